@@ -0,0 +1,116 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <SDL2/SDL.h>
+#include "arena.h"
+
+/*/////////////////////////////////////////////////////////////////////////////
+// Frame arena
+///////////////////////////////////////////////////////////////////////////////
+// One big block of memory for everything that only lives for a frame (or less),
+// handed out by bumping an offset. It's reset at the start of every frame, so
+// once it's allocated, frames don't need the heap at all, and the memory gets
+// used from the start of the block onwards.
+//
+// Geometry jobs allocate from it at the same time, so the offset is bumped with
+// an atomic add. Only reset and rewind it when no jobs are running.
+//
+// To reuse memory within a frame, take a mark before allocating scratch memory,
+// and rewind to the mark when the scratch memory isn't needed anymore.
+/////////////////////////////////////////////////////////////////////////////*/
+
+static uint8_t * arena_memory = NULL;
+static size_t arena_capacity = 0;
+static SDL_atomic_t arena_used;  // can go a little past arena_capacity when allocations fail
+static size_t arena_peak = 0;    // most ever used at once, as of the last reset or rewind
+
+bool init_frame_arena(size_t capacity)
+{
+    // Round the start up to a cache line too.
+    arena_memory = (uint8_t *)malloc(capacity + FRAME_ARENA_ALIGNMENT);
+    if (!arena_memory) {
+        fprintf(stderr, "Error: malloc failed for the frame arena.\n");
+        return false;
+    }
+
+    arena_capacity = capacity;
+    arena_peak = 0;
+    SDL_AtomicSet(&arena_used, 0);
+    return true;
+}
+
+void free_frame_arena(void)
+{
+    free(arena_memory);
+    arena_memory = NULL;
+    arena_capacity = 0;
+}
+
+static uint8_t * get_arena_start(void)
+{
+    uintptr_t start = (uintptr_t)arena_memory;
+    start = (start + FRAME_ARENA_ALIGNMENT - 1) & ~(uintptr_t)(FRAME_ARENA_ALIGNMENT - 1);
+    return (uint8_t *)start;
+}
+
+// Everything allocated before this mark stays, and everything after it is given back.
+void rewind_frame_arena(size_t mark)
+{
+    size_t used = (size_t)SDL_AtomicGet(&arena_used);
+    if (used > arena_capacity) {
+        used = arena_capacity;
+    }
+    if (used > arena_peak) {
+        arena_peak = used;
+    }
+
+    SDL_AtomicSet(&arena_used, (int)mark);
+}
+
+// Give back everything, at the start of a frame.
+void reset_frame_arena(void)
+{
+    rewind_frame_arena(0);
+}
+
+size_t get_frame_arena_mark(void)
+{
+    return (size_t)SDL_AtomicGet(&arena_used);
+}
+
+// Returns FRAME_ARENA_ALIGNMENT aligned memory that stays valid until the arena is
+// reset (or rewound to before it), or NULL if the arena is full. Safe to call from
+// several threads at once.
+void * frame_arena_alloc(size_t size)
+{
+    size_t aligned_size = (size + FRAME_ARENA_ALIGNMENT - 1) & ~(size_t)(FRAME_ARENA_ALIGNMENT - 1);
+    if (aligned_size > arena_capacity) {
+        return NULL;
+    }
+
+    // Once the arena is full, don't keep bumping the offset (it could overflow).
+    if ((size_t)SDL_AtomicGet(&arena_used) + aligned_size > arena_capacity) {
+        return NULL;
+    }
+
+    size_t offset = (size_t)SDL_AtomicAdd(&arena_used, (int)aligned_size);
+    if (offset + aligned_size > arena_capacity) {
+        return NULL;
+    }
+
+    return get_arena_start() + offset;
+}
+
+size_t get_frame_arena_peak(void)
+{
+    size_t used = get_frame_arena_mark();
+    if (used > arena_capacity) {
+        used = arena_capacity;
+    }
+    return (used > arena_peak) ? used : arena_peak;
+}
+
+size_t get_frame_arena_capacity(void)
+{
+    return arena_capacity;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Every allocation from the frame arena starts on its own cache line, so data written
+// by different threads never shares one.
+#define FRAME_ARENA_ALIGNMENT (64)
+
+// Sized for the geometry stage's worst case: one batch of triangles, about 8 MB (see
+// MESHLETS_PER_BATCH in main.c), which is still there while the render queue gets flushed.
+// That leaves about 8 MB for the rest. The instance sort takes 16 bytes per instance.
+// A full render queue's tile bins take 16 bytes per triangle, plus 4 bytes for each tile
+// a triangle touches, so they only fit if the triangles touch about 120 tiles each on
+// average; render_tiles() draws without tiles when they don't.
+#define FRAME_ARENA_SIZE (16 * 1024 * 1024)
+
+bool init_frame_arena(size_t capacity);
+void free_frame_arena(void);
+
+void reset_frame_arena(void);
+void * frame_arena_alloc(size_t size);
+
+size_t get_frame_arena_mark(void);
+void rewind_frame_arena(size_t mark);
+
+size_t get_frame_arena_peak(void);
+size_t get_frame_arena_capacity(void);
@@ -0,0 +1,367 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "bvh.h"
+#include "clipping.h"
+#include "mesh.h"
+#include "swap.h"
+
+/*/////////////////////////////////////////////////////////////////////////////
+// Scene bounding volume hierarchy
+///////////////////////////////////////////////////////////////////////////////
+// A binary tree of world space axis-aligned boxes. Each leaf holds up to
+// BVH_MAX_LEAF_OBJECTS instances, and every node's box holds all the boxes below
+// it. Culling starts at the root and only goes down into nodes whose box is at
+// least partly inside the frustum, so the cost follows how much of the scene is
+// visible, not how big the scene is.
+//
+// - Building: top down, splitting each node's instances in half at the median of
+//   their box centers along the longest axis. Done when instances are added.
+// - Refitting: when an instance moves, its leaf and the nodes above it are marked
+//   dirty, and the next update_scene_bvh() recomputes just those boxes. The
+//   tree's shape stays the same, so it's cheap, but it gets looser the further
+//   things move from where they were when it was built.
+// - Culling: a node that's completely inside a frustum plane doesn't get tested
+//   against that plane again anywhere below it.
+/////////////////////////////////////////////////////////////////////////////*/
+
+typedef struct {
+    vec3_t bounds_min;
+    vec3_t bounds_max;
+    int first;       // leaves: first entry in object_indices. Inner nodes: the first of the two child nodes
+    int num_objects; // 0 for inner nodes
+    int parent;      // -1 for the root
+    bool dirty;      // true when the box needs refitting
+} bvh_node_t;
+
+static bvh_node_t * nodes = NULL;
+static int num_nodes = 0;
+static int * object_indices = NULL; // instance indices, each leaf's next to each other
+static int * object_leaves = NULL;  // the leaf node each instance is in
+static int num_objects = 0;
+static bool needs_rebuild = true;
+
+// Only used while building.
+static vec3_t * object_centers = NULL;
+static int sort_axis = 0;
+
+// A frustum plane in world space: points p with dot(normal, p) >= distance are inside.
+typedef struct {
+    vec3_t normal;
+    float distance;
+} cull_plane_t;
+
+typedef struct {
+    cull_plane_t planes[NUM_FRUSTUM_PLANES];
+    vec3_t camera_position;
+    bvh_visit_function_t visit_function;
+    void * data;
+} cull_context_t;
+
+static float get_axis(vec3_t v, int axis)
+{
+    return (axis == 0) ? v.x : ((axis == 1) ? v.y : v.z);
+}
+
+static void grow_bounds(vec3_t * bounds_min, vec3_t * bounds_max, vec3_t other_min, vec3_t other_max)
+{
+    bounds_min->x = fminf(bounds_min->x, other_min.x);
+    bounds_min->y = fminf(bounds_min->y, other_min.y);
+    bounds_min->z = fminf(bounds_min->z, other_min.z);
+    bounds_max->x = fmaxf(bounds_max->x, other_max.x);
+    bounds_max->y = fmaxf(bounds_max->y, other_max.y);
+    bounds_max->z = fmaxf(bounds_max->z, other_max.z);
+}
+
+// Make the node's box the box around its instances' boxes.
+static void fit_leaf_bounds(bvh_node_t * node)
+{
+    for (int ii = 0; ii < node->num_objects; ii++) {
+        vec3_t bounds_min, bounds_max;
+        get_instance_world_bounds(get_instance(object_indices[node->first + ii]), &bounds_min, &bounds_max);
+
+        if (ii == 0) {
+            node->bounds_min = bounds_min;
+            node->bounds_max = bounds_max;
+        }
+        else {
+            grow_bounds(&node->bounds_min, &node->bounds_max, bounds_min, bounds_max);
+        }
+    }
+}
+
+static int compare_object_centers(const void * a, const void * b)
+{
+    int index_a = *(const int *)a;
+    int index_b = *(const int *)b;
+    float center_a = get_axis(object_centers[index_a], sort_axis);
+    float center_b = get_axis(object_centers[index_b], sort_axis);
+
+    if (center_a != center_b) {
+        return (center_a < center_b) ? -1 : 1;
+    }
+    // Break ties by instance index, so the tree comes out the same every time.
+    return index_a - index_b;
+}
+
+static void build_node(int node_index, int first, int count)
+{
+    bvh_node_t * node = &nodes[node_index];
+    node->first = first;
+    node->num_objects = count;
+    node->dirty = false;
+    fit_leaf_bounds(node);
+
+    if (count <= BVH_MAX_LEAF_OBJECTS) {
+        for (int ii = first; ii < first + count; ii++) {
+            object_leaves[object_indices[ii]] = node_index;
+        }
+        return;
+    }
+
+    // Split along the longest axis of the box around the instances' centers.
+    vec3_t centers_min = object_centers[object_indices[first]];
+    vec3_t centers_max = centers_min;
+    for (int ii = first + 1; ii < first + count; ii++) {
+        grow_bounds(&centers_min, &centers_max, object_centers[object_indices[ii]], object_centers[object_indices[ii]]);
+    }
+
+    vec3_t extent = vec3_sub(centers_max, centers_min);
+    sort_axis = (extent.x >= extent.y) ? ((extent.x >= extent.z) ? 0 : 2) : ((extent.y >= extent.z) ? 1 : 2);
+    qsort(&object_indices[first], count, sizeof(int), compare_object_centers);
+
+    // Splitting at the median keeps the tree balanced.
+    int first_child = num_nodes;
+    num_nodes += 2;
+
+    node->first = first_child;
+    node->num_objects = 0;
+    nodes[first_child].parent = node_index;
+    nodes[first_child + 1].parent = node_index;
+
+    build_node(first_child, first, count / 2);
+    build_node(first_child + 1, first + (count / 2), count - (count / 2));
+}
+
+static bool build_scene_bvh(void)
+{
+    num_objects = get_num_instances();
+    num_nodes = 0;
+
+    if (num_objects == 0) {
+        needs_rebuild = false;
+        return true;
+    }
+
+    // A binary tree with num_objects leaves or fewer has less than 2 * num_objects nodes.
+    bvh_node_t * new_nodes = (bvh_node_t *)realloc(nodes, 2 * num_objects * sizeof(bvh_node_t));
+    int * new_object_indices = (int *)realloc(object_indices, num_objects * sizeof(int));
+    int * new_object_leaves = (int *)realloc(object_leaves, num_objects * sizeof(int));
+    vec3_t * new_object_centers = (vec3_t *)realloc(object_centers, num_objects * sizeof(vec3_t));
+
+    nodes = (new_nodes != NULL) ? new_nodes : nodes;
+    object_indices = (new_object_indices != NULL) ? new_object_indices : object_indices;
+    object_leaves = (new_object_leaves != NULL) ? new_object_leaves : object_leaves;
+    object_centers = (new_object_centers != NULL) ? new_object_centers : object_centers;
+
+    if (!new_nodes || !new_object_indices || !new_object_leaves || !new_object_centers) {
+        fprintf(stderr, "Error: realloc failed for the scene BVH.\n");
+        num_objects = 0;
+        return false;
+    }
+
+    for (int instance_index = 0; instance_index < num_objects; instance_index++) {
+        vec3_t bounds_min, bounds_max;
+        get_instance_world_bounds(get_instance(instance_index), &bounds_min, &bounds_max);
+        object_centers[instance_index] = vec3_mul(vec3_add(bounds_min, bounds_max), 0.5);
+        object_indices[instance_index] = instance_index;
+    }
+
+    num_nodes = 1;
+    nodes[0].parent = -1;
+    build_node(0, 0, num_objects);
+
+    needs_rebuild = false;
+    return true;
+}
+
+// Meshes were added (or removed), so the next update_scene_bvh() builds the tree from scratch.
+void invalidate_scene_bvh(void)
+{
+    needs_rebuild = true;
+}
+
+// The instance's world matrix changed, so its leaf and every node above it need refitting.
+void mark_scene_bvh_object_moved(int instance_index)
+{
+    if (needs_rebuild || (instance_index < 0) || (instance_index >= num_objects)) {
+        // The instance isn't in the tree yet, and gets picked up by the rebuild.
+        return;
+    }
+
+    // Nodes above a dirty node are already dirty, so stop at the first one.
+    for (int node_index = object_leaves[instance_index];
+         (node_index >= 0) && ! nodes[node_index].dirty;
+         node_index = nodes[node_index].parent) {
+        nodes[node_index].dirty = true;
+    }
+}
+
+static void refit_node(int node_index)
+{
+    bvh_node_t * node = &nodes[node_index];
+    node->dirty = false;
+
+    if (node->num_objects > 0) {
+        fit_leaf_bounds(node);
+        return;
+    }
+
+    bvh_node_t * children = &nodes[node->first];
+    for (int child = 0; child < 2; child++) {
+        if (children[child].dirty) {
+            refit_node(node->first + child);
+        }
+    }
+
+    node->bounds_min = children[0].bounds_min;
+    node->bounds_max = children[0].bounds_max;
+    grow_bounds(&node->bounds_min, &node->bounds_max, children[1].bounds_min, children[1].bounds_max);
+}
+
+// Bring the tree up to date with the instances, before culling with it: rebuild it if
+// instances were added, otherwise refit the boxes of the instances that moved.
+bool update_scene_bvh(void)
+{
+    if (needs_rebuild) {
+        return build_scene_bvh();
+    }
+
+    if ((num_nodes > 0) && nodes[0].dirty) {
+        refit_node(0);
+    }
+    return true;
+}
+
+void free_scene_bvh(void)
+{
+    free(nodes);
+    free(object_indices);
+    free(object_leaves);
+    free(object_centers);
+    nodes = NULL;
+    object_indices = NULL;
+    object_leaves = NULL;
+    object_centers = NULL;
+    num_nodes = 0;
+    num_objects = 0;
+    needs_rebuild = true;
+}
+
+// Test a box against the frustum planes in plane_mask. Returns -1 if it's completely
+// outside any of them, otherwise plane_mask without the planes it's completely inside.
+static int test_box_planes(const cull_context_t * context, vec3_t bounds_min, vec3_t bounds_max, int plane_mask)
+{
+    for (int plane = 0; plane < NUM_FRUSTUM_PLANES; plane++) {
+        if (! (plane_mask & FRUSTUM_PLANE_BIT(plane))) {
+            continue;
+        }
+
+        // The box corner farthest along the plane's normal is the last one to go outside
+        // the plane, and the corner nearest along it is the first.
+        vec3_t normal = context->planes[plane].normal;
+        vec3_t farthest_corner = {
+            (normal.x >= 0) ? bounds_max.x : bounds_min.x,
+            (normal.y >= 0) ? bounds_max.y : bounds_min.y,
+            (normal.z >= 0) ? bounds_max.z : bounds_min.z,
+        };
+        vec3_t nearest_corner = {
+            (normal.x >= 0) ? bounds_min.x : bounds_max.x,
+            (normal.y >= 0) ? bounds_min.y : bounds_max.y,
+            (normal.z >= 0) ? bounds_min.z : bounds_max.z,
+        };
+
+        if (vec3_dot(normal, farthest_corner) < context->planes[plane].distance) {
+            return -1;
+        }
+        if (vec3_dot(normal, nearest_corner) >= context->planes[plane].distance) {
+            plane_mask &= ~FRUSTUM_PLANE_BIT(plane);
+        }
+    }
+
+    return plane_mask;
+}
+
+static float get_distance_squared_to_box_center(vec3_t point, const bvh_node_t * node)
+{
+    vec3_t center = vec3_mul(vec3_add(node->bounds_min, node->bounds_max), 0.5);
+    vec3_t offset = vec3_sub(center, point);
+    return vec3_dot(offset, offset);
+}
+
+static void cull_node(const cull_context_t * context, int node_index, int plane_mask)
+{
+    const bvh_node_t * node = &nodes[node_index];
+
+    if (plane_mask != 0) {
+        plane_mask = test_box_planes(context, node->bounds_min, node->bounds_max, plane_mask);
+        if (plane_mask < 0) {
+            return;
+        }
+    }
+
+    if (node->num_objects > 0) {
+        for (int ii = node->first; ii < node->first + node->num_objects; ii++) {
+            int instance_index = object_indices[ii];
+
+            if (plane_mask != 0) {
+                vec3_t bounds_min, bounds_max;
+                get_instance_world_bounds(get_instance(instance_index), &bounds_min, &bounds_max);
+                if (test_box_planes(context, bounds_min, bounds_max, plane_mask) < 0) {
+                    continue;
+                }
+            }
+
+            context->visit_function(instance_index, context->data);
+        }
+        return;
+    }
+
+    // Go into the nearer child first, so the instances come out roughly front to back, which
+    // lets the hierarchical z buffer reject more of the ones drawn later.
+    int near_child = node->first;
+    int far_child = node->first + 1;
+    if (get_distance_squared_to_box_center(context->camera_position, &nodes[far_child]) <
+        get_distance_squared_to_box_center(context->camera_position, &nodes[near_child])) {
+        int_swap(&near_child, &far_child);
+    }
+
+    cull_node(context, near_child, plane_mask);
+    cull_node(context, far_child, plane_mask);
+}
+
+// Call visit_function for every instance whose world space box is at least partly inside
+// the view frustum. update_scene_bvh() must have been called since the instances last changed.
+void cull_scene_bvh(const mat4_t * view_matrix, vec3_t camera_position,
+                    bvh_visit_function_t visit_function, void * data)
+{
+    if (num_nodes == 0) {
+        return;
+    }
+
+    cull_context_t context = {
+        .camera_position = camera_position,
+        .visit_function = visit_function,
+        .data = data,
+    };
+
+    plane_t world_planes[NUM_FRUSTUM_PLANES];
+    get_world_frustum_planes(view_matrix, world_planes);
+
+    for (int plane = 0; plane < NUM_FRUSTUM_PLANES; plane++) {
+        context.planes[plane].normal = world_planes[plane].normal;
+        context.planes[plane].distance = vec3_dot(world_planes[plane].point, world_planes[plane].normal);
+    }
+
+    cull_node(&context, 0, ALL_FRUSTUM_PLANES);
+}
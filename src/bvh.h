@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdbool.h>
+#include "gfx-vector.h"
+#include "matrix.h"
+
+// The scene BVH holds every instance's world space bounding box, so whole groups of instances
+// outside the view frustum can be skipped with a single test.
+#define BVH_MAX_LEAF_OBJECTS (4)
+
+// Called once for each instance whose bounds are at least partly inside the frustum.
+typedef void (*bvh_visit_function_t)(int instance_index, void * data);
+
+void invalidate_scene_bvh(void);
+void mark_scene_bvh_object_moved(int instance_index);
+bool update_scene_bvh(void);
+void free_scene_bvh(void);
+
+void cull_scene_bvh(const mat4_t * view_matrix, vec3_t camera_position,
+                    bvh_visit_function_t visit_function, void * data);
@@ -7,6 +7,7 @@ static camera_t camera = {
     .forward_velocity = {0, 0, 0},
     .yaw = 0.0,
     .pitch = 0.0,
+    .view_matrix_dirty = true,
 };
 
 void init_camera(vec3_t position, vec3_t direction)
@@ -16,6 +17,7 @@ void init_camera(vec3_t position, vec3_t direction)
     camera.forward_velocity = vec3_new(0,0,0);
     camera.yaw = 0.0;
     camera.pitch = 0.0;
+    camera.view_matrix_dirty = true;
 }
 
 vec3_t get_camera_position(void)
@@ -46,10 +48,12 @@ float get_camera_pitch(void)
 void update_camera_position(vec3_t position)
 {
     camera.position = position;
+    camera.view_matrix_dirty = true;
 }
 void update_camera_direction(vec3_t direction)
 {
     camera.direction = direction;
+    camera.view_matrix_dirty = true;
 }
 void update_camera_forward_velocity(vec3_t forward_velocity)
 {
@@ -59,11 +63,13 @@ void update_camera_forward_velocity(vec3_t forward_velocity)
 void rotate_camera_yaw(float angle)
 {
     camera.yaw += angle;
+    camera.view_matrix_dirty = true;
 }
 
 void rotate_camera_pitch(float angle)
 {
     camera.pitch += angle;
+    camera.view_matrix_dirty = true;
 }
 
 vec3_t get_camera_lookat_target(void)
@@ -88,4 +94,17 @@ vec3_t get_camera_lookat_target(void)
     target = vec3_add(camera.position, camera.direction);
 
     return target;
-}
\ No newline at end of file
+}
+
+mat4_t get_camera_view_matrix(void)
+{
+    if (camera.view_matrix_dirty) {
+        // Create the view matrix using the current camera position and target.
+        vec3_t target = get_camera_lookat_target();
+        vec3_t up_direction = {0, 1, 0}; // normalized y axis
+        camera.view_matrix = mat4_look_at(camera.position, target, up_direction);
+        camera.view_matrix_dirty = false;
+    }
+
+    return camera.view_matrix;
+}
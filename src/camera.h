@@ -1,12 +1,18 @@
 #pragma once
+#include <stdbool.h>
 #include "gfx-vector.h"
+#include "matrix.h"
 
+// The view matrix is cached: it only gets rebuilt after the camera position,
+// direction, yaw, or pitch changes.
 typedef struct {
     vec3_t position;
     vec3_t direction;
     vec3_t forward_velocity;
     float yaw;
     float pitch;
+    mat4_t view_matrix;
+    bool view_matrix_dirty;
 } camera_t;
 
 void init_camera(vec3_t position, vec3_t direction);
@@ -24,4 +30,5 @@ void update_camera_forward_velocity(vec3_t forward_velocity);
 void rotate_camera_yaw(float angle);
 void rotate_camera_pitch(float angle);
 
-vec3_t get_camera_lookat_target(void);
\ No newline at end of file
+vec3_t get_camera_lookat_target(void);
+mat4_t get_camera_view_matrix(void);
\ No newline at end of file
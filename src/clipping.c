@@ -1,9 +1,17 @@
 #include <stdio.h>
 #include "clipping.h"
+#include "simd.h"
 
-#define NUM_PLANES (6)
+#define NUM_PLANES (NUM_FRUSTUM_PLANES)
 plane_t frustum_planes[NUM_PLANES];
 
+// The left, right, top, and bottom planes of the guard band (indexed the same as the
+// frustum planes, which start with those four), which also go through the camera position.
+#define NUM_GUARD_BAND_PLANES (4)
+static plane_t guard_band_planes[NUM_GUARD_BAND_PLANES];
+
+static void init_outcode_planes(void);
+
 // Linear interpolation function aka "lerp".
 // Interpolate between a and b using interpolation factor t.
 float float_lerp(float a, float b, float t)
@@ -69,6 +77,211 @@ void init_frustum_planes(float fov_x, float fov_y, float z_near, float z_far)
     frustum_planes[FAR_FRUSTUM_PLANE].normal.x = 0;
     frustum_planes[FAR_FRUSTUM_PLANE].normal.y = 0;
     frustum_planes[FAR_FRUSTUM_PLANE].normal.z = -1;
+
+    // The guard band planes are the side planes for a field of view whose tangent is
+    // GUARD_BAND_SCALE times bigger, so the band is GUARD_BAND_SCALE times wider on screen.
+    float guard_band_fov_x = 2.0 * atan(GUARD_BAND_SCALE * tan(fov_x / 2));
+    float guard_band_fov_y = 2.0 * atan(GUARD_BAND_SCALE * tan(fov_y / 2));
+    float cos_half_guard_band_x = cos(guard_band_fov_x / 2);
+    float sin_half_guard_band_x = sin(guard_band_fov_x / 2);
+    float cos_half_guard_band_y = cos(guard_band_fov_y / 2);
+    float sin_half_guard_band_y = sin(guard_band_fov_y / 2);
+
+    guard_band_planes[LEFT_FRUSTUM_PLANE].point = vec3_new(0, 0, 0);
+    guard_band_planes[LEFT_FRUSTUM_PLANE].normal = vec3_new(cos_half_guard_band_x, 0, sin_half_guard_band_x);
+
+    guard_band_planes[RIGHT_FRUSTUM_PLANE].point = vec3_new(0, 0, 0);
+    guard_band_planes[RIGHT_FRUSTUM_PLANE].normal = vec3_new(-cos_half_guard_band_x, 0, sin_half_guard_band_x);
+
+    guard_band_planes[TOP_FRUSTUM_PLANE].point = vec3_new(0, 0, 0);
+    guard_band_planes[TOP_FRUSTUM_PLANE].normal = vec3_new(0, -cos_half_guard_band_y, sin_half_guard_band_y);
+
+    guard_band_planes[BOTTOM_FRUSTUM_PLANE].point = vec3_new(0, 0, 0);
+    guard_band_planes[BOTTOM_FRUSTUM_PLANE].normal = vec3_new(0, cos_half_guard_band_y, sin_half_guard_band_y);
+
+    init_outcode_planes();
+}
+
+// The frustum planes above are in camera space. Move them into world space, for
+// culling things before they're transformed, using the camera's view matrix
+// (which only rotates and translates). A camera space point c comes from a world
+// space point p as c = R*p + t, so p = transpose(R)*(c - t), and the normals
+// just get rotated by transpose(R).
+void get_world_frustum_planes(const mat4_t * view_matrix, plane_t world_planes[])
+{
+    const float (*m)[4] = view_matrix->m;
+
+    for (int plane = 0; plane < NUM_PLANES; plane++) {
+        vec3_t point = vec3_new(frustum_planes[plane].point.x - m[0][3],
+                                frustum_planes[plane].point.y - m[1][3],
+                                frustum_planes[plane].point.z - m[2][3]);
+        vec3_t normal = frustum_planes[plane].normal;
+
+        world_planes[plane].point.x = (m[0][0] * point.x) + (m[1][0] * point.y) + (m[2][0] * point.z);
+        world_planes[plane].point.y = (m[0][1] * point.x) + (m[1][1] * point.y) + (m[2][1] * point.z);
+        world_planes[plane].point.z = (m[0][2] * point.x) + (m[1][2] * point.y) + (m[2][2] * point.z);
+        world_planes[plane].normal.x = (m[0][0] * normal.x) + (m[1][0] * normal.y) + (m[2][0] * normal.z);
+        world_planes[plane].normal.y = (m[0][1] * normal.x) + (m[1][1] * normal.y) + (m[2][1] * normal.z);
+        world_planes[plane].normal.z = (m[0][2] * normal.x) + (m[1][2] * normal.y) + (m[2][2] * normal.z);
+    }
+}
+
+/*/////////////////////////////////////////////////////////////////////////////
+// Vertex outcodes
+///////////////////////////////////////////////////////////////////////////////
+// A vertex's outcode has a bit for each plane the vertex is outside of:
+// FRUSTUM_PLANE_BIT(plane) for the six frustum planes, and GUARD_BAND_BIT(plane)
+// for the four sides of the guard band. They're worked out once per vertex, and
+// then each triangle only needs to look at the outcodes of its three vertices.
+//
+// A point p is outside a plane when dot(p - plane.point, plane.normal) < 0, which
+// is the same as dot(p, plane.normal) < dot(plane.point, plane.normal).
+/////////////////////////////////////////////////////////////////////////////*/
+#define NUM_OUTCODE_PLANES (NUM_PLANES + NUM_GUARD_BAND_PLANES)
+
+typedef struct {
+    vec3_t normal;
+    float distance; // dot(plane.point, plane.normal)
+    outcode_t bit;
+} outcode_plane_t;
+
+static outcode_plane_t outcode_planes[NUM_OUTCODE_PLANES];
+
+static void init_outcode_planes(void)
+{
+    for (int plane = 0; plane < NUM_PLANES; plane++) {
+        outcode_planes[plane].normal = frustum_planes[plane].normal;
+        outcode_planes[plane].distance = vec3_dot(frustum_planes[plane].point, frustum_planes[plane].normal);
+        outcode_planes[plane].bit = FRUSTUM_PLANE_BIT(plane);
+    }
+
+    for (int plane = 0; plane < NUM_GUARD_BAND_PLANES; plane++) {
+        outcode_plane_t * outcode_plane = &outcode_planes[NUM_PLANES + plane];
+        outcode_plane->normal = guard_band_planes[plane].normal;
+        outcode_plane->distance = vec3_dot(guard_band_planes[plane].point, guard_band_planes[plane].normal);
+        outcode_plane->bit = GUARD_BAND_BIT(plane);
+    }
+}
+
+// Work out the outcodes for a batch of camera space points, SIMD_WIDTH points at a
+// time (see simd.h), with the last few points done one at a time using the same math.
+void compute_outcodes(const vec3_soa_t * points, outcode_t * outcodes, int count)
+{
+    int ii = 0;
+
+#if SIMD_WIDTH > 1
+    for (; ii + SIMD_WIDTH <= count; ii += SIMD_WIDTH) {
+        simd_float_t x = simd_load(&points->x[ii]);
+        simd_float_t y = simd_load(&points->y[ii]);
+        simd_float_t z = simd_load(&points->z[ii]);
+        simd_int_t codes = simd_int_set1(0);
+
+        for (int plane = 0; plane < NUM_OUTCODE_PLANES; plane++) {
+            const outcode_plane_t * outcode_plane = &outcode_planes[plane];
+            simd_float_t dot = simd_add(simd_add(simd_mul(simd_set1(outcode_plane->normal.x), x),
+                                                 simd_mul(simd_set1(outcode_plane->normal.y), y)),
+                                        simd_mul(simd_set1(outcode_plane->normal.z), z));
+            simd_int_t is_outside = simd_as_int(simd_cmplt(dot, simd_set1(outcode_plane->distance)));
+            codes = simd_int_or(codes, simd_int_and(is_outside, simd_int_set1(outcode_plane->bit)));
+        }
+
+        int lane_codes[SIMD_WIDTH];
+        simd_int_store(lane_codes, codes);
+        for (int lane = 0; lane < SIMD_WIDTH; lane++) {
+            outcodes[ii + lane] = (outcode_t)lane_codes[lane];
+        }
+    }
+#endif
+
+    for (; ii < count; ii++) {
+        outcode_t code = 0;
+
+        for (int plane = 0; plane < NUM_OUTCODE_PLANES; plane++) {
+            const outcode_plane_t * outcode_plane = &outcode_planes[plane];
+            float dot = (outcode_plane->normal.x * points->x[ii])
+                      + (outcode_plane->normal.y * points->y[ii])
+                      + (outcode_plane->normal.z * points->z[ii]);
+            if (dot < outcode_plane->distance) {
+                code |= outcode_plane->bit;
+            }
+        }
+
+        outcodes[ii] = code;
+    }
+}
+
+/*/////////////////////////////////////////////////////////////////////////////
+// Which planes does a triangle need clipping against?
+///////////////////////////////////////////////////////////////////////////////
+// Takes the outcodes of the triangle's three vertices, and returns a mask of
+// FRUSTUM_PLANE_BIT()s for clip_polygon(), or -1 if all three vertices are
+// outside the same frustum plane, so there's nothing to draw (trivial reject).
+//   - The near and far planes are only needed if the triangle crosses them.
+//   - The left, right, top, and bottom planes are only needed if the triangle
+//     pokes out of the guard band. Inside it, the parts of the triangle that are
+//     off the screen get skipped by the rasterizer instead (guard-band clipping).
+// Most triangles don't need any clipping at all, and get a mask of 0 (trivial
+// accept).
+/////////////////////////////////////////////////////////////////////////////*/
+// Turn the outcode bits that are set for every vertex (all_outside) and for any vertex
+// (any_outside) into the mask get_triangle_clip_planes() returns.
+static int clip_planes_from_outcodes(int all_outside, int any_outside)
+{
+    if (all_outside & ALL_FRUSTUM_PLANES) {
+        return -1;
+    }
+
+    int clip_planes = any_outside & (FRUSTUM_PLANE_BIT(NEAR_FRUSTUM_PLANE) | FRUSTUM_PLANE_BIT(FAR_FRUSTUM_PLANE));
+
+    for (int plane = 0; plane < NUM_GUARD_BAND_PLANES; plane++) {
+        if (any_outside & GUARD_BAND_BIT(plane)) {
+            clip_planes |= FRUSTUM_PLANE_BIT(plane);
+        }
+    }
+
+    return clip_planes;
+}
+
+int get_triangle_clip_planes(outcode_t outcode0, outcode_t outcode1, outcode_t outcode2)
+{
+    return clip_planes_from_outcodes(outcode0 & outcode1 & outcode2, outcode0 | outcode1 | outcode2);
+}
+
+// Same as get_triangle_clip_planes(), for any number of points, like the corners of a
+// bounding box. Everything inside the points' convex hull needs at most these planes.
+int get_points_clip_planes(const outcode_t * outcodes, int count)
+{
+    int all_outside = ~0;
+    int any_outside = 0;
+
+    for (int ii = 0; ii < count; ii++) {
+        all_outside &= outcodes[ii];
+        any_outside |= outcodes[ii];
+    }
+
+    return clip_planes_from_outcodes(all_outside, any_outside);
+}
+
+// Same as get_triangle_clip_planes(), for everything inside a camera space sphere.
+// The sphere is all outside a plane when its center is more than radius behind it,
+// and partly outside when its center is less than radius in front of it.
+int get_sphere_clip_planes(vec3_t center, float radius)
+{
+    int all_outside = 0;
+    int any_outside = 0;
+
+    for (int plane = 0; plane < NUM_OUTCODE_PLANES; plane++) {
+        const outcode_plane_t * outcode_plane = &outcode_planes[plane];
+        float distance = vec3_dot(center, outcode_plane->normal) - outcode_plane->distance;
+        if (distance < -radius) {
+            all_outside |= outcode_plane->bit;
+        }
+        if (distance < radius) {
+            any_outside |= outcode_plane->bit;
+        }
+    }
+
+    return clip_planes_from_outcodes(all_outside, any_outside);
 }
 
 polygon_t create_polygon_from_triangle(vec3_t v0, vec3_t v1, vec3_t v2, tex2_t t0, tex2_t t1, tex2_t t2)
@@ -198,14 +411,14 @@ void clip_polygon_against_plane(polygon_t * polygon, int plane)
     polygon->num_vertices = num_inside_vertices;
 }
 
-bool clip_polygon(polygon_t *polygon)
+// Clip the polygon against the frustum planes in plane_mask (see get_triangle_clip_planes()).
+bool clip_polygon(polygon_t *polygon, int plane_mask)
 {
-    clip_polygon_against_plane(polygon, LEFT_FRUSTUM_PLANE);
-    clip_polygon_against_plane(polygon, RIGHT_FRUSTUM_PLANE);
-    clip_polygon_against_plane(polygon, TOP_FRUSTUM_PLANE);
-    clip_polygon_against_plane(polygon, BOTTOM_FRUSTUM_PLANE);
-    clip_polygon_against_plane(polygon, NEAR_FRUSTUM_PLANE);
-    clip_polygon_against_plane(polygon, FAR_FRUSTUM_PLANE);
+    for (int plane = LEFT_FRUSTUM_PLANE; plane <= FAR_FRUSTUM_PLANE; plane++) {
+        if (plane_mask & FRUSTUM_PLANE_BIT(plane)) {
+            clip_polygon_against_plane(polygon, plane);
+        }
+    }
 
     return true;
 }
@@ -1,14 +1,18 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <math.h>
 #include "gfx-vector.h"
+#include "matrix.h"
 #include "triangle.h"
 
 // 10 is a hacky limit, but an effective one.
 #define MAX_NUM_POLY_VERTICES (10)
 #define MAX_NUM_POLY_TRIANGLES (10)
 
+#define NUM_FRUSTUM_PLANES (6)
+
 enum {
     LEFT_FRUSTUM_PLANE,
     RIGHT_FRUSTUM_PLANE,
@@ -18,6 +22,21 @@ enum {
     FAR_FRUSTUM_PLANE,
 };
 
+// Bit masks of frustum planes, used to say which planes to clip against.
+#define FRUSTUM_PLANE_BIT(plane) (1 << (plane))
+#define ALL_FRUSTUM_PLANES (0x3F)
+
+// Vertex outcodes have a FRUSTUM_PLANE_BIT() for each frustum plane the vertex is outside
+// of, plus a GUARD_BAND_BIT() for each side of the guard band it's outside of.
+#define GUARD_BAND_BIT(plane) (1 << (6 + (plane)))
+typedef uint16_t outcode_t;
+
+// The guard band is this many times wider and taller than the view, centered on it.
+// Triangles that stay inside it don't need clipping against the left, right, top, and
+// bottom planes, since the rasterizer only draws the pixels on the screen anyway.
+// It's small enough that projected points stay well inside the rasterizer's int range.
+#define GUARD_BAND_SCALE (4.0)
+
 typedef struct {
     vec3_t point;
     vec3_t normal;
@@ -30,8 +49,13 @@ typedef struct {
 } polygon_t;
 
 void init_frustum_planes(float fov_x, float fov_y, float z_near, float z_far);
+void get_world_frustum_planes(const mat4_t * view_matrix, plane_t world_planes[]);
 
 polygon_t create_polygon_from_triangle(vec3_t v0, vec3_t v1, vec3_t v2, tex2_t t0, tex2_t t1, tex2_t t2);
 
-bool clip_polygon(polygon_t *polygon);
+void compute_outcodes(const vec3_soa_t * points, outcode_t * outcodes, int count);
+int get_triangle_clip_planes(outcode_t outcode0, outcode_t outcode1, outcode_t outcode2);
+int get_points_clip_planes(const outcode_t * outcodes, int count);
+int get_sphere_clip_planes(vec3_t center, float radius);
+bool clip_polygon(polygon_t *polygon, int plane_mask);
 bool triangles_from_polygon(polygon_t *polygon, triangle_t triangles[], int *num_triangles);
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include "display.h"
+#include "simd.h"
 
 static SDL_Window * window = NULL;
 static SDL_Renderer * renderer = NULL;
@@ -8,6 +9,13 @@ static uint32_t * color_buffer = NULL;
 
 static float * z_buffer = NULL;
 
+// The hierarchical z buffer has one entry per HI_Z_BLOCK_SIZE x HI_Z_BLOCK_SIZE block
+// of the z buffer, holding the farthest depth in that block. It's allowed to be too far
+// (which only makes it less useful), but never too near.
+static float * hi_z_buffer = NULL;
+static int hi_z_width = 0;  // in blocks
+static int hi_z_height = 0; // in blocks
+
 static int window_width = 800;
 static int window_height = 600;
 
@@ -23,6 +31,13 @@ int get_window_height(void)
     return window_height;
 }
 
+// The rectangle covering the whole window.
+screen_rect_t get_screen_rect(void)
+{
+    screen_rect_t rect = { 0, 0, window_width, window_height };
+    return rect;
+}
+
 bool initialize_window(void)
 {
     if (SDL_Init(SDL_INIT_EVERYTHING) != 0) {
@@ -85,6 +100,15 @@ bool initialize_window(void)
         return false;
     }
 
+    hi_z_width = (window_width + HI_Z_BLOCK_SIZE - 1) / HI_Z_BLOCK_SIZE;
+    hi_z_height = (window_height + HI_Z_BLOCK_SIZE - 1) / HI_Z_BLOCK_SIZE;
+    hi_z_buffer = (float *)malloc(hi_z_width * hi_z_height * sizeof(float));
+
+    if (!hi_z_buffer) {
+        fprintf(stderr, "Error: malloc failed for hi_z_buffer.\n");
+        return false;
+    }
+
     // Create a texture buffer that displays the color buffer.
     color_buffer_texture = SDL_CreateTexture(
         renderer,
@@ -111,46 +135,105 @@ void draw_pixel(int x, int y, uint32_t color)
     }
 }
 
-void clear_color_buffer(uint32_t color)
+void clear_color_buffer(uint32_t color, const screen_rect_t * rect)
 {
-    for (int y = 0; y < window_height; y++) {
-        for (int x = 0; x < window_width; x++) {
+    for (int y = rect->y_min; y < rect->y_max; y++) {
+        for (int x = rect->x_min; x < rect->x_max; x++) {
             draw_pixel(x, y, color);
         }
     }
 }
 
-void clear_z_buffer(void)
+void clear_z_buffer(const screen_rect_t * rect)
 {
     // Note that we clear the z buffer by setting the values to 1.0.
     // Since we use 1/w (the inverted depth value) instead of the non-inverted
     // depth (because 1/w is linear, but w is not), 1.0 is maximum depth,
     // not 0.0.
-    for (int y = 0; y < window_height; y++) {
-        for (int x = 0; x < window_width; x++) {
+    for (int y = rect->y_min; y < rect->y_max; y++) {
+        for (int x = rect->x_min; x < rect->x_max; x++) {
             z_buffer[(y * window_width) + x] = 1.0;
         }
     }
+
+    // Every block the rectangle touches gets the maximum depth. For blocks only partly
+    // inside the rectangle that may be farther than their real farthest depth, which is
+    // fine.
+    int first_column = rect->x_min / HI_Z_BLOCK_SIZE;
+    int first_row = rect->y_min / HI_Z_BLOCK_SIZE;
+    int last_column = (rect->x_max - 1) / HI_Z_BLOCK_SIZE;
+    int last_row = (rect->y_max - 1) / HI_Z_BLOCK_SIZE;
+
+    for (int row = first_row; row <= last_row; row++) {
+        for (int column = first_column; column <= last_column; column++) {
+            hi_z_buffer[(row * hi_z_width) + column] = 1.0;
+        }
+    }
 }
 
-float get_zbuffer_at(int x, int y)
+// Direct access to the color and z buffers, for the rasterizer's inner loops.
+// Both are window_width * window_height large, one row after another. Callers must
+// stay inside the window themselves, since there's no bounds checking.
+uint32_t * get_color_buffer(void)
 {
-    float value = 1.0;
+    return color_buffer;
+}
 
-    if (    (x >= 0) && (x < window_width)
-         && (y >= 0) && (y < window_height)) {
-            value = z_buffer[(window_width * y) + x];
-    }
-    return value;
+float * get_z_buffer(void)
+{
+    return z_buffer;
 }
 
-void update_zbuffer_at(int x, int y, float value)
+// Direct access to the hierarchical z buffer, which is get_hi_z_width() blocks wide,
+// one row of blocks after another. There's no bounds checking.
+float * get_hi_z_buffer(void)
 {
+    return hi_z_buffer;
+}
 
-    if (    (x >= 0) && (x < window_width)
-         && (y >= 0) && (y < window_height)) {
-            z_buffer[(window_width * y) + x] = value;
+int get_hi_z_width(void)
+{
+    return hi_z_width;
+}
+
+// Recompute the farthest depth of a block from the z buffer, after drawing into the block
+// through get_z_buffer(). Drawing only ever brings depths nearer, so the block's entry
+// was still safe to use before this, just not as useful.
+void update_hi_z_block(int column, int row)
+{
+    int x_min = column * HI_Z_BLOCK_SIZE;
+    int y_min = row * HI_Z_BLOCK_SIZE;
+    float farthest_depth = 0.0;
+
+#if SIMD_WIDTH > 1
+    if ((x_min + HI_Z_BLOCK_SIZE <= window_width) && (y_min + HI_Z_BLOCK_SIZE <= window_height)) {
+        simd_float_t farthest = simd_set1(0.0f);
+        for (int y = y_min; y < y_min + HI_Z_BLOCK_SIZE; y++) {
+            for (int x = x_min; x < x_min + HI_Z_BLOCK_SIZE; x += SIMD_WIDTH) {
+                farthest = simd_max(farthest, simd_load(&z_buffer[(y * window_width) + x]));
+            }
+        }
+
+        float lanes[SIMD_WIDTH];
+        simd_store(lanes, farthest);
+        for (int lane = 0; lane < SIMD_WIDTH; lane++) {
+            farthest_depth = (lanes[lane] > farthest_depth) ? lanes[lane] : farthest_depth;
+        }
+
+        hi_z_buffer[(row * hi_z_width) + column] = farthest_depth;
+        return;
+    }
+#endif
+
+    // Blocks at the right and bottom edges can be partly outside the window.
+    for (int y = y_min; (y < y_min + HI_Z_BLOCK_SIZE) && (y < window_height); y++) {
+        for (int x = x_min; (x < x_min + HI_Z_BLOCK_SIZE) && (x < window_width); x++) {
+            float depth = z_buffer[(y * window_width) + x];
+            farthest_depth = (depth > farthest_depth) ? depth : farthest_depth;
+        }
     }
+
+    hi_z_buffer[(row * hi_z_width) + column] = farthest_depth;
 }
 
 void render_color_buffer(void)
@@ -171,24 +254,31 @@ void render_color_buffer(void)
     SDL_RenderPresent(renderer);
 }
 
-void draw_grid(void)
+void draw_grid(const screen_rect_t * rect)
 {
     const int x_incr = 10;
     const int y_incr = 10;
     const uint32_t color = 0xFF555555;
 
-    for (int x=0; x < window_width; x += x_incr) {
-        for (int y=0; y < window_height; y += y_incr) {
+    // Start at the first grid line inside the rectangle.
+    int x_first = ((rect->x_min + x_incr - 1) / x_incr) * x_incr;
+    int y_first = ((rect->y_min + y_incr - 1) / y_incr) * y_incr;
+
+    for (int x = x_first; x < rect->x_max; x += x_incr) {
+        for (int y = y_first; y < rect->y_max; y += y_incr) {
             draw_pixel(x, y, color);
         }
     }
 }
 
-void draw_rect(int rect_x, int rect_y, int width, int height, uint32_t color)
+void draw_rect(int rect_x, int rect_y, int width, int height, uint32_t color, const screen_rect_t * clip_rect)
 {
     for (int x = rect_x; x < (rect_x + width); x++) {
         for (int y = rect_y; y < (rect_y + height); y++) {
-            draw_pixel(x, y, color);
+            if (    (x >= clip_rect->x_min) && (x < clip_rect->x_max)
+                 && (y >= clip_rect->y_min) && (y < clip_rect->y_max)) {
+                draw_pixel(x, y, color);
+            }
         }
     }
 }
@@ -212,11 +302,16 @@ void destroy_window(void)
         z_buffer = NULL;
     }
 
+    if (hi_z_buffer) {
+        free(hi_z_buffer);
+        hi_z_buffer = NULL;
+    }
+
     SDL_Quit();
 }
 
 
-void draw_line(int x0, int y0, int x1, int y1, uint32_t color)
+void draw_line(int x0, int y0, int x1, int y1, uint32_t color, const screen_rect_t * clip_rect)
 {
     // Draw a line between two points using the DDA algorithm.
     int delta_x = x1 - x0;
@@ -231,15 +326,20 @@ void draw_line(int x0, int y0, int x1, int y1, uint32_t color)
     float current_x = x0;
     float current_y = y0;
     for (int ii=0; ii <= longest_side_length; ii++) {
-        draw_pixel(round(current_x), round(current_y), color);
+        int x = round(current_x);
+        int y = round(current_y);
+        if (    (x >= clip_rect->x_min) && (x < clip_rect->x_max)
+             && (y >= clip_rect->y_min) && (y < clip_rect->y_max)) {
+            draw_pixel(x, y, color);
+        }
         current_x += inc_x;
         current_y += inc_y;
     }
 }
 
-void draw_triangle(int x0, int y0, int x1, int y1, int x2, int y2, uint32_t color)
+void draw_triangle(int x0, int y0, int x1, int y1, int x2, int y2, uint32_t color, const screen_rect_t * clip_rect)
 {
-    draw_line(x0, y0, x1, y1, color);
-    draw_line(x1, y1, x2, y2, color);
-    draw_line(x2, y2, x0, y0, color);
+    draw_line(x0, y0, x1, y1, color, clip_rect);
+    draw_line(x1, y1, x2, y2, color, clip_rect);
+    draw_line(x2, y2, x0, y0, color, clip_rect);
 }
@@ -8,20 +8,39 @@
 #define FPS (60)
 #define FRAME_TARGET_TIME_MS (1000 / FPS)
 
+// The hierarchical z buffer keeps the farthest depth of each block of this many
+// pixels square, so whole blocks can be tested against a triangle's nearest depth.
+#define HI_Z_BLOCK_SIZE (8)
+
+// A rectangle of screen pixels, from (x_min, y_min) up to but not including (x_max, y_max).
+// Drawing functions only touch the pixels inside the rectangle they're given, which lets
+// the screen be split into tiles that get drawn independently.
+typedef struct {
+    int x_min;
+    int y_min;
+    int x_max;
+    int y_max;
+} screen_rect_t;
+
 bool initialize_window(void);
 int get_window_width(void);
 int get_window_height(void);
+screen_rect_t get_screen_rect(void);
 void draw_pixel(int x, int y, uint32_t color);
-void clear_color_buffer(uint32_t color);
-void clear_z_buffer(void);
+void clear_color_buffer(uint32_t color, const screen_rect_t * rect);
+void clear_z_buffer(const screen_rect_t * rect);
+
+uint32_t * get_color_buffer(void);
+float * get_z_buffer(void);
 
-float get_zbuffer_at(int x, int y);
-void update_zbuffer_at(int x, int y, float value);
+float * get_hi_z_buffer(void);
+int get_hi_z_width(void);
+void update_hi_z_block(int column, int row);
 
 void render_color_buffer(void);
-void draw_grid(void);
-void draw_rect(int rect_x, int rect_y, int width, int height, uint32_t color);
+void draw_grid(const screen_rect_t * rect);
+void draw_rect(int rect_x, int rect_y, int width, int height, uint32_t color, const screen_rect_t * clip_rect);
 void destroy_window(void);
 
-void draw_line(int x0, int y0, int x1, int y1, uint32_t color);
-void draw_triangle(int x0, int y0, int x1, int y1, int x2, int y2, uint32_t color);
\ No newline at end of file
+void draw_line(int x0, int y0, int x1, int y1, uint32_t color, const screen_rect_t * clip_rect);
+void draw_triangle(int x0, int y0, int x1, int y1, int x2, int y2, uint32_t color, const screen_rect_t * clip_rect);
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include <math.h>
+#include <stdlib.h>
 #include "gfx-vector.h"
 
 vec2_t vec2_new(float x, float y)
@@ -191,4 +192,46 @@ vec2_t vec2_from_vec4(vec4_t v)
 {
     vec2_t result = {v.x, v.y};
     return result;
-}
\ No newline at end of file
+}
+
+bool vec3_soa_alloc(vec3_soa_t * soa, int count)
+{
+    soa->x = (float *)malloc(count * sizeof(float));
+    soa->y = (float *)malloc(count * sizeof(float));
+    soa->z = (float *)malloc(count * sizeof(float));
+
+    if (!soa->x || !soa->y || !soa->z) {
+        vec3_soa_free(soa);
+        return false;
+    }
+    return true;
+}
+
+void vec3_soa_free(vec3_soa_t * soa)
+{
+    free(soa->x);
+    free(soa->y);
+    free(soa->z);
+    soa->x = soa->y = soa->z = NULL;
+}
+
+bool vec3_i16_soa_alloc(vec3_i16_soa_t * soa, int count)
+{
+    soa->x = (int16_t *)malloc(count * sizeof(int16_t));
+    soa->y = (int16_t *)malloc(count * sizeof(int16_t));
+    soa->z = (int16_t *)malloc(count * sizeof(int16_t));
+
+    if (!soa->x || !soa->y || !soa->z) {
+        vec3_i16_soa_free(soa);
+        return false;
+    }
+    return true;
+}
+
+void vec3_i16_soa_free(vec3_i16_soa_t * soa)
+{
+    free(soa->x);
+    free(soa->y);
+    free(soa->z);
+    soa->x = soa->y = soa->z = NULL;
+}
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
+
 typedef struct 
 {
     float x;
@@ -21,6 +24,31 @@ typedef struct
     float w;
 } vec4_t;
 
+// Struct-of-arrays vertex streams: component x of vertex n is x[n], and so on.
+// Keeping each component in its own array lets SIMD code load several vertices at once.
+typedef struct
+{
+    float * x;
+    float * y;
+    float * z;
+} vec3_soa_t;
+
+typedef struct
+{
+    float * x;
+    float * y;
+    float * z;
+    float * w;
+} vec4_soa_t;
+
+// 16-bit vertex stream for compact meshes, see COMPACT_MESH_STORAGE in mesh.h.
+typedef struct
+{
+    int16_t * x;
+    int16_t * y;
+    int16_t * z;
+} vec3_i16_soa_t;
+
 vec2_t vec2_new(float x, float y);
 float vec2_length(vec2_t v);
 vec2_t vec2_add(vec2_t a, vec2_t b);
@@ -49,4 +77,9 @@ vec3_t vec3_from_vec4(vec4_t v);
 
 vec4_t vec4_from_vec3(vec3_t v);
 
-vec2_t vec2_from_vec4(vec4_t v);
\ No newline at end of file
+vec2_t vec2_from_vec4(vec4_t v);
+
+bool vec3_soa_alloc(vec3_soa_t * soa, int count);
+void vec3_soa_free(vec3_soa_t * soa);
+bool vec3_i16_soa_alloc(vec3_i16_soa_t * soa, int count);
+void vec3_i16_soa_free(vec3_i16_soa_t * soa);
\ No newline at end of file
@@ -0,0 +1,805 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "array.h"
+#include "lod.h"
+
+/*/////////////////////////////////////////////////////////////////////////////
+// Mesh simplification
+///////////////////////////////////////////////////////////////////////////////
+// Levels of detail are made by collapsing edges one at a time, cheapest first,
+// using quadric error metrics (Garland and Heckbert, "Surface Simplification
+// Using Quadric Error Metrics"): every vertex keeps the sum of the squared
+// distances to the planes of the faces around it, so moving it anywhere gives a
+// cheap estimate of how far the surface moved.
+//
+// The collapses are half-edge collapses: vertex "from" moves onto its neighbor
+// "to" and goes away, so no new positions are made up, and no new UVs either.
+// The faces around "from" take the corner (vertex and UV) that "to" has in a face
+// they share the edge with, picking the face with the same UV at "from". When
+// "from" is on a UV seam and the edge doesn't run along the seam, one side of the
+// seam has no such face, and the collapse isn't done. That keeps the seams, and
+// the texture mapping with them, intact.
+//
+// Vertices at the same position are welded together while simplifying, so meshes
+// split into one vertex per UV (like crab.obj) aren't treated as being full of
+// holes. Edges on UV seams and the real open edges of the mesh get extra planes
+// at right angles to their face, so they hold their shape.
+/////////////////////////////////////////////////////////////////////////////*/
+
+// The upper half of a quadric's symmetric 4x4 matrix: xx xy xz xw yy yz yw zz zw ww,
+// and the total weight of the planes in it.
+typedef struct {
+    double q[10];
+    double weight;
+} quadric_t;
+
+// A face's corner: the level 0 vertex and the UV it has there.
+typedef struct {
+    int vertex;
+    tex2_t uv;
+} corner_t;
+
+typedef struct {
+    corner_t corners[3];
+    uint32_t color;
+    bool removed;
+} lod_face_t;
+
+// A candidate collapse of welded vertex "from" onto welded vertex "to". It's stale,
+// and gets skipped, if either vertex changed since it was queued.
+typedef struct {
+    double cost;  // the combined quadric's error
+    double error; // the same, per unit of plane weight: about the squared distance moved
+    int from;
+    int to;
+    int from_version;
+    int to_version;
+} collapse_t;
+
+// Another welded vertex sharing faces with the one being looked at.
+typedef struct {
+    int vertex;
+    int num_faces; // 1 means the edge between them is on an open edge of the mesh
+} neighbor_t;
+
+// Which corner the faces around "from" get instead of theirs.
+typedef struct {
+    corner_t from;
+    corner_t to;
+} wedge_t;
+
+// Only used while building the levels of a mesh.
+static const vec3_t * source_vertices = NULL; // level 0's
+static int num_source_vertices = 0;
+static int * welded_indices = NULL;      // each level 0 vertex's welded vertex
+static vec3_t * welded_positions = NULL;
+static quadric_t * quadrics = NULL;
+static int ** welded_faces = NULL;       // dynamic arrays of the faces around each welded vertex
+static bool * welded_removed = NULL;
+static int * welded_versions = NULL;
+static int num_welded = 0;
+static lod_face_t * lod_faces = NULL;
+static int num_lod_faces = 0;
+static int num_live_faces = 0;
+
+static collapse_t * heap = NULL; // min-heap on cost
+static int heap_length = 0;
+static int heap_capacity = 0;
+
+// Scratch space for checking a collapse, grown as needed.
+static neighbor_t * from_neighbors = NULL;
+static int from_neighbors_capacity = 0;
+static neighbor_t * to_neighbors = NULL;
+static int to_neighbors_capacity = 0;
+static wedge_t * wedges = NULL;
+static int wedges_capacity = 0;
+static int num_wedges = 0;
+static int * vertex_remap = NULL; // level 0 vertex to the vertex of the level being made
+
+// Make sure buffer has room for count items.
+static bool reserve(void ** buffer, int * capacity, int count, size_t item_size)
+{
+    if (count <= *capacity) {
+        return true;
+    }
+
+    int new_capacity = (*capacity > 0) ? *capacity : 16;
+    while (new_capacity < count) {
+        new_capacity *= 2;
+    }
+
+    void * new_buffer = realloc(*buffer, new_capacity * item_size);
+    if (!new_buffer) {
+        return false;
+    }
+    *buffer = new_buffer;
+    *capacity = new_capacity;
+    return true;
+}
+
+static quadric_t make_plane_quadric(vec3_t normal, float distance, double weight)
+{
+    // The plane is dot(normal, p) + distance = 0, and the quadric is weight times the
+    // outer product of (normal, distance) with itself.
+    double a = normal.x, b = normal.y, c = normal.z, d = distance;
+    quadric_t quadric = {{
+        weight * a * a, weight * a * b, weight * a * c, weight * a * d,
+        weight * b * b, weight * b * c, weight * b * d,
+        weight * c * c, weight * c * d,
+        weight * d * d,
+    }, weight };
+    return quadric;
+}
+
+static void add_quadric(quadric_t * quadric, const quadric_t * other)
+{
+    for (int ii = 0; ii < 10; ii++) {
+        quadric->q[ii] += other->q[ii];
+    }
+    quadric->weight += other->weight;
+}
+
+// The weighted sum of the squared distances from p to the quadric's planes.
+static double get_quadric_error(const quadric_t * quadric, vec3_t p)
+{
+    const double * q = quadric->q;
+    double x = p.x, y = p.y, z = p.z;
+    double error = (q[0] * x * x) + (2.0 * q[1] * x * y) + (2.0 * q[2] * x * z) + (2.0 * q[3] * x)
+                 + (q[4] * y * y) + (2.0 * q[5] * y * z) + (2.0 * q[6] * y)
+                 + (q[7] * z * z) + (2.0 * q[8] * z)
+                 + q[9];
+    return (error > 0.0) ? error : 0.0;
+}
+
+static bool corners_match(corner_t a, corner_t b)
+{
+    return (a.vertex == b.vertex) && (a.uv.u == b.uv.u) && (a.uv.v == b.uv.v);
+}
+
+static int get_welded(const lod_face_t * face, int corner)
+{
+    return welded_indices[face->corners[corner].vertex];
+}
+
+// Which corner of the face is at the welded vertex, or -1 if none is.
+static int find_corner(const lod_face_t * face, int welded)
+{
+    for (int corner = 0; corner < 3; corner++) {
+        if (get_welded(face, corner) == welded) {
+            return corner;
+        }
+    }
+    return -1;
+}
+
+// The (not normalized) normal of the face, with one of its corners moved to position.
+static vec3_t get_face_normal(const lod_face_t * face, int moved_corner, vec3_t position)
+{
+    vec3_t points[3];
+    for (int corner = 0; corner < 3; corner++) {
+        points[corner] = (corner == moved_corner) ? position : welded_positions[get_welded(face, corner)];
+    }
+    return vec3_cross(vec3_sub(points[1], points[0]), vec3_sub(points[2], points[0]));
+}
+
+/*/////////////////////////////////////////////////////////////////////////////
+// Collapse queue
+/////////////////////////////////////////////////////////////////////////////*/
+
+static bool queue_collapse(int from, int to)
+{
+    if (!reserve((void **)&heap, &heap_capacity, heap_length + 1, sizeof(collapse_t))) {
+        return false;
+    }
+
+    // The combined quadric, measured where "from" ends up.
+    quadric_t quadric = quadrics[from];
+    add_quadric(&quadric, &quadrics[to]);
+
+    double cost = get_quadric_error(&quadric, welded_positions[to]);
+    collapse_t collapse = {
+        .cost = cost,
+        .error = (quadric.weight > 0.0) ? (cost / quadric.weight) : 0.0,
+        .from = from,
+        .to = to,
+        .from_version = welded_versions[from],
+        .to_version = welded_versions[to],
+    };
+
+    int index = heap_length;
+    heap_length++;
+    while (index > 0) {
+        int parent = (index - 1) / 2;
+        if (heap[parent].cost <= collapse.cost) {
+            break;
+        }
+        heap[index] = heap[parent];
+        index = parent;
+    }
+    heap[index] = collapse;
+    return true;
+}
+
+static collapse_t pop_collapse(void)
+{
+    collapse_t top = heap[0];
+    collapse_t last = heap[heap_length - 1];
+    heap_length--;
+
+    int index = 0;
+    for (;;) {
+        int child = (2 * index) + 1;
+        if (child >= heap_length) {
+            break;
+        }
+        if ((child + 1 < heap_length) && (heap[child + 1].cost < heap[child].cost)) {
+            child++;
+        }
+        if (last.cost <= heap[child].cost) {
+            break;
+        }
+        heap[index] = heap[child];
+        index = child;
+    }
+    if (heap_length > 0) {
+        heap[index] = last;
+    }
+    return top;
+}
+
+/*/////////////////////////////////////////////////////////////////////////////
+// Collapsing edges
+/////////////////////////////////////////////////////////////////////////////*/
+
+// List the welded vertices sharing a face with vertex, and how many faces each shares.
+// Returns how many there are, or -1 if there was no memory for them.
+static int gather_neighbors(int vertex, neighbor_t ** neighbors, int * capacity)
+{
+    int num_neighbors = 0;
+    int * faces = welded_faces[vertex];
+
+    for (int ii = 0; ii < array_length(faces); ii++) {
+        const lod_face_t * face = &lod_faces[faces[ii]];
+        if (face->removed) {
+            continue;
+        }
+
+        int corner = find_corner(face, vertex);
+        for (int step = 1; step <= 2; step++) {
+            int other = get_welded(face, (corner + step) % 3);
+
+            int neighbor_i = 0;
+            while ((neighbor_i < num_neighbors) && ((*neighbors)[neighbor_i].vertex != other)) {
+                neighbor_i++;
+            }
+
+            if (neighbor_i == num_neighbors) {
+                if (!reserve((void **)neighbors, capacity, num_neighbors + 1, sizeof(neighbor_t))) {
+                    return -1;
+                }
+                (*neighbors)[neighbor_i].vertex = other;
+                (*neighbors)[neighbor_i].num_faces = 0;
+                num_neighbors++;
+            }
+            (*neighbors)[neighbor_i].num_faces++;
+        }
+    }
+
+    return num_neighbors;
+}
+
+static bool is_border_vertex(const neighbor_t * neighbors, int num_neighbors)
+{
+    for (int ii = 0; ii < num_neighbors; ii++) {
+        if (neighbors[ii].num_faces == 1) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static const wedge_t * find_wedge(corner_t from)
+{
+    for (int ii = 0; ii < num_wedges; ii++) {
+        if (corners_match(wedges[ii].from, from)) {
+            return &wedges[ii];
+        }
+    }
+    return NULL;
+}
+
+// Can "from" collapse onto "to" without tearing the mesh, folding faces over, or
+// losing UVs? Leaves the corners the faces around "from" will get in wedges.
+static bool check_collapse(int from, int to)
+{
+    if (welded_removed[from] || welded_removed[to]) {
+        return false;
+    }
+
+    int num_from_neighbors = gather_neighbors(from, &from_neighbors, &from_neighbors_capacity);
+    int num_to_neighbors = gather_neighbors(to, &to_neighbors, &to_neighbors_capacity);
+    if ((num_from_neighbors < 0) || (num_to_neighbors < 0)) {
+        return false;
+    }
+
+    int num_edge_faces = 0;
+    for (int ii = 0; ii < num_from_neighbors; ii++) {
+        if (from_neighbors[ii].vertex == to) {
+            num_edge_faces = from_neighbors[ii].num_faces;
+        }
+    }
+
+    // The edge has to be there, with one or two faces. A vertex on an open edge can only
+    // slide along it, and an edge joining two open edges across the mesh would pinch it.
+    if ((num_edge_faces == 0) || (num_edge_faces > 2)) {
+        return false;
+    }
+    if (is_border_vertex(from_neighbors, num_from_neighbors) && (num_edge_faces != 1)) {
+        return false;
+    }
+    if ((num_edge_faces == 2) && is_border_vertex(to_neighbors, num_to_neighbors)) {
+        return false;
+    }
+
+    // The only neighbors the two vertices share should be the far corners of the edge's
+    // faces, or the collapse would make faces or edges that are used twice.
+    int num_shared_neighbors = 0;
+    for (int ii = 0; ii < num_from_neighbors; ii++) {
+        for (int jj = 0; jj < num_to_neighbors; jj++) {
+            if (from_neighbors[ii].vertex == to_neighbors[jj].vertex) {
+                num_shared_neighbors++;
+            }
+        }
+    }
+    if (num_shared_neighbors != num_edge_faces) {
+        return false;
+    }
+
+    // The faces on the edge say which corner of "to" goes with each corner of "from".
+    num_wedges = 0;
+    int * faces = welded_faces[from];
+    for (int ii = 0; ii < array_length(faces); ii++) {
+        const lod_face_t * face = &lod_faces[faces[ii]];
+        int to_corner = face->removed ? -1 : find_corner(face, to);
+        if (to_corner < 0) {
+            continue;
+        }
+
+        wedge_t wedge = { face->corners[find_corner(face, from)], face->corners[to_corner] };
+        const wedge_t * existing = find_wedge(wedge.from);
+        if (existing) {
+            if (!corners_match(existing->to, wedge.to)) {
+                return false;
+            }
+            continue;
+        }
+
+        if (!reserve((void **)&wedges, &wedges_capacity, num_wedges + 1, sizeof(wedge_t))) {
+            return false;
+        }
+        wedges[num_wedges] = wedge;
+        num_wedges++;
+    }
+
+    // Every other face around "from" needs one of those corners, and must not flip over.
+    vec3_t to_position = welded_positions[to];
+    for (int ii = 0; ii < array_length(faces); ii++) {
+        const lod_face_t * face = &lod_faces[faces[ii]];
+        if (face->removed || (find_corner(face, to) >= 0)) {
+            continue;
+        }
+
+        int from_corner = find_corner(face, from);
+        if (!find_wedge(face->corners[from_corner])) {
+            return false;
+        }
+
+        vec3_t old_normal = get_face_normal(face, -1, to_position);
+        vec3_t new_normal = get_face_normal(face, from_corner, to_position);
+        if (vec3_dot(old_normal, new_normal) <= 0.0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Move "from" onto "to", after check_collapse(from, to) said it's fine.
+static bool collapse_edge(int from, int to)
+{
+    int * faces = welded_faces[from];
+    for (int ii = 0; ii < array_length(faces); ii++) {
+        lod_face_t * face = &lod_faces[faces[ii]];
+        if (face->removed) {
+            continue;
+        }
+
+        // The edge's own faces go away, the rest take the matching corner of "to".
+        if (find_corner(face, to) >= 0) {
+            face->removed = true;
+            num_live_faces--;
+            continue;
+        }
+
+        int from_corner = find_corner(face, from);
+        face->corners[from_corner] = find_wedge(face->corners[from_corner])->to;
+        array_push(welded_faces[to], faces[ii]);
+    }
+
+    array_free(welded_faces[from]);
+    welded_faces[from] = NULL;
+    welded_removed[from] = true;
+
+    add_quadric(&quadrics[to], &quadrics[from]);
+    welded_versions[to]++;
+
+    // Every collapse touching "to" costs something different now.
+    int num_neighbors = gather_neighbors(to, &to_neighbors, &to_neighbors_capacity);
+    if (num_neighbors < 0) {
+        return false;
+    }
+    for (int ii = 0; ii < num_neighbors; ii++) {
+        if (!queue_collapse(to, to_neighbors[ii].vertex) ||
+            !queue_collapse(to_neighbors[ii].vertex, to)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*/////////////////////////////////////////////////////////////////////////////
+// Setting up and making the levels
+/////////////////////////////////////////////////////////////////////////////*/
+
+static int compare_source_positions(const void * a, const void * b)
+{
+    vec3_t position_a = source_vertices[*(const int *)a];
+    vec3_t position_b = source_vertices[*(const int *)b];
+
+    if (position_a.x != position_b.x) {
+        return (position_a.x < position_b.x) ? -1 : 1;
+    }
+    if (position_a.y != position_b.y) {
+        return (position_a.y < position_b.y) ? -1 : 1;
+    }
+    if (position_a.z != position_b.z) {
+        return (position_a.z < position_b.z) ? -1 : 1;
+    }
+    return *(const int *)a - *(const int *)b;
+}
+
+// Give every group of level 0 vertices at the same position one welded vertex.
+static bool weld_vertices(void)
+{
+    int * order = (int *)malloc(num_source_vertices * sizeof(int));
+    if (!order) {
+        return false;
+    }
+
+    for (int vertex_i = 0; vertex_i < num_source_vertices; vertex_i++) {
+        order[vertex_i] = vertex_i;
+    }
+    qsort(order, num_source_vertices, sizeof(int), compare_source_positions);
+
+    num_welded = 0;
+    for (int ii = 0; ii < num_source_vertices; ii++) {
+        vec3_t position = source_vertices[order[ii]];
+        if ((ii == 0) ||
+            (position.x != welded_positions[num_welded - 1].x) ||
+            (position.y != welded_positions[num_welded - 1].y) ||
+            (position.z != welded_positions[num_welded - 1].z)) {
+            welded_positions[num_welded] = position;
+            num_welded++;
+        }
+        welded_indices[order[ii]] = num_welded - 1;
+    }
+
+    free(order);
+    return true;
+}
+
+// Is the face's edge from corner to corner + 1 on an open edge of the mesh or a UV seam?
+static bool is_border_edge(int face_index, int corner)
+{
+    const lod_face_t * face = &lod_faces[face_index];
+    corner_t start = face->corners[corner];
+    corner_t end = face->corners[(corner + 1) % 3];
+    int start_welded = welded_indices[start.vertex];
+    int end_welded = welded_indices[end.vertex];
+
+    int * faces = welded_faces[start_welded];
+    for (int ii = 0; ii < array_length(faces); ii++) {
+        const lod_face_t * other = &lod_faces[faces[ii]];
+        int other_end = (faces[ii] == face_index || other->removed) ? -1 : find_corner(other, end_welded);
+        if (other_end < 0) {
+            continue;
+        }
+
+        // The other face on the edge: it's a seam unless both ends have the same corners.
+        int other_start = find_corner(other, start_welded);
+        return !corners_match(other->corners[other_start], start) || !corners_match(other->corners[other_end], end);
+    }
+
+    return true;
+}
+
+static void free_simplifier(void)
+{
+    for (int welded = 0; welded < num_welded; welded++) {
+        array_free(welded_faces[welded]);
+    }
+
+    free(welded_indices);
+    free(welded_positions);
+    free(quadrics);
+    free(welded_faces);
+    free(welded_removed);
+    free(welded_versions);
+    free(lod_faces);
+    free(heap);
+    free(from_neighbors);
+    free(to_neighbors);
+    free(wedges);
+    free(vertex_remap);
+
+    welded_indices = NULL;
+    welded_positions = NULL;
+    quadrics = NULL;
+    welded_faces = NULL;
+    welded_removed = NULL;
+    welded_versions = NULL;
+    lod_faces = NULL;
+    heap = NULL;
+    from_neighbors = NULL;
+    to_neighbors = NULL;
+    wedges = NULL;
+    vertex_remap = NULL;
+    num_welded = 0;
+    heap_length = heap_capacity = 0;
+    from_neighbors_capacity = to_neighbors_capacity = wedges_capacity = 0;
+}
+
+static bool init_simplifier(const mesh_lod_t * full_detail)
+{
+    source_vertices = full_detail->vertices;
+    num_source_vertices = array_length(full_detail->vertices);
+    num_lod_faces = array_length(full_detail->faces);
+
+    welded_indices = (int *)malloc(num_source_vertices * sizeof(int));
+    welded_positions = (vec3_t *)malloc(num_source_vertices * sizeof(vec3_t));
+    quadrics = (quadric_t *)calloc(num_source_vertices, sizeof(quadric_t));
+    welded_faces = (int **)calloc(num_source_vertices, sizeof(int *));
+    welded_removed = (bool *)calloc(num_source_vertices, sizeof(bool));
+    welded_versions = (int *)calloc(num_source_vertices, sizeof(int));
+    vertex_remap = (int *)malloc(num_source_vertices * sizeof(int));
+    lod_faces = (lod_face_t *)malloc(num_lod_faces * sizeof(lod_face_t));
+
+    if (!welded_indices || !welded_positions || !quadrics || !welded_faces ||
+        !welded_removed || !welded_versions || !vertex_remap || !lod_faces) {
+        return false;
+    }
+
+    if (!weld_vertices()) {
+        return false;
+    }
+
+    num_live_faces = 0;
+    for (int face_i = 0; face_i < num_lod_faces; face_i++) {
+        const face_t * face = &full_detail->faces[face_i];
+        lod_face_t * lod_face = &lod_faces[face_i];
+        corner_t a = { face->a, face->a_uv };
+        corner_t b = { face->b, face->b_uv };
+        corner_t c = { face->c, face->c_uv };
+        lod_face->corners[0] = a;
+        lod_face->corners[1] = b;
+        lod_face->corners[2] = c;
+        lod_face->color = face->color;
+
+        // Faces that are already collapsed once welded don't get simplified; they're
+        // just left out of the simpler levels.
+        int welded_a = get_welded(lod_face, 0);
+        int welded_b = get_welded(lod_face, 1);
+        int welded_c = get_welded(lod_face, 2);
+        lod_face->removed = (welded_a == welded_b) || (welded_b == welded_c) || (welded_c == welded_a);
+        if (lod_face->removed) {
+            continue;
+        }
+
+        num_live_faces++;
+        for (int corner = 0; corner < 3; corner++) {
+            array_push(welded_faces[get_welded(lod_face, corner)], face_i);
+        }
+    }
+
+    // Each face's plane goes into the quadrics of its corners, and open edges and seams
+    // get a plane through the edge, at right angles to the face.
+    for (int face_i = 0; face_i < num_lod_faces; face_i++) {
+        const lod_face_t * face = &lod_faces[face_i];
+        if (face->removed) {
+            continue;
+        }
+
+        vec3_t normal = get_face_normal(face, -1, vec3_new(0, 0, 0));
+        if (vec3_length(normal) == 0.0) {
+            continue;
+        }
+        vec3_normalize(&normal);
+
+        vec3_t point = welded_positions[get_welded(face, 0)];
+        quadric_t quadric = make_plane_quadric(normal, -vec3_dot(normal, point), 1.0);
+        for (int corner = 0; corner < 3; corner++) {
+            add_quadric(&quadrics[get_welded(face, corner)], &quadric);
+        }
+
+        for (int corner = 0; corner < 3; corner++) {
+            if (!is_border_edge(face_i, corner)) {
+                continue;
+            }
+
+            vec3_t start = welded_positions[get_welded(face, corner)];
+            vec3_t end = welded_positions[get_welded(face, (corner + 1) % 3)];
+            vec3_t edge_normal = vec3_cross(vec3_sub(end, start), normal);
+            if (vec3_length(edge_normal) == 0.0) {
+                continue;
+            }
+            vec3_normalize(&edge_normal);
+
+            quadric_t edge_quadric = make_plane_quadric(edge_normal, -vec3_dot(edge_normal, start), LOD_BORDER_WEIGHT);
+            add_quadric(&quadrics[get_welded(face, corner)], &edge_quadric);
+            add_quadric(&quadrics[get_welded(face, (corner + 1) % 3)], &edge_quadric);
+        }
+    }
+
+    // Queue both directions of every edge.
+    for (int welded = 0; welded < num_welded; welded++) {
+        int num_neighbors = gather_neighbors(welded, &from_neighbors, &from_neighbors_capacity);
+        if (num_neighbors < 0) {
+            return false;
+        }
+        for (int ii = 0; ii < num_neighbors; ii++) {
+            if (!queue_collapse(welded, from_neighbors[ii].vertex)) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// Save the faces that are left as the mesh's next level of detail.
+static bool add_lod(mesh_t * mesh, float error)
+{
+    mesh_lod_t * lod = &mesh->lods[mesh->num_lods];
+    lod->vertices = NULL;
+    lod->faces = NULL;
+    lod->error = error;
+
+    for (int vertex_i = 0; vertex_i < num_source_vertices; vertex_i++) {
+        vertex_remap[vertex_i] = -1;
+    }
+
+    for (int face_i = 0; face_i < num_lod_faces; face_i++) {
+        const lod_face_t * lod_face = &lod_faces[face_i];
+        if (lod_face->removed) {
+            continue;
+        }
+
+        int indices[3];
+        for (int corner = 0; corner < 3; corner++) {
+            int vertex = lod_face->corners[corner].vertex;
+            if (vertex_remap[vertex] < 0) {
+                vertex_remap[vertex] = array_length(lod->vertices);
+                array_push(lod->vertices, source_vertices[vertex]);
+            }
+            indices[corner] = vertex_remap[vertex];
+        }
+
+        face_t face = {
+            .a = indices[0],
+            .b = indices[1],
+            .c = indices[2],
+            .a_uv = lod_face->corners[0].uv,
+            .b_uv = lod_face->corners[1].uv,
+            .c_uv = lod_face->corners[2].uv,
+            .color = lod_face->color
+        };
+        array_push(lod->faces, face);
+    }
+
+    compute_face_planes(lod);
+
+    mesh->num_lods++;
+    return true;
+}
+
+/*/////////////////////////////////////////////////////////////////////////////
+// Build the mesh's levels of detail from its full detail level
+///////////////////////////////////////////////////////////////////////////////
+// Each level aims for LOD_FACE_RATIO of the faces of the one before, until it
+// would get below LOD_MIN_FACES or there are MAX_MESH_LODS levels. Simplifying
+// stops early when there are no more edges that can be collapsed.
+/////////////////////////////////////////////////////////////////////////////*/
+bool build_mesh_lods(mesh_t * mesh)
+{
+    mesh->lods[0].error = 0.0;
+    mesh->num_lods = 1;
+
+    int num_faces = array_length(mesh->lods[0].faces);
+    if (num_faces * LOD_FACE_RATIO < LOD_MIN_FACES) {
+        return true;
+    }
+
+    bool all_good = init_simplifier(&mesh->lods[0]);
+    double max_error = 0.0;
+
+    while (all_good && (mesh->num_lods < MAX_MESH_LODS)) {
+        int target_faces = (int)(num_faces * LOD_FACE_RATIO);
+        if (target_faces < LOD_MIN_FACES) {
+            break;
+        }
+
+        while (all_good && (num_live_faces > target_faces) && (heap_length > 0)) {
+            collapse_t collapse = pop_collapse();
+            if ((collapse.from_version != welded_versions[collapse.from]) ||
+                (collapse.to_version != welded_versions[collapse.to]) ||
+                !check_collapse(collapse.from, collapse.to)) {
+                continue;
+            }
+
+            max_error = fmax(max_error, collapse.error);
+            all_good = collapse_edge(collapse.from, collapse.to);
+        }
+
+        // Ran out of edges before getting far enough to be worth another level.
+        if (!all_good || (num_live_faces > num_faces * 3 / 4)) {
+            break;
+        }
+
+        // The quadric error is a squared distance.
+        all_good = add_lod(mesh, (float)sqrt(max_error));
+        num_faces = num_live_faces;
+    }
+
+    free_simplifier();
+
+    if (!all_good) {
+        fprintf(stderr, "Error: out of memory while simplifying the mesh.\n");
+        return false;
+    }
+
+    printf("Built %d levels of detail:", mesh->num_lods);
+    for (int lod_index = 0; lod_index < mesh->num_lods; lod_index++) {
+        printf(" %d", array_length(mesh->lods[lod_index].faces));
+    }
+    printf(" faces.\n");
+
+    return true;
+}
+
+/*/////////////////////////////////////////////////////////////////////////////
+// Pick the level of detail to draw a mesh with
+///////////////////////////////////////////////////////////////////////////////
+// The simplest level whose error, projected to the screen at the nearest point
+// of the mesh's bounding sphere, is no more than LOD_MAX_SCREEN_ERROR pixels.
+// pixels_per_unit is how many pixels one unit covers at a depth of one unit.
+/////////////////////////////////////////////////////////////////////////////*/
+int select_mesh_lod(const mesh_t * mesh, const mat4_t * model_view, float pixels_per_unit)
+{
+    float scale = mat4_get_max_scale(model_view);
+    vec3_t center = vec3_from_vec4(mat4_mul_vec4(*model_view, vec4_from_vec3(mesh->bounds_center)));
+    float nearest_depth = center.z - (mesh->bounds_radius * scale);
+
+    // Too close to tell, so take no chances.
+    if (nearest_depth <= 0.0) {
+        return 0;
+    }
+
+    float pixels_per_error = (scale * pixels_per_unit) / nearest_depth;
+    int lod_index = 0;
+    while ((lod_index + 1 < mesh->num_lods) &&
+           (mesh->lods[lod_index + 1].error * pixels_per_error <= LOD_MAX_SCREEN_ERROR)) {
+        lod_index++;
+    }
+    return lod_index;
+}
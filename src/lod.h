@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdbool.h>
+#include "matrix.h"
+#include "mesh.h"
+
+// Each level of detail aims for this fraction of the faces of the level before it.
+#define LOD_FACE_RATIO (0.5)
+
+// Levels aren't simplified down past this many faces.
+#define LOD_MIN_FACES (32)
+
+// Edges on a UV seam or an open edge of the mesh count this much more when they move,
+// so the outline of the mesh and of its texture pieces hold their shape.
+#define LOD_BORDER_WEIGHT (10.0)
+
+// A level is only drawn while its error covers at most this many pixels on the screen.
+#define LOD_MAX_SCREEN_ERROR (1.0)
+
+bool build_mesh_lods(mesh_t * mesh);
+int select_mesh_lod(const mesh_t * mesh, const mat4_t * model_view, float pixels_per_unit);
@@ -2,6 +2,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 #include <SDL2/SDL.h>
 #include "display.h"
 #include "gfx-vector.h"
@@ -14,6 +15,13 @@
 #include "upng.h"
 #include "camera.h"
 #include "clipping.h"
+#include "thread_pool.h"
+#include "tiles.h"
+#include "bvh.h"
+#include "swap.h"
+#include "arena.h"
+#include "lod.h"
+#include "meshlet.h"
 
 int previous_frame_time = 0;
 float delta_time_s = 0;
@@ -22,15 +30,23 @@ bool g_display_vertex_dot = false;
 bool g_display_wireframe_lines = true;
 bool g_display_filled_trianges = false;
 bool g_display_texture = false;
+bool g_use_tiled_rendering = true;
+bool g_use_depth_prepass = false;
+bool g_use_lod = true;
 
-#define MAX_TRIANGLES_PER_MESH (10000)
+// Projected triangles wait in the render queue until it fills up or the frame is done,
+// and then get drawn all together (see flush_render_queue()). Big scenes just take more
+// flushes, so the memory used stays the same however many triangles a frame has.
+// The queue is allocated once in setup(), and reused by every frame.
+#define RENDER_QUEUE_SIZE (16384)
 
-triangle_t triangles_to_render[MAX_TRIANGLES_PER_MESH];
-int num_triangles_to_render = 0;
+triangle_t * render_queue = NULL;
+int render_queue_length = 0;
+bool is_frame_cleared = false; // true once this frame's first flush has cleared the screen
+
+static void flush_render_queue(void);
 
 mat4_t proj_matrix;
-mat4_t world_matrix;
-mat4_t view_matrix;
 
 bool is_running = false;
 
@@ -93,6 +109,28 @@ bool setup(void)
     // (left, right, top, bottom, front, back)
     init_frustum_planes(fov_x, fov_y, z_near, z_far);
 
+    // Start one thread per CPU core for the geometry stage.
+    if (! init_thread_pool(SDL_GetCPUCount())) {
+        return false;
+    }
+
+    render_queue = (triangle_t *)malloc(RENDER_QUEUE_SIZE * sizeof(triangle_t));
+
+    if (!render_queue) {
+        fprintf(stderr, "Error: malloc failed for render_queue.\n");
+        return false;
+    }
+
+    // Memory for everything that only lasts for a frame.
+    if (! init_frame_arena(FRAME_ARENA_SIZE)) {
+        return false;
+    }
+
+    // Split the screen into tiles for the rasterizer.
+    if (! init_tiles(get_window_width(), get_window_height())) {
+        return false;
+    }
+
     bool all_good = load_objects_to_display();
 
     return all_good;
@@ -118,6 +156,10 @@ void process_input(void)
                 Pressing “6” displays textured triangles and wireframe lines
                 Pressing “c” we should enable back-face culling
                 Pressing “x” we should disable the back-face culling
+                Pressing “t” toggles between tiled (multi-threaded) and whole-screen rasterization
+                Pressing “p” toggles the depth pre-pass (depth-only pass, then equal-depth shading)
+                Pressing “l” toggles between levels of detail by distance and always full detail
+                Pressing “m” cycles the texture span length (exact, 8 pixels, 16 pixels)
                 */
             if (event.key.keysym.sym == SDLK_ESCAPE)
             {
@@ -170,6 +212,23 @@ void process_input(void)
             {
                 g_display_back_face_culling = false;
             }
+            if (event.key.keysym.sym == SDLK_t)
+            {
+                g_use_tiled_rendering = ! g_use_tiled_rendering;
+            }
+            if (event.key.keysym.sym == SDLK_p)
+            {
+                g_use_depth_prepass = ! g_use_depth_prepass;
+            }
+            if (event.key.keysym.sym == SDLK_l)
+            {
+                g_use_lod = ! g_use_lod;
+            }
+            if (event.key.keysym.sym == SDLK_m)
+            {
+                // Cycle the texture spans through exact, 8 pixels, and 16 pixels.
+                set_texture_span_length((get_texture_span_length() + 8) % 24);
+            }
             if (event.key.keysym.sym == SDLK_UP)
             {
                 update_camera_forward_velocity(vec3_mul(get_camera_direction(), 5.0 * delta_time_s));
@@ -203,150 +262,261 @@ void process_input(void)
     }
 }
 
-/* /////////////////////////////////////////////////////////////////////////////
-// Process the graphics pipeline stages for all the mesh triangles
-///////////////////////////////////////////////////////////////////////////////
-// +-------------+
-// | Model space |  <-- original mesh vertices
-// +-------------+
-// |   +-------------+
-// `-> | World space |  <-- multiply by world matrix
-//     +-------------+
-//     |   +--------------+
-//     `-> | Camera space |  <-- multiply by view matrix
-//         +--------------+
-//         |    +------------+
-//         `--> |  Clipping  |  <-- clip against the six frustum planes
-//              +------------+
-//              |    +------------+
-//              `--> | Projection |  <-- multiply by projection matrix
-//                   +------------+
-//                   |    +-------------+
-//                   `--> | Image space |  <-- apply perspective divide
-//                        +-------------+
-//                        |    +--------------+
-//                        `--> | Screen space |  <-- ready to render
-//                             +--------------+
-/////////////////////////////////////////////////////////////////////////////// */
-void process_graphics_pipeline_stages(mesh_t * mesh)
+// The geometry stage splits each mesh's meshlets into chunks and runs them as jobs on the
+// thread pool. Small meshes aren't worth splitting up much.
+#define MAX_GEOMETRY_JOBS (64)
+#define MIN_MESHLETS_PER_JOB (4)
+
+// The meshlets go through the geometry stage this many at a time, and each batch's
+// triangles get moved to the render queue before the next batch starts, so the frame
+// arena only ever holds one batch's triangles however big the mesh is. At worst, every
+// face of every meshlet gets clipped into MAX_NUM_POLY_TRIANGLES triangles: about 8 MB
+// of triangle blocks for a batch, counting each job's last partial block, which
+// FRAME_ARENA_SIZE leaves room for.
+#define MESHLETS_PER_BATCH (64)
+
+// Triangles produced by one geometry job, in a list of blocks allocated from the frame
+// arena as the job needs them. Each job only writes to its own buffer, and the buffers
+// are merged in job order afterwards, so the triangles end up in the same order no matter
+// which thread ran which job.
+#define TRIANGLE_BLOCK_SIZE (256)
+
+typedef struct triangle_block {
+    struct triangle_block * next;
+    int num_triangles;
+    triangle_t triangles[TRIANGLE_BLOCK_SIZE];
+} triangle_block_t;
+
+typedef struct {
+    triangle_block_t * first_block;
+    triangle_block_t * last_block;
+    int num_dropped_triangles; // ones that didn't fit in the frame arena
+} triangle_buffer_t;
+
+static triangle_buffer_t geometry_job_buffers[MAX_GEOMETRY_JOBS];
+
+// What the geometry jobs need to know about the mesh they're working on.
+typedef struct {
+    mesh_t * mesh;
+    mesh_lod_t * lod; // the mesh's level of detail being drawn
+    mat4_t model_view_matrix;
+    mat4_t vertex_matrix; // the meshlets' stored vertices to camera space
+    mat4_t model_view_inverse; // camera space back to model space
+    vec3_t model_camera_position; // the camera in model space, for back-face culling
+    float max_scale; // the model-view matrix's biggest scale factor, for meshlet bounds
+    int clip_planes; // from get_mesh_clip_planes(): 0 when no face needs clipping
+    int first_item; // the first meshlet in this batch
+    int num_items;  // number of meshlets in this batch being split up
+    int num_jobs;
+} geometry_jobs_t;
+
+static int get_num_geometry_jobs(int num_items, int min_items_per_job)
 {
-    // Create the view matrix using the current camera position and target.
-    vec3_t target = get_camera_lookat_target();
-    vec3_t up_direction = {0, 1, 0}; // normalized y axis
-    mat4_t view_matrix = mat4_look_at(get_camera_position(), target, up_direction);
-
-    // Create scale, translation, and rotation matrices that will be used to multiply the mesh vertices.
-    mat4_t scale_matrix = mat4_make_scale(mesh->scale.x, mesh->scale.y, mesh->scale.z);
-    mat4_t translation_matrix = mat4_make_translation(mesh->translation.x, mesh->translation.y, mesh->translation.z);
-    mat4_t rotation_matrix_x = mat4_make_rotation_x(mesh->rotation.x);
-    mat4_t rotation_matrix_y = mat4_make_rotation_y(mesh->rotation.y);
-    mat4_t rotation_matrix_z = mat4_make_rotation_z(mesh->rotation.z);
-
-    // Loop all triangle faces of the mesh.
-    int num_faces = array_length(mesh->faces);
-
-    for (int face_i = 0; face_i < num_faces; face_i++)
-    {
-        // Handle 1 triangle face per iteration.
+    int num_jobs = num_items / min_items_per_job;
 
-        face_t mesh_face = mesh->faces[face_i];
-        vec3_t face_vertices[3];
-        face_vertices[0] = mesh->vertices[mesh_face.a];
-        face_vertices[1] = mesh->vertices[mesh_face.b];
-        face_vertices[2] = mesh->vertices[mesh_face.c];
+    if (num_jobs > get_thread_pool_size()) {
+        num_jobs = get_thread_pool_size();
+    }
+    if (num_jobs > MAX_GEOMETRY_JOBS) {
+        num_jobs = MAX_GEOMETRY_JOBS;
+    }
+    if (num_jobs < 1) {
+        num_jobs = 1;
+    }
+    return num_jobs;
+}
 
-        vec4_t transformed_vertices[3];
+// Find the range of items [first_item, end_item) that job_index should handle.
+static void get_job_range(geometry_jobs_t * jobs, int job_index, int * first_item, int * end_item)
+{
+    *first_item = jobs->first_item + (int)(((long long)jobs->num_items * job_index) / jobs->num_jobs);
+    *end_item = jobs->first_item + (int)(((long long)jobs->num_items * (job_index + 1)) / jobs->num_jobs);
+}
 
-        // For all 3 vertices of this triangle, apply transformations.
-        for (int vertex_i = 0; vertex_i < 3; vertex_i++)
-        {
-            vec4_t transformed_vertex = vec4_from_vec3(face_vertices[vertex_i]);
+static void push_triangle(triangle_buffer_t * buffer, triangle_t * triangle)
+{
+    triangle_block_t * block = buffer->last_block;
 
-            // Creating a single World Matrix combining the scale, rotation, and translation matrices.
-            // Note that the order matters: Must be scale first, then rotation, and finally translation last.
-            world_matrix = mat4_identity();
-            world_matrix = mat4_mul_mat4(scale_matrix, world_matrix);
-            world_matrix = mat4_mul_mat4(rotation_matrix_x, world_matrix);
-            world_matrix = mat4_mul_mat4(rotation_matrix_y, world_matrix);
-            world_matrix = mat4_mul_mat4(rotation_matrix_z, world_matrix);
-            world_matrix = mat4_mul_mat4(translation_matrix, world_matrix);
+    if (!block || (block->num_triangles == TRIANGLE_BLOCK_SIZE)) {
+        block = (triangle_block_t *)frame_arena_alloc(sizeof(triangle_block_t));
+        if (!block) {
+            buffer->num_dropped_triangles++;
+            return;
+        }
 
-            // Multiply (apply) the World Matrix by the vertex to get the transformed vertex.
-            transformed_vertex = mat4_mul_vec4(world_matrix, transformed_vertex);
+        block->next = NULL;
+        block->num_triangles = 0;
+        if (buffer->last_block) {
+            buffer->last_block->next = block;
+        }
+        else {
+            buffer->first_block = block;
+        }
+        buffer->last_block = block;
+    }
 
-            // Multiply the view matrix by the vertex vector to transform the scene to camera space.
-            transformed_vertex = mat4_mul_vec4(view_matrix, transformed_vertex);
+    block->triangles[block->num_triangles] = *triangle;
+    block->num_triangles++;
+}
 
-            // Save off the transformed vertex.
-            transformed_vertices[vertex_i] = transformed_vertex;
-        }
+// Perspective divide a clip space point, and map it to screen pixels.
+static vec4_t clip_to_screen(vec4_t point)
+{
+    // Divide by the original z depth, which is stored in the w value.
+    if (point.w != 0.0) {
+        point.x /= point.w;
+        point.y /= point.w;
+        point.z /= point.w;
+    }
 
-        // Calculate the triangle face normal.
-        vec3_t face_normal = get_triangle_normal(transformed_vertices);
+    // Scale into the view.
+    point.x *= (get_window_width() / 2.0);
+    point.y *= (get_window_width() / 2.0);
 
-        if (g_display_back_face_culling)
-        {
-            // Find the vector between a point in the triangle (point A) and the axes origin.
-            vec3_t origin = {0, 0, 0};
-            vec3_t camera_ray = vec3_sub(origin, vec3_from_vec4(transformed_vertices[0]));
+    // Invert the y values to account for flipped screen y coordinate: in our object coordinate system,
+    // y increases going "up" the screen, but in SDL the y increases going "down" the screen.
+    point.y *= -1.0;
 
-            // How aligned is the face's normal with the camera ray?
-            float dot_normal_camera = vec3_dot(face_normal, camera_ray);
-            if (dot_normal_camera < 0)
-            {
-                // If the dot product is < 0, then the face is pointing away from the camera,
-                // and we don't need to display it.
+    // Translate the projected points to the middle of the screen.
+    point.x += (get_window_width() / 2.0); // translate to center of window
+    point.y += (get_window_width() / 2.0); // translate to center of window
+
+    return point;
+}
+
+// A meshlet's vertices after vertex processing: camera space and clip space positions,
+// outcodes (unless the whole meshlet is inside the frustum), and UVs.
+typedef struct {
+    vec3_soa_t camera_positions;
+    vec4_soa_t clip_positions;
+    outcode_t * outcodes;
+    const tex2_t * texcoords;
+} meshlet_vertices_t;
+
+// Face processing: cull, clip, and project the meshlet's faces, and save the resulting
+// triangles in the job's triangle buffer.
+static void process_meshlet_faces(const geometry_jobs_t * jobs, const meshlet_t * meshlet, int meshlet_clip_planes,
+                                  const meshlet_vertices_t * vertices, triangle_buffer_t * output)
+{
+    mesh_t * mesh = jobs->mesh;
+    mesh_lod_t * lod = jobs->lod;
+
+    // Loop over the meshlet's triangle faces.
+    for (int face_i = meshlet->first_face; face_i < meshlet->first_face + meshlet->num_faces; face_i++)
+    {
+        // Handle 1 triangle face per iteration.
+
+        meshlet_face_t mesh_face = lod->meshlet_faces[face_i];
+
+        // The face's corners in the meshlet's vertices.
+        const uint8_t * face_indices = &lod->meshlet_indices[3 * face_i];
+
+        // Back-face culling happens in model space, with the plane worked out when the mesh
+        // was loaded: if the camera is behind the face's plane, the face is pointing away
+        // from the camera, and we don't need to display it. It's one dot product, and
+        // about half of the faces never go any further.
+        if (g_display_back_face_culling &&
+            (vec3_dot(mesh_face.normal, jobs->model_camera_position) < mesh_face.distance)) {
+            continue;
+        }
+
+        // Find out which frustum planes the face needs clipping against, if any, from the
+        // outcodes of its vertices. Faces completely outside the frustum get dropped right
+        // away. Faces that go off the sides of the screen don't need clipping unless they
+        // go way off (outside the guard band), since the rasterizer only draws the on-screen
+        // part anyway. When the whole meshlet is inside, none of its faces need looking at.
+        int clip_planes = 0;
+        if (meshlet_clip_planes != 0) {
+            clip_planes = get_triangle_clip_planes(vertices->outcodes[face_indices[0]],
+                                                   vertices->outcodes[face_indices[1]],
+                                                   vertices->outcodes[face_indices[2]]);
+            if (clip_planes < 0) {
                 continue;
             }
         }
 
-        // Clipping!
-        // First, create a polygon starting with the triangle.
-        polygon_t polygon = create_polygon_from_triangle(vec3_from_vec4(transformed_vertices[0]),
-                                                         vec3_from_vec4(transformed_vertices[1]),
-                                                         vec3_from_vec4(transformed_vertices[2]),
-                                                         mesh_face.a_uv,
-                                                         mesh_face.b_uv,
-                                                         mesh_face.c_uv);
-
-        // Now clip the polygon against the frustum so we only display things we can actually see.
-        // Note that the polygon starts as a triangle, but the act of clipping it may turn it into
-        // a polygon with more than just 3 points. It could also be empty if the entire polygon
-        // is clipped!
-        clip_polygon(&polygon); // Note the polygon structure is modified inside clip_polygon().
-
-        // After the polygon has been clipped, we'll need to break it up into triangles for projection
-        // and display.
-        triangle_t triangles_after_clipping[MAX_NUM_POLY_TRIANGLES];
+        // Clip space points of the triangles to draw for this face.
+        vec4_t triangles_clip_points[MAX_NUM_POLY_TRIANGLES][3];
+        tex2_t triangles_texcoords[MAX_NUM_POLY_TRIANGLES][3];
         int num_triangles_after_clipping = 0;
 
-        triangles_from_polygon(&polygon, triangles_after_clipping, &num_triangles_after_clipping);
+        if (clip_planes == 0) {
+            // Nothing to clip, which is the usual case: the vertex stage already projected
+            // the face's vertices to clip space.
+            for (int vertex_i = 0; vertex_i < 3; vertex_i++) {
+                int index = face_indices[vertex_i];
+                triangles_clip_points[0][vertex_i].x = vertices->clip_positions.x[index];
+                triangles_clip_points[0][vertex_i].y = vertices->clip_positions.y[index];
+                triangles_clip_points[0][vertex_i].z = vertices->clip_positions.z[index];
+                triangles_clip_points[0][vertex_i].w = vertices->clip_positions.w[index];
+            }
+            for (int vertex_i = 0; vertex_i < 3; vertex_i++) {
+                triangles_texcoords[0][vertex_i] = vertices->texcoords[face_indices[vertex_i]];
+            }
+            num_triangles_after_clipping = 1;
+        }
+        else {
+            // Clipping!
+            // Assemble the face from the already transformed camera space vertices.
+            vec3_t transformed_vertices[3];
+
+            for (int vertex_i = 0; vertex_i < 3; vertex_i++) {
+                int index = face_indices[vertex_i];
+                transformed_vertices[vertex_i].x = vertices->camera_positions.x[index];
+                transformed_vertices[vertex_i].y = vertices->camera_positions.y[index];
+                transformed_vertices[vertex_i].z = vertices->camera_positions.z[index];
+            }
+
+            // First, create a polygon starting with the triangle.
+            polygon_t polygon = create_polygon_from_triangle(transformed_vertices[0],
+                                                             transformed_vertices[1],
+                                                             transformed_vertices[2],
+                                                             vertices->texcoords[face_indices[0]],
+                                                             vertices->texcoords[face_indices[1]],
+                                                             vertices->texcoords[face_indices[2]]);
+
+            // Now clip the polygon against the frustum so we only display things we can actually see.
+            // Note that the polygon starts as a triangle, but the act of clipping it may turn it into
+            // a polygon with more than just 3 points. It could also be empty if the entire polygon
+            // is clipped!
+            clip_polygon(&polygon, clip_planes); // Note the polygon structure is modified inside clip_polygon().
+
+            // After the polygon has been clipped, we'll need to break it up into triangles for projection
+            // and display.
+            triangle_t triangles_after_clipping[MAX_NUM_POLY_TRIANGLES];
+            triangles_from_polygon(&polygon, triangles_after_clipping, &num_triangles_after_clipping);
+
+            // Project the clipped triangles' points.
+            for (int tri = 0; tri < num_triangles_after_clipping; tri++) {
+                for (int vertex_i = 0; vertex_i < 3; vertex_i++) {
+                    triangles_clip_points[tri][vertex_i] = mat4_mul_vec4(proj_matrix, triangles_after_clipping[tri].points[vertex_i]);
+                    triangles_texcoords[tri][vertex_i] = triangles_after_clipping[tri].texcoords[vertex_i];
+                }
+            }
+        }
+
+        // Bring the face's normal into camera space for lighting. Normals go through the
+        // transpose of the inverse matrix, which keeps them at right angles to the face even
+        // when the mesh is scaled differently along each axis.
+        const float (*inverse)[4] = jobs->model_view_inverse.m;
+        vec3_t face_normal = {
+            (inverse[0][0] * mesh_face.normal.x) + (inverse[1][0] * mesh_face.normal.y) + (inverse[2][0] * mesh_face.normal.z),
+            (inverse[0][1] * mesh_face.normal.x) + (inverse[1][1] * mesh_face.normal.y) + (inverse[2][1] * mesh_face.normal.z),
+            (inverse[0][2] * mesh_face.normal.x) + (inverse[1][2] * mesh_face.normal.y) + (inverse[2][2] * mesh_face.normal.z),
+        };
+        if (vec3_length(face_normal) > 0.0) {
+            vec3_normalize(&face_normal);
+        }
 
         // Now that we have the array of triangles to display after being clipped, loop through
-        // all the triangles to project them.
+        // all the triangles to finish projecting them.
         for (int tri = 0; tri < num_triangles_after_clipping; tri++)
         {
-
-            triangle_t triangle_after_clipping = triangles_after_clipping[tri];
-
             vec4_t projected_points[3];
 
             for (int vertex_i = 0; vertex_i < 3; vertex_i++)
             {
-                // Project the current vertex.
-                projected_points[vertex_i] = mat4_mul_vec4_project(proj_matrix, triangle_after_clipping.points[vertex_i]);
-
-                // Scale into the view.
-                projected_points[vertex_i].x *= (get_window_width() / 2.0);
-                projected_points[vertex_i].y *= (get_window_width() / 2.0);
-
-                // Invert the y values to account for flipped screen y coordinate: in our object coordinate system,
-                // y increases going "up" the screen, but in SDL the y increases going "down" the screen.
-                projected_points[vertex_i].y *= -1.0;
-
-                // Translate the projected points to the middle of the screen.
-                projected_points[vertex_i].x += (get_window_width() / 2.0); // translate to center of window
-                projected_points[vertex_i].y += (get_window_width() / 2.0); // translate to center of window
+                projected_points[vertex_i] = clip_to_screen(triangles_clip_points[tri][vertex_i]);
             }
 
             // Calculate the triangle color based on the original triangle color and the angle of the light
@@ -368,27 +538,299 @@ void process_graphics_pipeline_stages(mesh_t * mesh)
                     {projected_points[2].x, projected_points[2].y, projected_points[2].z, projected_points[2].w},
                 },
                 .texcoords = {
-                    {triangle_after_clipping.texcoords[0].u, triangle_after_clipping.texcoords[0].v},
-                    {triangle_after_clipping.texcoords[1].u, triangle_after_clipping.texcoords[1].v},
-                    {triangle_after_clipping.texcoords[2].u, triangle_after_clipping.texcoords[2].v},
+                    {triangles_texcoords[tri][0].u, triangles_texcoords[tri][0].v},
+                    {triangles_texcoords[tri][1].u, triangles_texcoords[tri][1].v},
+                    {triangles_texcoords[tri][2].u, triangles_texcoords[tri][2].v},
+                },
+                .reciprocal_w = {
+                    1.0 / projected_points[0].w,
+                    1.0 / projected_points[1].w,
+                    1.0 / projected_points[2].w,
                 },
                 .color = triangle_color,
                 .texture = mesh->texture,
             };
 
-            // Saves the projected triangle to the the array of triangles to render.
-            if (num_triangles_to_render < MAX_TRIANGLES_PER_MESH)
-            {
-                triangles_to_render[num_triangles_to_render] = triangle_to_render;
-                num_triangles_to_render++;
+            // Saves the projected triangle to this job's triangle buffer.
+            push_triangle(output, &triangle_to_render);
+        }
+    }
+}
+
+// Geometry job: for each of this job's share of the meshlets, cull the whole meshlet by its
+// normal cone and bounding sphere, then transform its vertices and process its faces, saving
+// the resulting triangles in the job's own triangle buffer.
+static void process_meshlets_job(void * job_data, int job_index)
+{
+    geometry_jobs_t * jobs = (geometry_jobs_t *)job_data;
+    mesh_lod_t * lod = jobs->lod;
+    triangle_buffer_t * output = &geometry_job_buffers[job_index];
+    int first_meshlet, end_meshlet;
+    get_job_range(jobs, job_index, &first_meshlet, &end_meshlet);
+
+    // One meshlet's transformed vertices at a time. They're small enough to stay in the L1
+    // cache while the meshlet's faces use them.
+    float camera_x[MESHLET_MAX_VERTICES], camera_y[MESHLET_MAX_VERTICES], camera_z[MESHLET_MAX_VERTICES];
+    float clip_x[MESHLET_MAX_VERTICES], clip_y[MESHLET_MAX_VERTICES], clip_z[MESHLET_MAX_VERTICES], clip_w[MESHLET_MAX_VERTICES];
+    outcode_t outcodes[MESHLET_MAX_VERTICES];
+    tex2_t texcoords[MESHLET_MAX_VERTICES];
+    meshlet_vertices_t vertices = {
+        { camera_x, camera_y, camera_z },
+        { clip_x, clip_y, clip_z, clip_w },
+        outcodes,
+        texcoords,
+    };
+
+    for (int meshlet_i = first_meshlet; meshlet_i < end_meshlet; meshlet_i++) {
+        const meshlet_t * meshlet = &lod->meshlets[meshlet_i];
+
+        // Meshlets with every face pointing away from the camera, or completely outside the
+        // frustum, are dropped without touching their vertices. When the whole mesh is inside,
+        // so are all its meshlets.
+        if (g_display_back_face_culling && is_meshlet_back_facing(meshlet, jobs->model_camera_position)) {
+            continue;
+        }
+
+        int clip_planes = 0;
+        if (jobs->clip_planes != 0) {
+            clip_planes = get_meshlet_clip_planes(meshlet, &jobs->model_view_matrix, jobs->max_scale);
+            if (clip_planes < 0) {
+                continue;
             }
-            else
-            {
-                fprintf(stderr, "ERROR: trying to render %d triangles, which is more than the max allowed: %d\n",
-                        num_triangles_to_render, MAX_TRIANGLES_PER_MESH);
+        }
+
+        // Vertex processing: transform each of the meshlet's vertices into camera space and
+        // clip space once, through the batch (SIMD) transform, along with their outcodes.
+        // Faces share vertices, so doing this per face would transform the same vertex
+        // several times. Compact meshes' UVs get unpacked along with their positions.
+        int first_vertex = meshlet->first_vertex;
+        if (jobs->mesh->is_compact) {
+            vec3_i16_soa_t positions = {
+                &lod->quantized_positions.x[first_vertex], &lod->quantized_positions.y[first_vertex], &lod->quantized_positions.z[first_vertex]
+            };
+            mat4_transform_quantized_points_soa(&jobs->vertex_matrix, &proj_matrix, &positions,
+                                                &vertices.camera_positions, &vertices.clip_positions, meshlet->num_vertices);
+
+            tex2_t texcoords_min = jobs->mesh->texcoords_min;
+            tex2_t texcoords_scale = jobs->mesh->texcoords_scale;
+            for (int vertex_i = 0; vertex_i < meshlet->num_vertices; vertex_i++) {
+                tex2_u16_t quantized = lod->quantized_texcoords[first_vertex + vertex_i];
+                texcoords[vertex_i].u = texcoords_min.u + (quantized.u * texcoords_scale.u);
+                texcoords[vertex_i].v = texcoords_min.v + (quantized.v * texcoords_scale.v);
+            }
+            vertices.texcoords = texcoords;
+        }
+        else {
+            vec3_soa_t positions = {
+                &lod->positions.x[first_vertex], &lod->positions.y[first_vertex], &lod->positions.z[first_vertex]
+            };
+            mat4_transform_points_soa(&jobs->vertex_matrix, &proj_matrix, &positions,
+                                      &vertices.camera_positions, &vertices.clip_positions, meshlet->num_vertices);
+            vertices.texcoords = &lod->texcoords[first_vertex];
+        }
+        if (clip_planes != 0) {
+            compute_outcodes(&vertices.camera_positions, vertices.outcodes, meshlet->num_vertices);
+        }
+
+        process_meshlet_faces(jobs, meshlet, clip_planes, &vertices, output);
+    }
+}
+
+// Move the job buffers, in job order, into the render queue, drawing what's in the queue
+// whenever it fills up. Returns how many triangles the jobs had to drop.
+static int move_job_buffers_to_render_queue(int num_jobs)
+{
+    int num_dropped_triangles = 0;
+
+    for (int job_index = 0; job_index < num_jobs; job_index++) {
+        triangle_buffer_t * buffer = &geometry_job_buffers[job_index];
+        num_dropped_triangles += buffer->num_dropped_triangles;
+
+        for (triangle_block_t * block = buffer->first_block; block != NULL; block = block->next) {
+            int num_copied = 0;
+
+            while (num_copied < block->num_triangles) {
+                if (render_queue_length == RENDER_QUEUE_SIZE) {
+                    flush_render_queue();
+                }
+
+                int num_to_copy = int_min(block->num_triangles - num_copied, RENDER_QUEUE_SIZE - render_queue_length);
+                memcpy(&render_queue[render_queue_length], &block->triangles[num_copied], num_to_copy * sizeof(triangle_t));
+                render_queue_length += num_to_copy;
+                num_copied += num_to_copy;
             }
         }
     }
+
+    return num_dropped_triangles;
+}
+
+/* /////////////////////////////////////////////////////////////////////////////
+// Process the graphics pipeline stages for all the mesh triangles
+///////////////////////////////////////////////////////////////////////////////
+// +-------------+
+// | Model space |  <-- mesh vertices, at the level of detail picked for the distance
+// +-------------+
+// |   +-------------+
+// `-> | World space |  <-- multiply by world matrix
+//     +-------------+
+//     |   +--------------+
+//     `-> | Camera space |  <-- multiply by view matrix (once per meshlet vertex)
+//         +--------------+
+//         |    +------------+
+//         `--> |  Clipping  |  <-- cull whole meshes, then meshlets, by their bounds, then
+//              |            |      outcodes per vertex, clip only straddling faces outside
+//              |            |      the guard band
+//              +------------+
+//              |    +------------+
+//              `--> | Projection |  <-- multiply by projection matrix
+//                   +------------+
+//                   |    +-------------+
+//                   `--> | Image space |  <-- apply perspective divide
+//                        +-------------+
+//                        |    +--------------+
+//                        `--> | Screen space |  <-- ready to render
+//                             +--------------+
+/////////////////////////////////////////////////////////////////////////////// */
+void process_graphics_pipeline_stages(instance_t * instance)
+{
+    mesh_t * mesh = get_mesh(instance->mesh_index);
+    geometry_jobs_t jobs = { .mesh = mesh };
+
+    // Combine the cached world and view matrices into one model-view matrix, so each
+    // vertex only needs a single matrix multiply to get from model space to camera space.
+    // Note that the order matters: the world matrix is applied first, then the view matrix.
+    jobs.model_view_matrix = mat4_mul_mat4(get_camera_view_matrix(), get_instance_world_matrix(instance));
+
+    // Check the mesh's bounds against the frustum first. Meshes that are completely outside
+    // it are skipped without touching a single vertex, and meshes that are completely inside
+    // don't need any of their faces clipped.
+    jobs.clip_planes = get_mesh_clip_planes(mesh, &jobs.model_view_matrix);
+    if (jobs.clip_planes < 0) {
+        return;
+    }
+
+    // Meshes far enough away are drawn with one of their simpler levels of detail. One
+    // unit at a depth of one unit covers proj_matrix.m[0][0] times half the window width.
+    int lod_index = 0;
+    if (g_use_lod) {
+        float pixels_per_unit = proj_matrix.m[0][0] * (get_window_width() / 2.0);
+        lod_index = select_mesh_lod(mesh, &jobs.model_view_matrix, pixels_per_unit);
+    }
+    jobs.lod = &mesh->lods[lod_index];
+
+    // Back-face culling and lighting use the face normals the mesh was loaded with, which
+    // are in model space, so bring the camera (the camera space origin) into model space.
+    jobs.model_view_inverse = mat4_inverse_affine(jobs.model_view_matrix);
+    jobs.model_camera_position = vec3_new(jobs.model_view_inverse.m[0][3],
+                                          jobs.model_view_inverse.m[1][3],
+                                          jobs.model_view_inverse.m[2][3]);
+    jobs.max_scale = mat4_get_max_scale(&jobs.model_view_matrix);
+
+    // Compact meshes' positions are quantized, and get back to model space on the way to
+    // camera space, in the same matrix multiply.
+    jobs.vertex_matrix = jobs.model_view_matrix;
+    if (mesh->is_compact) {
+        jobs.vertex_matrix = mat4_mul_mat4(jobs.model_view_matrix, mesh->dequantize_matrix);
+    }
+
+    // Split each batch of the level's meshlets up among the jobs, each one taking its meshlets
+    // all the way from culling to projected triangles, and writing them to its own triangle
+    // buffer.
+    int num_meshlets = array_length(jobs.lod->meshlets);
+    int num_dropped_triangles = 0;
+
+    for (jobs.first_item = 0; jobs.first_item < num_meshlets; jobs.first_item += MESHLETS_PER_BATCH) {
+        jobs.num_items = int_min(MESHLETS_PER_BATCH, num_meshlets - jobs.first_item);
+        jobs.num_jobs = get_num_geometry_jobs(jobs.num_items, MIN_MESHLETS_PER_JOB);
+
+        // The job buffers are only needed until they've been moved to the render queue.
+        size_t arena_mark = get_frame_arena_mark();
+
+        for (int job_index = 0; job_index < jobs.num_jobs; job_index++) {
+            triangle_buffer_t empty_buffer = { NULL, NULL, 0 };
+            geometry_job_buffers[job_index] = empty_buffer;
+        }
+
+        run_jobs(process_meshlets_job, &jobs, jobs.num_jobs);
+
+        num_dropped_triangles += move_job_buffers_to_render_queue(jobs.num_jobs);
+        rewind_frame_arena(arena_mark);
+    }
+
+    // Batches keep this from happening, unless FRAME_ARENA_SIZE gets too small for one.
+    if (num_dropped_triangles > 0) {
+        fprintf(stderr, "Error: frame arena is full, dropped %d triangles.\n", num_dropped_triangles);
+    }
+}
+
+// The instances cull_scene_bvh() found might be visible this frame.
+typedef struct {
+    int * instance_indices;
+    int num_instances;
+} visible_instances_t;
+
+// Called by cull_scene_bvh() for each instance that might be visible.
+static void add_visible_instance(int instance_index, void * data)
+{
+    visible_instances_t * visible = (visible_instances_t *)data;
+    visible->instance_indices[visible->num_instances] = instance_index;
+    visible->num_instances++;
+}
+
+// Send the visible instances down the pipeline, all the instances of one mesh right after
+// each other, so the mesh's vertices and faces are still in the cache for the next one.
+// The meshes go in the order their first instance was found in, and each mesh's instances
+// keep their order, so it's still roughly front to back (a stable counting sort).
+static void process_visible_instances(const visible_instances_t * visible)
+{
+    int num_meshes = get_num_meshes();
+    int * mesh_groups = (int *)frame_arena_alloc(num_meshes * sizeof(int));
+    int * group_starts = (int *)frame_arena_alloc((num_meshes + 1) * sizeof(int));
+    int * sorted_indices = (int *)frame_arena_alloc(visible->num_instances * sizeof(int));
+
+    if (!mesh_groups || !group_starts || !sorted_indices) {
+        fprintf(stderr, "Error: frame arena is full, drawing instances unsorted.\n");
+        for (int ii = 0; ii < visible->num_instances; ii++) {
+            process_graphics_pipeline_stages(get_instance(visible->instance_indices[ii]));
+        }
+        return;
+    }
+
+    for (int mesh_index = 0; mesh_index < num_meshes; mesh_index++) {
+        mesh_groups[mesh_index] = -1;
+    }
+
+    // Number the meshes in the order they're first seen, and count their instances.
+    int num_groups = 0;
+    for (int ii = 0; ii < visible->num_instances; ii++) {
+        int mesh_index = get_instance(visible->instance_indices[ii])->mesh_index;
+        if (mesh_groups[mesh_index] < 0) {
+            mesh_groups[mesh_index] = num_groups;
+            group_starts[num_groups] = 0;
+            num_groups++;
+        }
+        group_starts[mesh_groups[mesh_index]]++;
+    }
+
+    // Turn the counts into where each group starts.
+    int start = 0;
+    for (int group = 0; group < num_groups; group++) {
+        int count = group_starts[group];
+        group_starts[group] = start;
+        start += count;
+    }
+
+    for (int ii = 0; ii < visible->num_instances; ii++) {
+        int instance_index = visible->instance_indices[ii];
+        int group = mesh_groups[get_instance(instance_index)->mesh_index];
+        sorted_indices[group_starts[group]] = instance_index;
+        group_starts[group]++;
+    }
+
+    for (int ii = 0; ii < visible->num_instances; ii++) {
+        process_graphics_pipeline_stages(get_instance(sorted_indices[ii]));
+    }
 }
 
 void update(void)
@@ -407,119 +849,216 @@ void update(void)
     // How many ms have passed since we last were called?
     previous_frame_time = SDL_GetTicks();
 
-    // Reset the triangle counter for this tick.
-    num_triangles_to_render = 0;
+    // Everything from the last frame is done with, so start the frame arena and the
+    // render queue over.
+    reset_frame_arena();
+    render_queue_length = 0;
 
-    for (int mesh_index = 0; mesh_index < get_num_meshes(); mesh_index++)
-    {
-        mesh_t *mesh = get_mesh(mesh_index);
+    // Spin a few of the instances.
+    instance_t * instance = get_instance(1);
+    if (instance) {
+        update_instance_rotation(instance, vec3_add(instance->rotation, vec3_new(0.6 * delta_time_s, 0, 0)));
+    }
+    instance = get_instance(2);
+    if (instance) {
+        update_instance_rotation(instance, vec3_add(instance->rotation, vec3_new(0, 0.6 * delta_time_s, 0)));
+    }
+    instance = get_instance(3);
+    if (instance) {
+        update_instance_rotation(instance, vec3_add(instance->rotation, vec3_new(0, 0, 0.6 * delta_time_s)));
+    }
 
-        if (mesh_index == 1) {
-            mesh->rotation.x += 0.6 * delta_time_s;
-        }
-        else if (mesh_index == 2) {
-            mesh->rotation.y += 0.6 * delta_time_s;
-        }
-        else if (mesh_index == 3) {
-            mesh->rotation.z += 0.6 * delta_time_s;
-        }
+    // instance->scale.x += 0.02 * delta_time_s;
+    // instance->scale.y += 0.01 * delta_time_s;
+    // instance->scale.z += 0.03 * delta_time_s;
+
+    // instance->translation.x += 0.1 * delta_time_s;
+    // instance->translation.y += 0.2 * delta_time_s;
+
+    // Bring the scene BVH up to date with the instances that moved, and only send the
+    // instances that are at least partly inside the view frustum down the pipeline.
+    update_scene_bvh();
+
+    visible_instances_t visible = {
+        .instance_indices = (int *)frame_arena_alloc(get_num_instances() * sizeof(int)),
+        .num_instances = 0,
+    };
+    if (!visible.instance_indices) {
+        fprintf(stderr, "Error: frame arena is full, skipping the frame's geometry.\n");
+        return;
+    }
 
-        // mesh->scale.x += 0.02 * delta_time_s;
-        // mesh->scale.y += 0.01 * delta_time_s;
-        // mesh->scale.z += 0.03 * delta_time_s;
+    mat4_t view_matrix = get_camera_view_matrix();
+    cull_scene_bvh(&view_matrix, get_camera_position(), add_visible_instance, &visible);
+    process_visible_instances(&visible);
+}
+
+// Size of the dots drawn at each triangle vertex, in pixels.
+#define VERTEX_DOT_SIZE (3)
 
-        // mesh->translation.x += 0.1 * delta_time_s;
-        // mesh->translation.y += 0.2 * delta_time_s;
+// Clear a rectangle of the screen and draw the background grid in it.
+void clear_screen_rect(const screen_rect_t * rect)
+{
+    clear_color_buffer(0xFF000000, rect);
+    clear_z_buffer(rect);
 
-        // Translate the vertex away from the camera.
-        // mesh->translation.z = 5.0;
+    draw_grid(rect);
+}
 
-        process_graphics_pipeline_stages(mesh);
+// Depth pre-pass: draw only the depth of one projected triangle, if the current display
+// mode fills triangles, only touching the pixels inside clip_rect.
+void draw_triangle_depth_to_render(triangle_t * triangle_p, const screen_rect_t * clip_rect)
+{
+    triangle_t triangle = *triangle_p;
+
+    if (g_display_filled_trianges || g_display_texture) {
+        draw_triangle_depth(
+            triangle.points[0].x,
+            triangle.points[0].y,
+            triangle.reciprocal_w[0],
+            triangle.points[1].x,
+            triangle.points[1].y,
+            triangle.reciprocal_w[1],
+            triangle.points[2].x,
+            triangle.points[2].y,
+            triangle.reciprocal_w[2],
+            clip_rect);
     }
 }
 
-void render(void)
+// Draw one projected triangle in the current display mode, only touching the pixels
+// inside clip_rect.
+void draw_triangle_to_render(triangle_t * triangle_p, const screen_rect_t * clip_rect)
 {
-    clear_color_buffer(0xFF000000);
-    clear_z_buffer();
-
-    draw_grid();
-
-    // Loop all projected triangles and render them.
-
-    // earliest example:
-    //draw_filled_triangle(300, 100, 50, 400, 500, 700, 0xFF00FF00);
-
-    // triangles_to_render is already sorted from back to front.
-    for (int ii=0; ii < num_triangles_to_render; ii++) {
-        triangle_t triangle = triangles_to_render[ii];
-
-        if (g_display_filled_trianges) {
-            draw_filled_triangle(
-                triangle.points[0].x,
-                triangle.points[0].y,
-                triangle.points[0].z,
-                triangle.points[0].w,
-                triangle.points[1].x,
-                triangle.points[1].y,
-                triangle.points[1].z,
-                triangle.points[1].w,
-                triangle.points[2].x,
-                triangle.points[2].y,
-                triangle.points[2].z,
-                triangle.points[2].w,
-                triangle.color);
-        }
+    triangle_t triangle = *triangle_p;
+
+    // After a depth pre-pass, only the pixels that ended up in front get drawn.
+    depth_mode_t depth_mode = g_use_depth_prepass ? DEPTH_MODE_EQUAL : DEPTH_MODE_NORMAL;
+
+    if (g_display_filled_trianges) {
+        draw_filled_triangle(
+            triangle.points[0].x,
+            triangle.points[0].y,
+            triangle.points[0].z,
+            triangle.reciprocal_w[0],
+            triangle.points[1].x,
+            triangle.points[1].y,
+            triangle.points[1].z,
+            triangle.reciprocal_w[1],
+            triangle.points[2].x,
+            triangle.points[2].y,
+            triangle.points[2].z,
+            triangle.reciprocal_w[2],
+            triangle.color,
+            depth_mode,
+            clip_rect);
+    }
+
+    if (g_display_texture) {
+        draw_textured_triangle(
+            triangle.points[0].x,
+            triangle.points[0].y,
+            triangle.points[0].z,
+            triangle.reciprocal_w[0],
+            triangle.texcoords[0].u,
+            triangle.texcoords[0].v,
+            triangle.points[1].x,
+            triangle.points[1].y,
+            triangle.points[1].z,
+            triangle.reciprocal_w[1],
+            triangle.texcoords[1].u,
+            triangle.texcoords[1].v,
+            triangle.points[2].x,
+            triangle.points[2].y,
+            triangle.points[2].z,
+            triangle.reciprocal_w[2],
+            triangle.texcoords[2].u,
+            triangle.texcoords[2].v,
+            triangle.texture,
+            depth_mode,
+            clip_rect);
+    }
 
-        if (g_display_texture) {
-            draw_textured_triangle(
-                triangle.points[0].x,
-                triangle.points[0].y,
-                triangle.points[0].z,
-                triangle.points[0].w,
-                triangle.texcoords[0].u,
-                triangle.texcoords[0].v,
-                triangle.points[1].x,
-                triangle.points[1].y,
-                triangle.points[1].z,
-                triangle.points[1].w,
-                triangle.texcoords[1].u,
-                triangle.texcoords[1].v,
-                triangle.points[2].x,
-                triangle.points[2].y,
-                triangle.points[2].z,
-                triangle.points[2].w,
-                triangle.texcoords[2].u,
-                triangle.texcoords[2].v,
-                triangle.texture);
+    if (g_display_wireframe_lines) {
+        // Draw the outlines for the triangle.
+        draw_triangle(
+            triangle.points[0].x,
+            triangle.points[0].y,
+            triangle.points[1].x,
+            triangle.points[1].y,
+            triangle.points[2].x,
+            triangle.points[2].y,
+            0xFF0000FF,
+            clip_rect);
+    }
+
+    if (g_display_vertex_dot) {
+        // Draw each point as a small 4x4 yellow rectangle so we can see it.
+        draw_rect(triangle.points[0].x, triangle.points[0].y, VERTEX_DOT_SIZE, VERTEX_DOT_SIZE, 0xFFFF0000, clip_rect);
+        draw_rect(triangle.points[1].x, triangle.points[1].y, VERTEX_DOT_SIZE, VERTEX_DOT_SIZE, 0xFFFF0000, clip_rect);
+        draw_rect(triangle.points[2].x, triangle.points[2].y, VERTEX_DOT_SIZE, VERTEX_DOT_SIZE, 0xFFFF0000, clip_rect);
+    }
+}
+
+// Draw the triangles in the render queue, and empty it. The first flush of a frame
+// clears the screen, and later ones draw over it, which comes out the same as drawing
+// all of the frame's triangles at once (even with the depth pre-pass, since shading
+// leaves every pixel's depth in the z buffer).
+static void flush_render_queue(void)
+{
+    if (g_use_tiled_rendering) {
+        // Bin the triangles into screen tiles, and draw the tiles in parallel.
+        render_tiles(render_queue, render_queue_length, VERTEX_DOT_SIZE,
+                     is_frame_cleared ? NULL : clear_screen_rect,
+                     g_use_depth_prepass ? draw_triangle_depth_to_render : NULL,
+                     draw_triangle_to_render);
+    }
+    else {
+        // Draw all the triangles one after another over the whole screen.
+        screen_rect_t screen_rect = get_screen_rect();
+
+        if (! is_frame_cleared) {
+            clear_screen_rect(&screen_rect);
         }
 
-        if (g_display_wireframe_lines) {
-            // Draw the outlines for the triangle.
-            draw_triangle(
-                triangle.points[0].x,
-                triangle.points[0].y,
-                triangle.points[1].x,
-                triangle.points[1].y,
-                triangle.points[2].x,
-                triangle.points[2].y,
-                0xFF0000FF);
+        if (g_use_depth_prepass) {
+            for (int ii=0; ii < render_queue_length; ii++) {
+                draw_triangle_depth_to_render(&render_queue[ii], &screen_rect);
+            }
         }
 
-        if (g_display_vertex_dot) {
-            // Draw each point as a small 4x4 yellow rectangle so we can see it.
-            draw_rect(triangle.points[0].x, triangle.points[0].y, 3, 3, 0xFFFF0000);
-            draw_rect(triangle.points[1].x, triangle.points[1].y, 3, 3, 0xFFFF0000);
-            draw_rect(triangle.points[2].x, triangle.points[2].y, 3, 3, 0xFFFF0000);
+        for (int ii=0; ii < render_queue_length; ii++) {
+            draw_triangle_to_render(&render_queue[ii], &screen_rect);
         }
     }
 
+    render_queue_length = 0;
+    is_frame_cleared = true;
+}
+
+void render(void)
+{
+    // Draw whatever's left in the render queue (which also clears the screen, if the
+    // queue never filled up this frame), and show the frame.
+    flush_render_queue();
     render_color_buffer();
+
+    is_frame_cleared = false;
 }
 
 void free_resources(void)
 {
+    destroy_thread_pool();
+    free_tiles();
+
+    free_scene_bvh();
     free_meshes();
+
+    printf("Frame arena peak usage: %zu of %zu bytes.\n", get_frame_arena_peak(), get_frame_arena_capacity());
+    free_frame_arena();
+
+    free(render_queue);
+    render_queue = NULL;
 }
 
 int main(void) {
@@ -1,5 +1,7 @@
 #include <math.h>
+#include <stddef.h>
 #include "matrix.h"
+#include "simd.h"
 
 vec4_t mat4_mul_vec4(mat4_t m, vec4_t v)
 {
@@ -176,6 +178,58 @@ vec4_t mat4_mul_vec4_project(mat4_t mat_proj, vec4_t v)
     return result;
 }
 
+// The most the matrix stretches any direction by (ignoring skew), which is the length of
+// the longest of its first three columns. Handy for growing a bounding sphere's radius.
+float mat4_get_max_scale(const mat4_t * m)
+{
+    float max_scale_squared = 0.0;
+    for (int column = 0; column < 3; column++) {
+        float scale_squared = (m->m[0][column] * m->m[0][column])
+                            + (m->m[1][column] * m->m[1][column])
+                            + (m->m[2][column] * m->m[2][column]);
+        max_scale_squared = fmaxf(max_scale_squared, scale_squared);
+    }
+    return sqrtf(max_scale_squared);
+}
+
+// Invert a matrix that only scales, rotates, and translates (the bottom row is 0 0 0 1).
+// The upper 3x3 part's inverse is its adjugate (the transposed cofactors) divided by its
+// determinant, and the translation is undone by moving back through that inverse.
+// Matrices with no inverse, like ones with a zero scale, give all zeros.
+mat4_t mat4_inverse_affine(mat4_t m)
+{
+    mat4_t inverse = {{{ 0 }}};
+
+    float cofactor_00 = (m.m[1][1] * m.m[2][2]) - (m.m[1][2] * m.m[2][1]);
+    float cofactor_01 = (m.m[1][2] * m.m[2][0]) - (m.m[1][0] * m.m[2][2]);
+    float cofactor_02 = (m.m[1][0] * m.m[2][1]) - (m.m[1][1] * m.m[2][0]);
+    float determinant = (m.m[0][0] * cofactor_00) + (m.m[0][1] * cofactor_01) + (m.m[0][2] * cofactor_02);
+
+    if (determinant == 0.0) {
+        return inverse;
+    }
+
+    float scale = 1.0 / determinant;
+    inverse.m[0][0] = cofactor_00 * scale;
+    inverse.m[1][0] = cofactor_01 * scale;
+    inverse.m[2][0] = cofactor_02 * scale;
+    inverse.m[0][1] = ((m.m[0][2] * m.m[2][1]) - (m.m[0][1] * m.m[2][2])) * scale;
+    inverse.m[1][1] = ((m.m[0][0] * m.m[2][2]) - (m.m[0][2] * m.m[2][0])) * scale;
+    inverse.m[2][1] = ((m.m[0][1] * m.m[2][0]) - (m.m[0][0] * m.m[2][1])) * scale;
+    inverse.m[0][2] = ((m.m[0][1] * m.m[1][2]) - (m.m[0][2] * m.m[1][1])) * scale;
+    inverse.m[1][2] = ((m.m[0][2] * m.m[1][0]) - (m.m[0][0] * m.m[1][2])) * scale;
+    inverse.m[2][2] = ((m.m[0][0] * m.m[1][1]) - (m.m[0][1] * m.m[1][0])) * scale;
+
+    for (int row = 0; row < 3; row++) {
+        inverse.m[row][3] = -((inverse.m[row][0] * m.m[0][3]) +
+                              (inverse.m[row][1] * m.m[1][3]) +
+                              (inverse.m[row][2] * m.m[2][3]));
+    }
+    inverse.m[3][3] = 1.0;
+
+    return inverse;
+}
+
 mat4_t mat4_look_at(vec3_t eye,     // position of camera
                     vec3_t target,  // what the camera is looking at
                     vec3_t up)      // "up" or vertical direction from camera
@@ -206,4 +260,102 @@ mat4_t mat4_look_at(vec3_t eye,     // position of camera
 
     return view_matrix;
 
-}
\ No newline at end of file
+}
+
+/*/////////////////////////////////////////////////////////////////////////////
+// Transform a whole batch of points stored as struct-of-arrays
+///////////////////////////////////////////////////////////////////////////////
+// Every input point is (x, y, z, 1). The model-view matrix is affine (its bottom
+// row is 0 0 0 1), so the camera space result only needs x, y, and z.
+//
+// If clip_out is not NULL, the camera space point is also multiplied by the
+// projection matrix in the same pass, giving the clip space x, y, z, and w
+// (before the perspective divide).
+//
+// SIMD_WIDTH points are transformed per loop iteration (see simd.h), and the
+// last few points that don't fill a whole SIMD register are done one at a time
+// with the same math.
+//
+// The points come either as floats (in) or as 16-bit integers (quantized_in)
+// for compact meshes. The 16-bit ones are turned into floats as they're loaded,
+// and the model-view matrix includes the scale and offset back to model space.
+/////////////////////////////////////////////////////////////////////////////*/
+static inline void transform_points_soa(const mat4_t * model_view, const mat4_t * proj,
+                                        const vec3_soa_t * in, const vec3_i16_soa_t * quantized_in,
+                                        vec3_soa_t * camera_out, vec4_soa_t * clip_out, int count)
+{
+    const float (*mv)[4] = model_view->m;
+
+    // The projection matrix is only used when clip space output was asked for.
+    mat4_t proj_matrix = (proj != NULL) ? *proj : mat4_identity();
+    const float (*p)[4] = proj_matrix.m;
+
+    int ii = 0;
+
+    // Broadcast each matrix element across a SIMD register once, outside the loop.
+    simd_float_t mv00 = simd_set1(mv[0][0]), mv01 = simd_set1(mv[0][1]), mv02 = simd_set1(mv[0][2]), mv03 = simd_set1(mv[0][3]);
+    simd_float_t mv10 = simd_set1(mv[1][0]), mv11 = simd_set1(mv[1][1]), mv12 = simd_set1(mv[1][2]), mv13 = simd_set1(mv[1][3]);
+    simd_float_t mv20 = simd_set1(mv[2][0]), mv21 = simd_set1(mv[2][1]), mv22 = simd_set1(mv[2][2]), mv23 = simd_set1(mv[2][3]);
+
+    simd_float_t p00 = simd_set1(p[0][0]), p01 = simd_set1(p[0][1]), p02 = simd_set1(p[0][2]), p03 = simd_set1(p[0][3]);
+    simd_float_t p10 = simd_set1(p[1][0]), p11 = simd_set1(p[1][1]), p12 = simd_set1(p[1][2]), p13 = simd_set1(p[1][3]);
+    simd_float_t p20 = simd_set1(p[2][0]), p21 = simd_set1(p[2][1]), p22 = simd_set1(p[2][2]), p23 = simd_set1(p[2][3]);
+    simd_float_t p30 = simd_set1(p[3][0]), p31 = simd_set1(p[3][1]), p32 = simd_set1(p[3][2]), p33 = simd_set1(p[3][3]);
+
+    for (; ii + SIMD_WIDTH <= count; ii += SIMD_WIDTH) {
+        simd_float_t x = (in != NULL) ? simd_load(&in->x[ii]) : simd_load_int16(&quantized_in->x[ii]);
+        simd_float_t y = (in != NULL) ? simd_load(&in->y[ii]) : simd_load_int16(&quantized_in->y[ii]);
+        simd_float_t z = (in != NULL) ? simd_load(&in->z[ii]) : simd_load_int16(&quantized_in->z[ii]);
+
+        simd_float_t cx = simd_add(simd_add(simd_add(simd_mul(mv00, x), simd_mul(mv01, y)), simd_mul(mv02, z)), mv03);
+        simd_float_t cy = simd_add(simd_add(simd_add(simd_mul(mv10, x), simd_mul(mv11, y)), simd_mul(mv12, z)), mv13);
+        simd_float_t cz = simd_add(simd_add(simd_add(simd_mul(mv20, x), simd_mul(mv21, y)), simd_mul(mv22, z)), mv23);
+
+        simd_store(&camera_out->x[ii], cx);
+        simd_store(&camera_out->y[ii], cy);
+        simd_store(&camera_out->z[ii], cz);
+
+        if (clip_out != NULL) {
+            simd_store(&clip_out->x[ii], simd_add(simd_add(simd_add(simd_mul(p00, cx), simd_mul(p01, cy)), simd_mul(p02, cz)), p03));
+            simd_store(&clip_out->y[ii], simd_add(simd_add(simd_add(simd_mul(p10, cx), simd_mul(p11, cy)), simd_mul(p12, cz)), p13));
+            simd_store(&clip_out->z[ii], simd_add(simd_add(simd_add(simd_mul(p20, cx), simd_mul(p21, cy)), simd_mul(p22, cz)), p23));
+            simd_store(&clip_out->w[ii], simd_add(simd_add(simd_add(simd_mul(p30, cx), simd_mul(p31, cy)), simd_mul(p32, cz)), p33));
+        }
+    }
+
+    // Finish the points that didn't fill a whole SIMD register.
+    for (; ii < count; ii++) {
+        float x = (in != NULL) ? in->x[ii] : quantized_in->x[ii];
+        float y = (in != NULL) ? in->y[ii] : quantized_in->y[ii];
+        float z = (in != NULL) ? in->z[ii] : quantized_in->z[ii];
+
+        float cx = mv[0][0] * x + mv[0][1] * y + mv[0][2] * z + mv[0][3];
+        float cy = mv[1][0] * x + mv[1][1] * y + mv[1][2] * z + mv[1][3];
+        float cz = mv[2][0] * x + mv[2][1] * y + mv[2][2] * z + mv[2][3];
+
+        camera_out->x[ii] = cx;
+        camera_out->y[ii] = cy;
+        camera_out->z[ii] = cz;
+
+        if (clip_out != NULL) {
+            clip_out->x[ii] = p[0][0] * cx + p[0][1] * cy + p[0][2] * cz + p[0][3];
+            clip_out->y[ii] = p[1][0] * cx + p[1][1] * cy + p[1][2] * cz + p[1][3];
+            clip_out->z[ii] = p[2][0] * cx + p[2][1] * cy + p[2][2] * cz + p[2][3];
+            clip_out->w[ii] = p[3][0] * cx + p[3][1] * cy + p[3][2] * cz + p[3][3];
+        }
+    }
+}
+
+void mat4_transform_points_soa(const mat4_t * model_view, const mat4_t * proj,
+                               const vec3_soa_t * in, vec3_soa_t * camera_out, vec4_soa_t * clip_out,
+                               int count)
+{
+    transform_points_soa(model_view, proj, in, NULL, camera_out, clip_out, count);
+}
+
+void mat4_transform_quantized_points_soa(const mat4_t * model_view, const mat4_t * proj,
+                                         const vec3_i16_soa_t * in, vec3_soa_t * camera_out, vec4_soa_t * clip_out,
+                                         int count)
+{
+    transform_points_soa(model_view, proj, NULL, in, camera_out, clip_out, count);
+}
@@ -18,5 +18,14 @@ mat4_t mat4_make_rotation_z(float angle);
 
 mat4_t mat4_make_projection(float fov /* field of view angle*/, float aspect /* screen h/w */, float znear, float zfar);
 vec4_t mat4_mul_vec4_project(mat4_t mat_proj, vec4_t v);
+float mat4_get_max_scale(const mat4_t * m);
+mat4_t mat4_inverse_affine(mat4_t m);
 
-mat4_t mat4_look_at(vec3_t eye, vec3_t target, vec3_t up);
\ No newline at end of file
+mat4_t mat4_look_at(vec3_t eye, vec3_t target, vec3_t up);
+
+void mat4_transform_points_soa(const mat4_t * model_view, const mat4_t * proj,
+                               const vec3_soa_t * in, vec3_soa_t * camera_out, vec4_soa_t * clip_out,
+                               int count);
+void mat4_transform_quantized_points_soa(const mat4_t * model_view, const mat4_t * proj,
+                                         const vec3_i16_soa_t * in, vec3_soa_t * camera_out, vec4_soa_t * clip_out,
+                                         int count);
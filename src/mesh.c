@@ -1,16 +1,31 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <math.h>
 #include <string.h>
 
 #include "gfx-vector.h"
 
 #include "mesh.h"
 #include "array.h"
+#include "bvh.h"
+#include "lod.h"
+#include "meshlet.h"
+#include "vertex_cache.h"
 
-#define MAX_NUM_MESHES (10)
-static mesh_t meshes[MAX_NUM_MESHES];
-static int mesh_count = 0;
+// All the loaded meshes, and the instances placing them in the world, in dynamic arrays
+// grown by load_mesh(). Growing can move them, so don't hold on to get_mesh() or
+// get_instance() pointers across a load_mesh() call.
+static mesh_t * meshes = NULL;
+static instance_t * instances = NULL;
+
+// Textures converted from PNG files, shared by all the meshes that use the same file.
+typedef struct {
+    char * filename;
+    texture_t * texture;
+} loaded_texture_t;
+
+static loaded_texture_t * loaded_textures = NULL;
 
 // Using left hand coordinate system
 //           +y  +z
@@ -23,35 +38,290 @@ static int mesh_count = 0;
 //        /  |
 //
 
+// Free everything the mesh owns. Its texture belongs to loaded_textures, so it's left
+// alone. Works on a mesh that only got partway through loading, too.
+static void free_mesh_data(mesh_t * mesh)
+{
+    free(mesh->obj_filename);
+    free(mesh->png_filename);
+    for (int lod_index = 0; lod_index < mesh->num_lods; lod_index++) {
+        array_free(mesh->lods[lod_index].faces);
+        array_free(mesh->lods[lod_index].vertices);
+        array_free(mesh->lods[lod_index].meshlets);
+        array_free(mesh->lods[lod_index].meshlet_faces);
+        array_free(mesh->lods[lod_index].meshlet_indices);
+        vec3_soa_free(&mesh->lods[lod_index].positions);
+        free(mesh->lods[lod_index].texcoords);
+        vec3_i16_soa_free(&mesh->lods[lod_index].quantized_positions);
+        free(mesh->lods[lod_index].quantized_texcoords);
+    }
+}
+
 void free_meshes(void)
 {
-    for (int mesh_index = 0; mesh_index < mesh_count; mesh_index++) {
-        array_free(meshes[mesh_index].faces);
-        array_free(meshes[mesh_index].vertices);
+    for (int mesh_index = 0; mesh_index < array_length(meshes); mesh_index++) {
+        free_mesh_data(&meshes[mesh_index]);
+    }
 
-        if (meshes[mesh_index].texture)
-        {
-            upng_free(meshes[mesh_index].texture);
-        }
+    for (int texture_index = 0; texture_index < array_length(loaded_textures); texture_index++) {
+        free(loaded_textures[texture_index].filename);
+        texture_free(loaded_textures[texture_index].texture);
     }
+
+    array_free(meshes);
+    array_free(instances);
+    array_free(loaded_textures);
+    meshes = NULL;
+    instances = NULL;
+    loaded_textures = NULL;
 }
 
 int get_num_meshes(void)
 {
-    return mesh_count;
+    return array_length(meshes);
 }
 
 mesh_t * get_mesh(int index)
 {
     mesh_t * ret = NULL;
 
-    if ((index >= 0) && (index < mesh_count)) {
+    if ((index >= 0) && (index < array_length(meshes))) {
         ret =  &(meshes[index]);
     }
 
     return ret;
 }
 
+int get_num_instances(void)
+{
+    return array_length(instances);
+}
+
+instance_t * get_instance(int index)
+{
+    instance_t * ret = NULL;
+
+    if ((index >= 0) && (index < array_length(instances))) {
+        ret =  &(instances[index]);
+    }
+
+    return ret;
+}
+
+void update_instance_scale(instance_t * instance, vec3_t scale)
+{
+    instance->scale = scale;
+    instance->world_matrix_dirty = true;
+    mark_scene_bvh_object_moved(instance - instances);
+}
+
+void update_instance_rotation(instance_t * instance, vec3_t rotation)
+{
+    instance->rotation = rotation;
+    instance->world_matrix_dirty = true;
+    mark_scene_bvh_object_moved(instance - instances);
+}
+
+void update_instance_translation(instance_t * instance, vec3_t translation)
+{
+    instance->translation = translation;
+    instance->world_matrix_dirty = true;
+    mark_scene_bvh_object_moved(instance - instances);
+}
+
+mat4_t get_instance_world_matrix(instance_t * instance)
+{
+    if (instance->world_matrix_dirty) {
+        // Create scale, translation, and rotation matrices that will be used to multiply the mesh vertices.
+        mat4_t scale_matrix = mat4_make_scale(instance->scale.x, instance->scale.y, instance->scale.z);
+        mat4_t translation_matrix = mat4_make_translation(instance->translation.x, instance->translation.y, instance->translation.z);
+        mat4_t rotation_matrix_x = mat4_make_rotation_x(instance->rotation.x);
+        mat4_t rotation_matrix_y = mat4_make_rotation_y(instance->rotation.y);
+        mat4_t rotation_matrix_z = mat4_make_rotation_z(instance->rotation.z);
+
+        // Creating a single World Matrix combining the scale, rotation, and translation matrices.
+        // Note that the order matters: Must be scale first, then rotation, and finally translation last.
+        mat4_t world_matrix = mat4_identity();
+        world_matrix = mat4_mul_mat4(scale_matrix, world_matrix);
+        world_matrix = mat4_mul_mat4(rotation_matrix_x, world_matrix);
+        world_matrix = mat4_mul_mat4(rotation_matrix_y, world_matrix);
+        world_matrix = mat4_mul_mat4(rotation_matrix_z, world_matrix);
+        world_matrix = mat4_mul_mat4(translation_matrix, world_matrix);
+
+        instance->world_matrix = world_matrix;
+        instance->world_matrix_dirty = false;
+
+        // The world space box has to hold the transformed model space box. Its center
+        // goes through the matrix, and each of its half sizes picks up the matching
+        // row of the matrix, made positive, times the model space half sizes.
+        const mesh_t * mesh = &meshes[instance->mesh_index];
+        vec3_t center = vec3_mul(vec3_add(mesh->bounds_min, mesh->bounds_max), 0.5);
+        vec3_t half_size = vec3_mul(vec3_sub(mesh->bounds_max, mesh->bounds_min), 0.5);
+        vec3_t world_center = vec3_from_vec4(mat4_mul_vec4(world_matrix, vec4_from_vec3(center)));
+        const float (*m)[4] = world_matrix.m;
+        vec3_t world_half_size = {
+            (fabsf(m[0][0]) * half_size.x) + (fabsf(m[0][1]) * half_size.y) + (fabsf(m[0][2]) * half_size.z),
+            (fabsf(m[1][0]) * half_size.x) + (fabsf(m[1][1]) * half_size.y) + (fabsf(m[1][2]) * half_size.z),
+            (fabsf(m[2][0]) * half_size.x) + (fabsf(m[2][1]) * half_size.y) + (fabsf(m[2][2]) * half_size.z),
+        };
+
+        instance->world_bounds_min = vec3_sub(world_center, world_half_size);
+        instance->world_bounds_max = vec3_add(world_center, world_half_size);
+    }
+
+    return instance->world_matrix;
+}
+
+void get_instance_world_bounds(instance_t * instance, vec3_t * bounds_min, vec3_t * bounds_max)
+{
+    get_instance_world_matrix(instance); // rebuilds the cached bounds too, if needed
+
+    *bounds_min = instance->world_bounds_min;
+    *bounds_max = instance->world_bounds_max;
+}
+
+// Work out the model space plane of each of the level's faces once, so back-face culling
+// and lighting don't need the normals worked out again from the transformed vertices.
+void compute_face_planes(mesh_lod_t * lod)
+{
+    for (int face_i = 0; face_i < array_length(lod->faces); face_i++) {
+        face_t * face = &lod->faces[face_i];
+        vec3_t vertices[3] = { lod->vertices[face->a], lod->vertices[face->b], lod->vertices[face->c] };
+
+        // Faces with no area have no normal, and never get culled.
+        vec3_t edge_cross = vec3_cross(vec3_sub(vertices[1], vertices[0]), vec3_sub(vertices[2], vertices[0]));
+        if (vec3_length(edge_cross) == 0.0) {
+            face->normal = vec3_new(0, 0, 0);
+            face->distance = 0.0;
+            continue;
+        }
+
+        face->normal = get_triangle_normal(vertices);
+        face->distance = vec3_dot(face->normal, vertices[0]);
+    }
+}
+
+// Work out the mesh's model space bounds from its vertices: an axis-aligned box, and a
+// sphere around the box's center that's just big enough to hold every vertex (usually a
+// lot smaller than the one around the box's corners).
+static void compute_mesh_bounds(mesh_t * mesh)
+{
+    vec3_t * vertices = mesh->lods[0].vertices;
+    int num_vertices = array_length(vertices);
+
+    mesh->bounds_min = vec3_new(0, 0, 0);
+    mesh->bounds_max = vec3_new(0, 0, 0);
+    mesh->bounds_center = vec3_new(0, 0, 0);
+    mesh->bounds_radius = 0.0;
+
+    if (num_vertices == 0) {
+        return;
+    }
+
+    mesh->bounds_min = vertices[0];
+    mesh->bounds_max = vertices[0];
+
+    for (int vertex_i = 1; vertex_i < num_vertices; vertex_i++) {
+        vec3_t vertex = vertices[vertex_i];
+        mesh->bounds_min.x = fminf(mesh->bounds_min.x, vertex.x);
+        mesh->bounds_min.y = fminf(mesh->bounds_min.y, vertex.y);
+        mesh->bounds_min.z = fminf(mesh->bounds_min.z, vertex.z);
+        mesh->bounds_max.x = fmaxf(mesh->bounds_max.x, vertex.x);
+        mesh->bounds_max.y = fmaxf(mesh->bounds_max.y, vertex.y);
+        mesh->bounds_max.z = fmaxf(mesh->bounds_max.z, vertex.z);
+    }
+
+    mesh->bounds_center = vec3_mul(vec3_add(mesh->bounds_min, mesh->bounds_max), 0.5);
+
+    for (int vertex_i = 0; vertex_i < num_vertices; vertex_i++) {
+        float distance = vec3_length(vec3_sub(vertices[vertex_i], mesh->bounds_center));
+        mesh->bounds_radius = fmaxf(mesh->bounds_radius, distance);
+    }
+}
+
+// Set up a compact mesh's quantization from its bounds and level 0's UVs: positions
+// go from -32767 to 32767 across the bounding box, and UVs from 0 to 65535 across
+// their range. Quantized positions can land up to half a step outside the box, so
+// the bounds grow by a step.
+static void set_up_mesh_quantization(mesh_t * mesh)
+{
+    vec3_t center = vec3_mul(vec3_add(mesh->bounds_min, mesh->bounds_max), 0.5);
+    vec3_t step = vec3_div(vec3_sub(mesh->bounds_max, mesh->bounds_min), 2.0 * 32767.0);
+
+    mesh->is_compact = true;
+    mesh->dequantize_matrix = mat4_mul_mat4(mat4_make_translation(center.x, center.y, center.z),
+                                            mat4_make_scale(step.x, step.y, step.z));
+    mesh->bounds_min = vec3_sub(mesh->bounds_min, step);
+    mesh->bounds_max = vec3_add(mesh->bounds_max, step);
+    mesh->bounds_radius += vec3_length(step);
+
+    face_t * faces = mesh->lods[0].faces;
+    tex2_t texcoords_min = { 0.0, 0.0 };
+    tex2_t texcoords_max = { 0.0, 0.0 };
+    if (array_length(faces) > 0) {
+        texcoords_min = faces[0].a_uv;
+        texcoords_max = faces[0].a_uv;
+    }
+
+    for (int face_i = 0; face_i < array_length(faces); face_i++) {
+        tex2_t texcoords[3] = { faces[face_i].a_uv, faces[face_i].b_uv, faces[face_i].c_uv };
+        for (int corner = 0; corner < 3; corner++) {
+            texcoords_min.u = fminf(texcoords_min.u, texcoords[corner].u);
+            texcoords_min.v = fminf(texcoords_min.v, texcoords[corner].v);
+            texcoords_max.u = fmaxf(texcoords_max.u, texcoords[corner].u);
+            texcoords_max.v = fmaxf(texcoords_max.v, texcoords[corner].v);
+        }
+    }
+
+    mesh->texcoords_min = texcoords_min;
+    mesh->texcoords_scale.u = (texcoords_max.u - texcoords_min.u) / 65535.0;
+    mesh->texcoords_scale.v = (texcoords_max.v - texcoords_min.v) / 65535.0;
+}
+
+/*/////////////////////////////////////////////////////////////////////////////
+// Which frustum planes does the whole mesh need clipping against?
+///////////////////////////////////////////////////////////////////////////////
+// Returns -1 if the mesh is completely outside the frustum, 0 if it's completely
+// inside (the guard band, for the left, right, top, and bottom planes), and
+// otherwise the FRUSTUM_PLANE_BIT()s its faces might need clipping against,
+// like get_triangle_clip_planes() does for one face.
+// The bounding sphere is cheap to test, and settles it for most meshes. Meshes
+// whose sphere crosses a plane get a second look with the corners of their
+// bounding box, which usually fits tighter.
+/////////////////////////////////////////////////////////////////////////////*/
+int get_mesh_clip_planes(mesh_t * mesh, const mat4_t * model_view)
+{
+    // The view matrix doesn't scale, so the sphere's radius only grows by the world matrix's
+    // biggest scale factor.
+    vec3_t center = vec3_from_vec4(mat4_mul_vec4(*model_view, vec4_from_vec3(mesh->bounds_center)));
+    int clip_planes = get_sphere_clip_planes(center, mesh->bounds_radius * mat4_get_max_scale(model_view));
+    if (clip_planes <= 0) {
+        return clip_planes;
+    }
+
+    float corners_x[8], corners_y[8], corners_z[8];
+    float camera_x[8], camera_y[8], camera_z[8];
+    for (int corner = 0; corner < 8; corner++) {
+        corners_x[corner] = (corner & 1) ? mesh->bounds_max.x : mesh->bounds_min.x;
+        corners_y[corner] = (corner & 2) ? mesh->bounds_max.y : mesh->bounds_min.y;
+        corners_z[corner] = (corner & 4) ? mesh->bounds_max.z : mesh->bounds_min.z;
+    }
+
+    vec3_soa_t corners = { corners_x, corners_y, corners_z };
+    vec3_soa_t camera_corners = { camera_x, camera_y, camera_z };
+    outcode_t outcodes[8];
+
+    mat4_transform_points_soa(model_view, NULL, &corners, &camera_corners, NULL, 8);
+    compute_outcodes(&camera_corners, outcodes, 8);
+
+    // Both tests are safe on their own, so a plane only needs clipping if both say so.
+    int box_clip_planes = get_points_clip_planes(outcodes, 8);
+    if (box_clip_planes < 0) {
+        return -1;
+    }
+    return clip_planes & box_clip_planes;
+}
+
 bool load_mesh_obj_data(mesh_t *mesh, char * obj_filename)
 {
     FILE * fp = fopen(obj_filename, "r");
@@ -91,7 +361,7 @@ bool load_mesh_obj_data(mesh_t *mesh, char * obj_filename)
                 all_good = false;
                 break;
             }
-            array_push(mesh->vertices, vertex);
+            array_push(mesh->lods[0].vertices, vertex);
         } else if (strncmp(line, "vt ", 3) == 0) {
             // Texture coordinate info.
             texture_num++;
@@ -141,12 +411,17 @@ bool load_mesh_obj_data(mesh_t *mesh, char * obj_filename)
                 .c_uv = texcoords[texture_indices[2] - 1],
                 .color = 0xFFFFFFFF
             };
-            array_push(mesh->faces, face);
+            array_push(mesh->lods[0].faces, face);
         }
     }
 
     array_free(texcoords);
 
+    if (all_good) {
+        compute_face_planes(&mesh->lods[0]);
+        compute_mesh_bounds(mesh);
+    }
+
     if (fp) {
         fclose(fp);
     }
@@ -158,8 +433,25 @@ bool load_mesh_obj_data(mesh_t *mesh, char * obj_filename)
     return all_good;
 }
 
+static char * copy_string(const char * string)
+{
+    char * copy = (char *)malloc(strlen(string) + 1);
+    if (copy) {
+        strcpy(copy, string);
+    }
+    return copy;
+}
+
 bool load_mesh_png_data(mesh_t * mesh, char * png_filename)
 {
+    // Only decode and convert each PNG file once.
+    for (int texture_index = 0; texture_index < array_length(loaded_textures); texture_index++) {
+        if (strcmp(loaded_textures[texture_index].filename, png_filename) == 0) {
+            mesh->texture = loaded_textures[texture_index].texture;
+            return true;
+        }
+    }
+
     bool all_good = false;
 
     upng_t * png_image = upng_new_from_file(png_filename);
@@ -169,42 +461,135 @@ bool load_mesh_png_data(mesh_t * mesh, char * png_filename)
         upng_error error = upng_get_error(png_image);
         fprintf(stderr, "upng_get_error returned: %d\n", error);
         if (error == UPNG_EOK) {
-            mesh->texture = png_image;
-            all_good = true;
+            // The rasterizer only needs the converted texture, not the PNG.
+            texture_t * texture = texture_from_png(png_image);
+            if (texture) {
+                loaded_texture_t loaded_texture = { copy_string(png_filename), texture };
+                array_push(loaded_textures, loaded_texture);
+                mesh->texture = texture;
+                all_good = true;
+            }
         }
+        upng_free(png_image);
     }
 
     return all_good;
 }
 
-bool load_mesh(char * obj_filename, char * png_texture_filename,
-               vec3_t scale, vec3_t translation, vec3_t rotation)
+// Find the mesh loaded from these files, or load it. Returns the mesh's index, or -1
+// if it couldn't be loaded.
+static int find_or_load_mesh(char * obj_filename, char * png_texture_filename)
 {
-    if (mesh_count >= MAX_NUM_MESHES) {
-        fprintf(stderr, "ERROR: too many meshes, can only have %d\n", MAX_NUM_MESHES);
-        return false;
+    for (int mesh_index = 0; mesh_index < array_length(meshes); mesh_index++) {
+        if ((strcmp(meshes[mesh_index].obj_filename, obj_filename) == 0) &&
+            (strcmp(meshes[mesh_index].png_filename, png_texture_filename) == 0)) {
+            return mesh_index;
+        }
     }
 
-    mesh_t * new_mesh = &(meshes[mesh_count]);
+    mesh_t new_mesh;
+    memset(&new_mesh, 0, sizeof(mesh_t));
+    new_mesh.num_lods = 1;
 
-    bool all_good = load_mesh_obj_data(new_mesh, obj_filename);
+    bool all_good = load_mesh_obj_data(&new_mesh, obj_filename);
     if (! all_good) {
         fprintf(stderr, "Error: load_mesh_obj_data failed on filename: %s\n", obj_filename);
-        return false;
+        free_mesh_data(&new_mesh);
+        return -1;
+    }
+
+    // Put the faces and vertices in an order that reuses vertices, so the simplifier
+    // and the meshlets below walk the vertices mostly in order.
+    float old_miss_ratio = get_vertex_cache_miss_ratio(new_mesh.lods[0].faces);
+    if (! optimize_vertex_cache(&new_mesh.lods[0])) {
+        free_mesh_data(&new_mesh);
+        return -1;
     }
+    printf("Reordered faces for the vertex cache: ACMR %.3f before, %.3f after.\n",
+           old_miss_ratio, get_vertex_cache_miss_ratio(new_mesh.lods[0].faces));
+
+    // Simplify the mesh into its levels of detail, and split each level into meshlets.
+    // Splitting is last, since the levels' own vertices and faces aren't kept after it.
+    // Simplifying leaves holes in level 0's order, so the simpler levels get reordered too.
+    if (! build_mesh_lods(&new_mesh)) {
+        free_mesh_data(&new_mesh);
+        return -1;
+    }
+
+    // Compact meshes quantize every level against level 0's bounds and UVs.
+    if (COMPACT_MESH_STORAGE) {
+        set_up_mesh_quantization(&new_mesh);
+    }
+
+    int num_meshlets = 0;
+    int num_bytes = 0;
+    int vertex_bytes = new_mesh.is_compact ? (3 * sizeof(int16_t)) + sizeof(tex2_u16_t) : (3 * sizeof(float)) + sizeof(tex2_t);
+
+    for (int lod_index = 0; lod_index < new_mesh.num_lods; lod_index++) {
+        mesh_lod_t * lod = &new_mesh.lods[lod_index];
+        if ((lod_index > 0) && ! optimize_vertex_cache(lod)) {
+            free_mesh_data(&new_mesh);
+            return -1;
+        }
+        if (! build_meshlets(&new_mesh, lod)) {
+            free_mesh_data(&new_mesh);
+            return -1;
+        }
 
-    all_good = load_mesh_png_data(new_mesh, png_texture_filename);
+        // Drawing only uses the meshlets from here on.
+        array_free(lod->vertices);
+        array_free(lod->faces);
+        lod->vertices = NULL;
+        lod->faces = NULL;
+
+        int num_meshlet_vertices = 0;
+        for (int meshlet_i = 0; meshlet_i < array_length(lod->meshlets); meshlet_i++) {
+            num_meshlet_vertices += lod->meshlets[meshlet_i].num_vertices;
+        }
+        num_meshlets += array_length(lod->meshlets);
+        num_bytes += (array_length(lod->meshlets) * sizeof(meshlet_t)) +
+                     (array_length(lod->meshlet_faces) * (sizeof(meshlet_face_t) + 3)) +
+                     (num_meshlet_vertices * vertex_bytes);
+    }
+    printf("Stored %d meshlets in %d KB, with %s vertices.\n", num_meshlets, num_bytes / 1024,
+           new_mesh.is_compact ? "16-bit" : "float");
+
+    all_good = load_mesh_png_data(&new_mesh, png_texture_filename);
 
     if (! all_good) {
         fprintf(stderr, "Error: load_mesh_png_data failed on filename: %s\n", png_texture_filename);
+        free_mesh_data(&new_mesh);
+        return -1;
+    }
+
+    new_mesh.obj_filename = copy_string(obj_filename);
+    new_mesh.png_filename = copy_string(png_texture_filename);
+    array_push(meshes, new_mesh);
+
+    return array_length(meshes) - 1;
+}
+
+// Place an instance of the mesh from these files in the world, loading the files if
+// no other instance has yet.
+bool load_mesh(char * obj_filename, char * png_texture_filename,
+               vec3_t scale, vec3_t translation, vec3_t rotation)
+{
+    int mesh_index = find_or_load_mesh(obj_filename, png_texture_filename);
+    if (mesh_index < 0) {
         return false;
     }
 
-    new_mesh->scale = scale;
-    new_mesh->translation = translation;
-    new_mesh->rotation = rotation;
+    instance_t new_instance = {
+        .mesh_index = mesh_index,
+        .rotation = rotation,
+        .scale = scale,
+        .translation = translation,
+        .world_matrix_dirty = true,
+    };
+    array_push(instances, new_instance);
 
-    mesh_count++;
+    // The scene's BVH gets rebuilt to take in the new instance.
+    invalidate_scene_bvh();
 
     return true;
-}
\ No newline at end of file
+}
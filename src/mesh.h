@@ -1,28 +1,121 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 
+#include "clipping.h"
 #include "gfx-vector.h"
+#include "matrix.h"
 #include "triangle.h"
 #include "upng.h"
 
-// This struct is a mesh, with dynamically sized vertices and faces,
-// as well as the rotation of this mesh.
+// The most detail levels a mesh can have, counting the full detail one.
+#define MAX_MESH_LODS (6)
+
+// The most vertices and faces in one meshlet. The vertex limit keeps a meshlet's
+// transformed vertices small enough to stay in the L1 cache while its faces use them,
+// and lets the faces index them with one byte.
+#define MESHLET_MAX_VERTICES (64)
+#define MESHLET_MAX_FACES (128)
+
+// Build with -DCOMPACT_MESH_STORAGE=1 to store meshes' drawing data in about half the
+// memory: positions as 16-bit fractions of the mesh's bounding box, and UVs as 16-bit
+// fractions of the mesh's UV range. Positions move by up to 1/65534 of the box's size.
+#ifndef COMPACT_MESH_STORAGE
+#define COMPACT_MESH_STORAGE (0)
+#endif
+
+// A meshlet is a small cluster of neighboring faces, with its own list of the vertices
+// they use, and bounds to cull the whole cluster with before touching its vertices.
+typedef struct {
+    int first_face;   // the meshlet's faces are next to each other in the level's faces
+    int num_faces;
+    int first_vertex; // and its vertices are next to each other in the level's positions
+    int num_vertices;
+    vec3_t center;    // model space bounding sphere
+    float radius;
+    vec3_t cone_apex; // normal cone, see is_meshlet_back_facing()
+    vec3_t cone_axis;
+    float cone_cutoff; // more than 1 when the faces point too many ways to ever cull
+} meshlet_t;
+
+// What drawing needs of each face, besides its corners.
+typedef struct {
+    vec3_t normal;   // same as the face_t's
+    float distance;
+    uint32_t color;
+} meshlet_face_t;
+
+// One level of detail of a mesh: its own vertices and faces, simplified from the full
+// detail level (level 0). Simplifying only ever removes vertices, so every level's
+// vertices are some of level 0's, and level 0's bounds hold all the levels.
+// The vertices and faces are only kept while loading. Drawing uses the meshlets, whose
+// vertices are a position and a UV each.
 typedef struct {
-    vec3_t * vertices;   // dynamic array of vertices for this mesh
-    face_t * faces;      // dynamic array of faces for this mesh
-    upng_t * texture;    // PNG texture pointer
-    vec3_t rotation;     // rotation of this mesh with x, y, z
+    vec3_t * vertices;   // dynamic array of vertices for this level
+    face_t * faces;      // dynamic array of faces for this level
+    meshlet_t * meshlets; // dynamic array of the meshlets the faces are split into
+    meshlet_face_t * meshlet_faces; // dynamic array of the faces, one meshlet's after another
+    uint8_t * meshlet_indices; // three per face: its corners in its meshlet's vertices
+    // Every meshlet's vertices, one meshlet's after another. Positions are struct-of-arrays
+    // for the batch vertex transform. Compact meshes only have the quantized ones.
+    vec3_soa_t positions;
+    tex2_t * texcoords;
+    vec3_i16_soa_t quantized_positions;
+    tex2_u16_t * quantized_texcoords;
+    float error;         // how far, in model space, this level's surface can be from level 0's
+} mesh_lod_t;
+
+// This struct is a mesh, with its levels of detail and its texture.
+// Meshes are shared: every instance of a mesh uses the same geometry and texture, and
+// load_mesh() only loads each OBJ and PNG file pair once.
+typedef struct {
+    char * obj_filename; // the files the mesh was loaded from
+    char * png_filename;
+    mesh_lod_t lods[MAX_MESH_LODS]; // levels of detail, from full detail down to the simplest
+    int num_lods;
+    vec3_t bounds_min;    // model space axis-aligned bounding box
+    vec3_t bounds_max;
+    vec3_t bounds_center; // model space bounding sphere
+    float bounds_radius;
+    bool is_compact;      // true when the meshlets' vertices are quantized
+    mat4_t dequantize_matrix; // quantized positions to model space
+    tex2_t texcoords_min; // quantized UVs to UVs: texcoords_min + (quantized * texcoords_scale)
+    tex2_t texcoords_scale;
+    texture_t * texture; // converted from the PNG file, shared with other meshes using the same file
+} mesh_t;
+
+// This struct is one placement of a mesh in the world, with its own scale, rotation,
+// and translation.
+// The world matrix is cached: change scale, rotation, or translation through the
+// update_instance_*() functions so the cached matrix gets rebuilt.
+typedef struct {
+    int mesh_index;      // which mesh this is an instance of
+    vec3_t rotation;     // rotation of this instance with x, y, z
     vec3_t scale;        // scale with x, y, z
     vec3_t translation;  // translation with x, y, z
-} mesh_t;
+    mat4_t world_matrix; // cached scale, rotation, and translation combined
+    bool world_matrix_dirty; // true when world_matrix needs to be rebuilt
+    vec3_t world_bounds_min; // world space axis-aligned box around the mesh's bounding box, cached with world_matrix
+    vec3_t world_bounds_max;
+} instance_t;
 
 void free_meshes(void);
 int get_num_meshes(void);
 mesh_t * get_mesh(int index);
+int get_num_instances(void);
+instance_t * get_instance(int index);
 
 bool load_mesh_obj_data(mesh_t * mesh, char * obj_filename);
 bool load_mesh_png_data(mesh_t * mesh, char * obj_filename);
+void compute_face_planes(mesh_lod_t * lod);
+int get_mesh_clip_planes(mesh_t * mesh, const mat4_t * model_view);
+
+void update_instance_scale(instance_t * instance, vec3_t scale);
+void update_instance_rotation(instance_t * instance, vec3_t rotation);
+void update_instance_translation(instance_t * instance, vec3_t translation);
+mat4_t get_instance_world_matrix(instance_t * instance);
+void get_instance_world_bounds(instance_t * instance, vec3_t * bounds_min, vec3_t * bounds_max);
 
 bool load_mesh(char * obj_filename, char * png_texture_filename,
                vec3_t scale, vec3_t translation, vec3_t rotation);
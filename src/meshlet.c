@@ -0,0 +1,412 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "array.h"
+#include "clipping.h"
+#include "meshlet.h"
+
+/*/////////////////////////////////////////////////////////////////////////////
+// Split a level of detail into meshlets
+///////////////////////////////////////////////////////////////////////////////
+// Meshlets are grown one face at a time, starting from the first face that isn't
+// in a meshlet yet. The next face is picked from the faces sharing a vertex with
+// the meshlet so far: the one adding the fewest new vertices, and out of those
+// the one facing the most like the meshlet so far, which keeps the normal cones
+// narrow enough to be worth testing. A meshlet is done when the next face would
+// take it over MESHLET_MAX_VERTICES or MESHLET_MAX_FACES. When a separate piece
+// of the mesh runs out of faces, the meshlet carries on with the next piece.
+//
+// A meshlet's vertices are a position and a UV each, so the faces only need to
+// say which of them they use. A vertex on a UV seam turns into one meshlet vertex
+// for each side of the seam, and vertices shared by meshlets are copied (and
+// transformed) once for each of them.
+//
+// Compact meshes (see COMPACT_MESH_STORAGE) store the meshlet vertices quantized,
+// and the meshlets' bounds hold the quantized positions.
+/////////////////////////////////////////////////////////////////////////////*/
+
+// The meshlet being grown: the level vertex and the UV of each of its vertices.
+// first_local_indices[vertex] is the first of the meshlet's vertices with that level
+// vertex, and next_local_indices[] leads to the others.
+typedef struct {
+    meshlet_t meshlet;
+    int vertices[MESHLET_MAX_VERTICES];
+    tex2_t texcoords[MESHLET_MAX_VERTICES];
+    int next_local_indices[MESHLET_MAX_VERTICES];
+    int * first_local_indices;
+} meshlet_builder_t;
+
+static int find_meshlet_vertex(const meshlet_builder_t * builder, int vertex, tex2_t texcoord)
+{
+    for (int local_index = builder->first_local_indices[vertex]; local_index >= 0;
+         local_index = builder->next_local_indices[local_index]) {
+        if ((builder->texcoords[local_index].u == texcoord.u) && (builder->texcoords[local_index].v == texcoord.v)) {
+            return local_index;
+        }
+    }
+    return -1;
+}
+
+// How many of the face's corners aren't in the meshlet yet.
+static int count_new_vertices(const meshlet_builder_t * builder, const face_t * face)
+{
+    int corners[3] = { face->a, face->b, face->c };
+    tex2_t texcoords[3] = { face->a_uv, face->b_uv, face->c_uv };
+    int num_new_vertices = 0;
+
+    for (int corner = 0; corner < 3; corner++) {
+        bool is_repeat = false;
+        for (int other = 0; other < corner; other++) {
+            is_repeat = is_repeat || ((corners[other] == corners[corner]) &&
+                                      (texcoords[other].u == texcoords[corner].u) &&
+                                      (texcoords[other].v == texcoords[corner].v));
+        }
+        if (!is_repeat && (find_meshlet_vertex(builder, corners[corner], texcoords[corner]) < 0)) {
+            num_new_vertices++;
+        }
+    }
+    return num_new_vertices;
+}
+
+// Find the corner's vertex in the meshlet, adding it if it isn't there yet.
+static int add_meshlet_vertex(meshlet_builder_t * builder, int vertex, tex2_t texcoord)
+{
+    int local_index = find_meshlet_vertex(builder, vertex, texcoord);
+    if (local_index < 0) {
+        local_index = builder->meshlet.num_vertices;
+        builder->vertices[local_index] = vertex;
+        builder->texcoords[local_index] = texcoord;
+        builder->next_local_indices[local_index] = builder->first_local_indices[vertex];
+        builder->first_local_indices[vertex] = local_index;
+        builder->meshlet.num_vertices++;
+    }
+    return local_index;
+}
+
+// Bounding sphere and normal cone of the meshlet. The cone follows "Optimizing the
+// Graphics Pipeline with Compute" (Wihlidal) and meshoptimizer: the apex is moved back
+// along the average normal until it's behind every face's plane, and from anywhere in
+// the cone in front of the apex, every face is seen from behind.
+static void compute_meshlet_bounds(meshlet_t * meshlet, const meshlet_face_t * faces, const vec3_t * positions)
+{
+    const vec3_t * vertices = &positions[meshlet->first_vertex];
+    vec3_t bounds_min = vertices[0];
+    vec3_t bounds_max = vertices[0];
+
+    for (int vertex_i = 1; vertex_i < meshlet->num_vertices; vertex_i++) {
+        bounds_min.x = fminf(bounds_min.x, vertices[vertex_i].x);
+        bounds_min.y = fminf(bounds_min.y, vertices[vertex_i].y);
+        bounds_min.z = fminf(bounds_min.z, vertices[vertex_i].z);
+        bounds_max.x = fmaxf(bounds_max.x, vertices[vertex_i].x);
+        bounds_max.y = fmaxf(bounds_max.y, vertices[vertex_i].y);
+        bounds_max.z = fmaxf(bounds_max.z, vertices[vertex_i].z);
+    }
+
+    meshlet->center = vec3_mul(vec3_add(bounds_min, bounds_max), 0.5);
+    meshlet->radius = 0.0;
+    for (int vertex_i = 0; vertex_i < meshlet->num_vertices; vertex_i++) {
+        meshlet->radius = fmaxf(meshlet->radius, vec3_length(vec3_sub(vertices[vertex_i], meshlet->center)));
+    }
+
+    // Until shown otherwise, the cone can't cull anything.
+    meshlet->cone_apex = meshlet->center;
+    meshlet->cone_axis = vec3_new(0, 0, 1);
+    meshlet->cone_cutoff = 2.0;
+
+    const meshlet_face_t * meshlet_faces = &faces[meshlet->first_face];
+    vec3_t normal_sum = vec3_new(0, 0, 0);
+
+    for (int face_i = 0; face_i < meshlet->num_faces; face_i++) {
+        // Faces with no normal are never back-face culled, so neither is their meshlet.
+        if (vec3_length(meshlet_faces[face_i].normal) == 0.0) {
+            return;
+        }
+        normal_sum = vec3_add(normal_sum, meshlet_faces[face_i].normal);
+    }
+
+    if (vec3_length(normal_sum) == 0.0) {
+        return;
+    }
+    vec3_t axis = normal_sum;
+    vec3_normalize(&axis);
+
+    // The cone's half angle holds every normal. Past 90 degrees there's nowhere to see
+    // all the faces from behind.
+    float min_dot = 1.0;
+    for (int face_i = 0; face_i < meshlet->num_faces; face_i++) {
+        min_dot = fminf(min_dot, vec3_dot(meshlet_faces[face_i].normal, axis));
+    }
+    if (min_dot <= 0.0) {
+        return;
+    }
+
+    // Move the apex back to where it's on or behind every face's plane.
+    float max_t = 0.0;
+    for (int face_i = 0; face_i < meshlet->num_faces; face_i++) {
+        const meshlet_face_t * face = &meshlet_faces[face_i];
+        float t = (vec3_dot(meshlet->center, face->normal) - face->distance) / vec3_dot(axis, face->normal);
+        max_t = fmaxf(max_t, t);
+    }
+
+    // Faces turned up to the cone's half angle from the axis are all seen from behind
+    // when the camera is within 90 degrees minus that angle of the reversed axis, which
+    // is where the cosine to the apex is more than sin(angle).
+    meshlet->cone_apex = vec3_sub(meshlet->center, vec3_mul(axis, max_t));
+    meshlet->cone_axis = axis;
+    meshlet->cone_cutoff = sqrtf(1.0 - (min_dot * min_dot));
+}
+
+// The dequantize matrix only scales and translates, so quantizing undoes that.
+static int16_t quantize_coordinate(float value, float scale, float offset)
+{
+    if (scale == 0.0) {
+        return 0;
+    }
+    float quantized = roundf((value - offset) / scale);
+    return (int16_t)fmaxf(-32767.0, fminf(32767.0, quantized));
+}
+
+static uint16_t quantize_texcoord(float value, float scale, float offset)
+{
+    if (scale == 0.0) {
+        return 0;
+    }
+    float quantized = roundf((value - offset) / scale);
+    return (uint16_t)fmaxf(0.0, fminf(65535.0, quantized));
+}
+
+// Store the meshlets' vertices in the level, quantized for compact meshes. Quantizing
+// moves the positions a little, so they're changed to where the quantized ones land,
+// for the meshlets' bounds to be worked out from.
+static bool store_meshlet_vertices(const mesh_t * mesh, mesh_lod_t * lod, vec3_t * positions, tex2_t * texcoords)
+{
+    int num_positions = array_length(positions);
+
+    if (!mesh->is_compact) {
+        if (!vec3_soa_alloc(&lod->positions, num_positions)) {
+            return false;
+        }
+        for (int ii = 0; ii < num_positions; ii++) {
+            lod->positions.x[ii] = positions[ii].x;
+            lod->positions.y[ii] = positions[ii].y;
+            lod->positions.z[ii] = positions[ii].z;
+        }
+        lod->texcoords = (tex2_t *)malloc((num_positions + 1) * sizeof(tex2_t));
+        if (!lod->texcoords) {
+            return false;
+        }
+        memcpy(lod->texcoords, texcoords, num_positions * sizeof(tex2_t));
+        return true;
+    }
+
+    const float (*dequantize)[4] = mesh->dequantize_matrix.m;
+    if (!vec3_i16_soa_alloc(&lod->quantized_positions, num_positions)) {
+        return false;
+    }
+    lod->quantized_texcoords = (tex2_u16_t *)malloc((num_positions + 1) * sizeof(tex2_u16_t));
+    if (!lod->quantized_texcoords) {
+        return false;
+    }
+
+    for (int ii = 0; ii < num_positions; ii++) {
+        int16_t x = quantize_coordinate(positions[ii].x, dequantize[0][0], dequantize[0][3]);
+        int16_t y = quantize_coordinate(positions[ii].y, dequantize[1][1], dequantize[1][3]);
+        int16_t z = quantize_coordinate(positions[ii].z, dequantize[2][2], dequantize[2][3]);
+        lod->quantized_positions.x[ii] = x;
+        lod->quantized_positions.y[ii] = y;
+        lod->quantized_positions.z[ii] = z;
+        positions[ii] = vec3_from_vec4(mat4_mul_vec4(mesh->dequantize_matrix, vec4_from_vec3(vec3_new(x, y, z))));
+
+        lod->quantized_texcoords[ii].u = quantize_texcoord(texcoords[ii].u, mesh->texcoords_scale.u, mesh->texcoords_min.u);
+        lod->quantized_texcoords[ii].v = quantize_texcoord(texcoords[ii].v, mesh->texcoords_scale.v, mesh->texcoords_min.v);
+    }
+    return true;
+}
+
+bool build_meshlets(const mesh_t * mesh, mesh_lod_t * lod)
+{
+    int num_vertices = array_length(lod->vertices);
+    int num_faces = array_length(lod->faces);
+
+    // The faces around each vertex, all in one array, starting at vertex_face_starts[vertex].
+    int * vertex_face_starts = (int *)calloc(num_vertices + 1, sizeof(int));
+    int * vertex_faces = (int *)malloc((3 * num_faces + 1) * sizeof(int));
+    int * first_local_indices = (int *)malloc((num_vertices + 1) * sizeof(int));
+    bool * is_face_used = (bool *)calloc(num_faces + 1, sizeof(bool));
+    bool * is_candidate = (bool *)calloc(num_faces + 1, sizeof(bool));
+    int * candidates = (int *)malloc((num_faces + 1) * sizeof(int));
+    vec3_t * meshlet_positions = NULL;
+    tex2_t * meshlet_texcoords = NULL;
+    bool all_good = vertex_face_starts && vertex_faces && first_local_indices && is_face_used &&
+                    is_candidate && candidates;
+
+    if (all_good) {
+        for (int face_i = 0; face_i < num_faces; face_i++) {
+            vertex_face_starts[lod->faces[face_i].a + 1]++;
+            vertex_face_starts[lod->faces[face_i].b + 1]++;
+            vertex_face_starts[lod->faces[face_i].c + 1]++;
+        }
+        for (int vertex_i = 0; vertex_i < num_vertices; vertex_i++) {
+            vertex_face_starts[vertex_i + 1] += vertex_face_starts[vertex_i];
+        }
+
+        int * fill = first_local_indices; // borrowed as the fill position of each vertex's list
+        for (int vertex_i = 0; vertex_i < num_vertices; vertex_i++) {
+            fill[vertex_i] = vertex_face_starts[vertex_i];
+        }
+        for (int face_i = 0; face_i < num_faces; face_i++) {
+            vertex_faces[fill[lod->faces[face_i].a]++] = face_i;
+            vertex_faces[fill[lod->faces[face_i].b]++] = face_i;
+            vertex_faces[fill[lod->faces[face_i].c]++] = face_i;
+        }
+        for (int vertex_i = 0; vertex_i < num_vertices; vertex_i++) {
+            first_local_indices[vertex_i] = -1;
+        }
+    }
+
+    int num_meshlet_faces = 0;
+    int next_seed = 0;
+
+    while (all_good && (num_meshlet_faces < num_faces)) {
+        meshlet_builder_t builder = {
+            .meshlet = {
+                .first_face = num_meshlet_faces,
+                .first_vertex = array_length(meshlet_positions),
+            },
+            .first_local_indices = first_local_indices,
+        };
+        meshlet_t * meshlet = &builder.meshlet;
+        int num_candidates = 0;
+        vec3_t normal_sum = vec3_new(0, 0, 0);
+
+        while (meshlet->num_faces < MESHLET_MAX_FACES) {
+            // Pick the neighboring face that fits best.
+            int best_face = -1;
+            float best_score = 0.0;
+            float normal_sum_length = vec3_length(normal_sum);
+
+            for (int ii = 0; ii < num_candidates; ii++) {
+                int face_i = candidates[ii];
+                if (is_face_used[face_i]) {
+                    is_candidate[face_i] = false;
+                    candidates[ii] = candidates[num_candidates - 1];
+                    num_candidates--;
+                    ii--;
+                    continue;
+                }
+
+                int num_new_vertices = count_new_vertices(&builder, &lod->faces[face_i]);
+                if (meshlet->num_vertices + num_new_vertices > MESHLET_MAX_VERTICES) {
+                    continue;
+                }
+
+                float facing = (normal_sum_length > 0.0) ? (vec3_dot(lod->faces[face_i].normal, normal_sum) / normal_sum_length) : 1.0;
+                float score = num_new_vertices + (0.5 * (1.0 - facing));
+                if ((best_face < 0) || (score < best_score)) {
+                    best_face = face_i;
+                    best_score = score;
+                }
+            }
+
+            if (best_face < 0) {
+                // Neighbors that don't fit mean the meshlet is full. No neighbors at all
+                // means this piece of the mesh is done, so go on with the next one.
+                if (num_candidates > 0) {
+                    break;
+                }
+                while ((next_seed < num_faces) && is_face_used[next_seed]) {
+                    next_seed++;
+                }
+                if ((next_seed == num_faces) ||
+                    (meshlet->num_vertices + count_new_vertices(&builder, &lod->faces[next_seed]) > MESHLET_MAX_VERTICES)) {
+                    break;
+                }
+                best_face = next_seed;
+            }
+
+            // Add the face to the meshlet, and its neighbors to the candidates.
+            const face_t * face = &lod->faces[best_face];
+            int corners[3] = { face->a, face->b, face->c };
+            tex2_t texcoords[3] = { face->a_uv, face->b_uv, face->c_uv };
+            is_face_used[best_face] = true;
+            num_meshlet_faces++;
+            meshlet->num_faces++;
+            normal_sum = vec3_add(normal_sum, face->normal);
+
+            meshlet_face_t meshlet_face = { face->normal, face->distance, face->color };
+            array_push(lod->meshlet_faces, meshlet_face);
+
+            for (int corner = 0; corner < 3; corner++) {
+                int vertex = corners[corner];
+                uint8_t local_index = (uint8_t)add_meshlet_vertex(&builder, vertex, texcoords[corner]);
+                array_push(lod->meshlet_indices, local_index);
+
+                for (int ii = vertex_face_starts[vertex]; ii < vertex_face_starts[vertex + 1]; ii++) {
+                    int neighbor = vertex_faces[ii];
+                    if (!is_face_used[neighbor] && !is_candidate[neighbor]) {
+                        is_candidate[neighbor] = true;
+                        candidates[num_candidates] = neighbor;
+                        num_candidates++;
+                    }
+                }
+            }
+        }
+
+        for (int vertex_i = 0; vertex_i < meshlet->num_vertices; vertex_i++) {
+            array_push(meshlet_positions, lod->vertices[builder.vertices[vertex_i]]);
+            array_push(meshlet_texcoords, builder.texcoords[vertex_i]);
+            first_local_indices[builder.vertices[vertex_i]] = -1;
+        }
+        for (int ii = 0; ii < num_candidates; ii++) {
+            is_candidate[candidates[ii]] = false;
+        }
+
+        array_push(lod->meshlets, *meshlet);
+    }
+
+    if (all_good) {
+        all_good = store_meshlet_vertices(mesh, lod, meshlet_positions, meshlet_texcoords);
+    }
+    for (int meshlet_i = 0; all_good && (meshlet_i < array_length(lod->meshlets)); meshlet_i++) {
+        compute_meshlet_bounds(&lod->meshlets[meshlet_i], lod->meshlet_faces, meshlet_positions);
+    }
+
+    free(vertex_face_starts);
+    free(vertex_faces);
+    free(first_local_indices);
+    free(is_face_used);
+    free(is_candidate);
+    free(candidates);
+    array_free(meshlet_positions);
+    array_free(meshlet_texcoords);
+
+    if (!all_good) {
+        fprintf(stderr, "Error: malloc failed while splitting the mesh into meshlets.\n");
+    }
+    return all_good;
+}
+
+/*/////////////////////////////////////////////////////////////////////////////
+// Is every face of the meshlet facing away from the camera?
+///////////////////////////////////////////////////////////////////////////////
+// The camera position is in model space. True when the camera is inside the
+// normal cone, past its apex: the cosine of the angle between the cone's axis
+// and the direction from the camera to the apex is more than the cutoff.
+// Only ever true when the faces' own back-face test would cull all of them.
+/////////////////////////////////////////////////////////////////////////////*/
+bool is_meshlet_back_facing(const meshlet_t * meshlet, vec3_t camera_position)
+{
+    vec3_t camera_to_apex = vec3_sub(meshlet->cone_apex, camera_position);
+    return vec3_dot(camera_to_apex, meshlet->cone_axis) > meshlet->cone_cutoff * vec3_length(camera_to_apex);
+}
+
+// Which frustum planes do the meshlet's faces need clipping against? Like
+// get_mesh_clip_planes(), but just with the bounding sphere: -1 when the meshlet is
+// completely outside, 0 when it's completely inside. max_scale is the model-view
+// matrix's biggest scale factor.
+int get_meshlet_clip_planes(const meshlet_t * meshlet, const mat4_t * model_view, float max_scale)
+{
+    vec3_t center = vec3_from_vec4(mat4_mul_vec4(*model_view, vec4_from_vec3(meshlet->center)));
+    return get_sphere_clip_planes(center, meshlet->radius * max_scale);
+}
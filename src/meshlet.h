@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdbool.h>
+#include "matrix.h"
+#include "mesh.h"
+
+bool build_meshlets(const mesh_t * mesh, mesh_lod_t * lod);
+
+bool is_meshlet_back_facing(const meshlet_t * meshlet, vec3_t camera_position);
+int get_meshlet_clip_planes(const meshlet_t * meshlet, const mat4_t * model_view, float max_scale);
@@ -0,0 +1,148 @@
+#pragma once
+
+// Pick the widest SIMD instruction set the compiler is targeting.
+// Plain x86-64 builds get 4-wide SSE2. Building with -mavx2 (or -march=native on a
+// machine that has it) gets the 8-wide AVX2 paths. Everything else falls back to
+// "1-wide SIMD" in plain C.
+//
+// The float operations, and simd_load_int16() which loads 16-bit integers as floats, are
+// available at every width, so loops written with them work on every platform. The
+// integer and mask operations only exist when SIMD_WIDTH > 1; code using them needs a
+// plain C version for the 1-wide case.
+#include <stdint.h>
+
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+
+#define SIMD_WIDTH (8)
+typedef __m256 simd_float_t;
+typedef __m256i simd_int_t;
+
+#define simd_set1(a)     _mm256_set1_ps(a)
+#define simd_load(p)     _mm256_loadu_ps(p)
+#define simd_store(p, a) _mm256_storeu_ps((p), (a))
+#define simd_add(a, b)   _mm256_add_ps((a), (b))
+#define simd_sub(a, b)   _mm256_sub_ps((a), (b))
+#define simd_mul(a, b)   _mm256_mul_ps((a), (b))
+#define simd_max(a, b)   _mm256_max_ps((a), (b))
+
+#define simd_rcp(a)      _mm256_rcp_ps(a)
+#define simd_cmplt(a, b) _mm256_cmp_ps((a), (b), _CMP_LT_OQ)
+#define simd_cmpeq(a, b) _mm256_cmp_ps((a), (b), _CMP_EQ_OQ)
+#define simd_movemask(a) _mm256_movemask_ps(a)
+
+#define simd_int_set1(a)         _mm256_set1_epi32(a)
+#define simd_int_load(p)         _mm256_loadu_si256((const __m256i *)(p))
+#define simd_int_store(p, a)     _mm256_storeu_si256((__m256i *)(p), (a))
+#define simd_int_add(a, b)       _mm256_add_epi32((a), (b))
+#define simd_int_sub(a, b)       _mm256_sub_epi32((a), (b))
+#define simd_int_or(a, b)        _mm256_or_si256((a), (b))
+#define simd_int_and(a, b)       _mm256_and_si256((a), (b))
+#define simd_int_andnot(a, b)    _mm256_andnot_si256((a), (b))
+#define simd_int_srai(a, n)      _mm256_srai_epi32((a), (n))
+#define simd_int_slli(a, n)      _mm256_slli_epi32((a), (n))
+#define simd_int_cmpgt(a, b)     _mm256_cmpgt_epi32((a), (b))
+#define simd_int_to_float(a)     _mm256_cvtepi32_ps(a)
+#define simd_float_to_int(a)     _mm256_cvttps_epi32(a)
+#define simd_as_float(a)         _mm256_castsi256_ps(a)
+#define simd_as_int(a)           _mm256_castps_si256(a)
+#define simd_int_gather(base, i) _mm256_i32gather_epi32((const int *)(base), (i), 4)
+
+#define simd_load_int16(p) _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(p))))
+
+#elif defined(__SSE2__)
+
+#include <emmintrin.h>
+
+#define SIMD_WIDTH (4)
+typedef __m128 simd_float_t;
+typedef __m128i simd_int_t;
+
+#define simd_set1(a)     _mm_set1_ps(a)
+#define simd_load(p)     _mm_loadu_ps(p)
+#define simd_store(p, a) _mm_storeu_ps((p), (a))
+#define simd_add(a, b)   _mm_add_ps((a), (b))
+#define simd_sub(a, b)   _mm_sub_ps((a), (b))
+#define simd_mul(a, b)   _mm_mul_ps((a), (b))
+#define simd_max(a, b)   _mm_max_ps((a), (b))
+
+#define simd_rcp(a)      _mm_rcp_ps(a)
+#define simd_cmplt(a, b) _mm_cmplt_ps((a), (b))
+#define simd_cmpeq(a, b) _mm_cmpeq_ps((a), (b))
+#define simd_movemask(a) _mm_movemask_ps(a)
+
+#define simd_int_set1(a)         _mm_set1_epi32(a)
+#define simd_int_load(p)         _mm_loadu_si128((const __m128i *)(p))
+#define simd_int_store(p, a)     _mm_storeu_si128((__m128i *)(p), (a))
+#define simd_int_add(a, b)       _mm_add_epi32((a), (b))
+#define simd_int_sub(a, b)       _mm_sub_epi32((a), (b))
+#define simd_int_or(a, b)        _mm_or_si128((a), (b))
+#define simd_int_and(a, b)       _mm_and_si128((a), (b))
+#define simd_int_andnot(a, b)    _mm_andnot_si128((a), (b))
+#define simd_int_srai(a, n)      _mm_srai_epi32((a), (n))
+#define simd_int_slli(a, n)      _mm_slli_epi32((a), (n))
+#define simd_int_cmpgt(a, b)     _mm_cmpgt_epi32((a), (b))
+#define simd_int_to_float(a)     _mm_cvtepi32_ps(a)
+#define simd_float_to_int(a)     _mm_cvttps_epi32(a)
+#define simd_as_float(a)         _mm_castsi128_ps(a)
+#define simd_as_int(a)           _mm_castps_si128(a)
+#define simd_int_gather(base, i) simd_int_gather_sse2((const int *)(base), (i))
+#define simd_load_int16(p)       simd_load_int16_sse2((const int16_t *)(p))
+
+// SSE2 has no gather instruction, so load the four values one at a time.
+static inline __m128i simd_int_gather_sse2(const int * base, __m128i indices)
+{
+    int index[4];
+    _mm_storeu_si128((__m128i *)index, indices);
+    return _mm_setr_epi32(base[index[0]], base[index[1]], base[index[2]], base[index[3]]);
+}
+
+// SSE2 has no 16 to 32-bit sign extend either: put each value in the top half of its
+// 32-bit lane, and shift it back down.
+static inline __m128 simd_load_int16_sse2(const int16_t * p)
+{
+    __m128i values = _mm_loadl_epi64((const __m128i *)p);
+    return _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(values, values), 16));
+}
+
+#else
+
+#define SIMD_WIDTH (1)
+typedef float simd_float_t;
+
+#define simd_set1(a)     (a)
+#define simd_load(p)     (*(p))
+#define simd_store(p, a) (*(p) = (a))
+#define simd_add(a, b)   ((a) + (b))
+#define simd_sub(a, b)   ((a) - (b))
+#define simd_mul(a, b)   ((a) * (b))
+#define simd_max(a, b)   ((a) > (b) ? (a) : (b))
+
+#define simd_load_int16(p) ((float)*(p))
+
+#endif
+
+#if SIMD_WIDTH > 1
+
+// Pick a where mask is set, and b where it isn't.
+#define simd_int_select(mask, a, b) simd_int_or(simd_int_and((mask), (a)), simd_int_andnot((mask), (b)))
+
+// Round each lane down to an int. The conversion rounds towards zero, which is one too
+// big for negative values with a fraction; the compare's all-ones mask is -1 there.
+// Values that don't fit in an int come out as garbage, but never trap.
+#define simd_floor_to_int(a) simd_floor_to_int_fixup((a), simd_float_to_int(a))
+static inline simd_int_t simd_floor_to_int_fixup(simd_float_t a, simd_int_t t)
+{
+    return simd_int_add(t, simd_as_int(simd_cmplt(a, simd_int_to_float(t))));
+}
+
+// Approximate 1/a: the rcp instruction is only good to about 12 bits, and one
+// Newton-Raphson step (r * (2 - a * r)) brings that up to nearly full float precision.
+#define simd_reciprocal(a) simd_reciprocal_newton((a), simd_rcp(a))
+static inline simd_float_t simd_reciprocal_newton(simd_float_t a, simd_float_t r)
+{
+    return simd_mul(r, simd_sub(simd_set1(2.0f), simd_mul(a, r)));
+}
+
+#endif
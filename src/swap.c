@@ -7,9 +7,22 @@ void int_swap(int *a, int *b)
     *b = temp;
 }
 
-void float_swap(float *a, float *b) 
+int int_min(int a, int b)
 {
-    float temp = *a;
-    *a = *b;
-    *b = temp;
+    return (a < b) ? a : b;
+}
+
+int int_max(int a, int b)
+{
+    return (a > b) ? a : b;
+}
+
+float float_min(float a, float b)
+{
+    return (a < b) ? a : b;
+}
+
+float float_max(float a, float b)
+{
+    return (a > b) ? a : b;
 }
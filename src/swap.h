@@ -1,4 +1,8 @@
 #pragma once
 
 void int_swap(int *a, int *b);
-void float_swap(float *a, float *b);
\ No newline at end of file
+
+int int_min(int a, int b);
+int int_max(int a, int b);
+float float_min(float a, float b);
+float float_max(float a, float b);
\ No newline at end of file
@@ -1,8 +1,120 @@
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "texture.h"
 
 tex2_t tex2_clone(tex2_t *p)
 {
     tex2_t result = {p->u, p->v};
     return result;
-}
\ No newline at end of file
+}
+
+/*/////////////////////////////////////////////////////////////////////////////
+// Convert a decoded PNG to a texture
+///////////////////////////////////////////////////////////////////////////////
+// upng hands back the PNG's own format: 1 to 4 components (luminance,
+// luminance and alpha, RGB, or RGBA) of 1 to 16 bits each, packed with no
+// padding between rows. Each texel gets converted to 8-bit RGBA once here,
+// written as bytes in the color buffer's SDL_PIXELFORMAT_RGBA32 order, so the
+// rasterizer can copy texels straight to the screen.
+//
+// Sizes that aren't a power of two get resampled (nearest texel) up to the
+// next power of two, so the rasterizer can wrap texel coordinates with an AND
+// instead of a divide. u and v still cover the whole texture either way.
+/////////////////////////////////////////////////////////////////////////////*/
+
+// The smallest power of two that's at least size, and its log2.
+static int get_power_of_two_size(int size, int * shift)
+{
+    *shift = 0;
+    while ((1 << *shift) < size) {
+        (*shift)++;
+    }
+    return 1 << *shift;
+}
+
+// One component of the PNG's pixels, scaled to 8 bits.
+static unsigned char get_png_sample(const unsigned char * buffer, unsigned bit_depth, unsigned long sample_index)
+{
+    if (bit_depth == 8) {
+        return buffer[sample_index];
+    }
+    if (bit_depth == 16) {
+        // 16-bit samples are big endian, so the first byte is the high one.
+        return buffer[sample_index * 2];
+    }
+
+    // 1, 2, and 4 bit samples are packed from the high bits of each byte down.
+    unsigned long bit_index = sample_index * bit_depth;
+    unsigned max_value = (1u << bit_depth) - 1;
+    unsigned value = (buffer[bit_index / 8] >> (8 - bit_depth - (bit_index % 8))) & max_value;
+    return (unsigned char)((value * 255) / max_value);
+}
+
+texture_t * texture_from_png(const upng_t * png)
+{
+    int png_width = upng_get_width(png);
+    int png_height = upng_get_height(png);
+    unsigned num_components = upng_get_components(png);
+    unsigned bit_depth = upng_get_bitdepth(png);
+    const unsigned char * buffer = upng_get_buffer(png);
+
+    if ((png_width <= 0) || (png_height <= 0) || (num_components == 0) || (buffer == NULL)) {
+        fprintf(stderr, "Error: the PNG's format (%d) isn't supported for textures.\n", upng_get_format(png));
+        return NULL;
+    }
+
+    texture_t * texture = (texture_t *)malloc(sizeof(texture_t));
+    if (!texture) {
+        fprintf(stderr, "Error: malloc failed for a texture.\n");
+        return NULL;
+    }
+
+    int height_shift;
+    texture->width = get_power_of_two_size(png_width, &texture->width_shift);
+    texture->height = get_power_of_two_size(png_height, &height_shift);
+    texture->width_mask = texture->width - 1;
+    texture->height_mask = texture->height - 1;
+    texture->pixels = (uint32_t *)malloc(texture->width * texture->height * sizeof(uint32_t));
+    if (!texture->pixels) {
+        fprintf(stderr, "Error: malloc failed for a %d x %d texture.\n", texture->width, texture->height);
+        free(texture);
+        return NULL;
+    }
+
+    for (int y = 0; y < texture->height; y++) {
+        int png_y = (int)(((int64_t)y * png_height) / texture->height);
+        for (int x = 0; x < texture->width; x++) {
+            int png_x = (int)(((int64_t)x * png_width) / texture->width);
+            unsigned long first_sample = (((unsigned long)png_y * png_width) + png_x) * num_components;
+
+            unsigned char samples[4];
+            for (unsigned ii = 0; ii < num_components; ii++) {
+                samples[ii] = get_png_sample(buffer, bit_depth, first_sample + ii);
+            }
+
+            // Luminance goes to all three colors, and alpha is opaque unless the PNG has it.
+            bool has_color = (num_components >= 3);
+            bool has_alpha = (num_components == 2) || (num_components == 4);
+            unsigned char * texel = (unsigned char *)&texture->pixels[(y << texture->width_shift) + x];
+            texel[0] = samples[0];
+            texel[1] = has_color ? samples[1] : samples[0];
+            texel[2] = has_color ? samples[2] : samples[0];
+            texel[3] = has_alpha ? samples[num_components - 1] : 0xFF;
+        }
+    }
+
+    if ((texture->width != png_width) || (texture->height != png_height)) {
+        printf("Resampled the %d x %d texture to %d x %d.\n", png_width, png_height, texture->width, texture->height);
+    }
+
+    return texture;
+}
+
+void texture_free(texture_t * texture)
+{
+    if (texture) {
+        free(texture->pixels);
+        free(texture);
+    }
+}
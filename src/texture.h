@@ -1,8 +1,31 @@
 #pragma once
 
+#include <stdint.h>
+#include "upng.h"
+
 typedef struct {
     float u;
     float v;
 } tex2_t;
 
-tex2_t tex2_clone(tex2_t *p);
\ No newline at end of file
+// UV texture coordinates of compact meshes, as fractions of the mesh's UV range.
+typedef struct {
+    uint16_t u;
+    uint16_t v;
+} tex2_u16_t;
+
+// A texture converted once at load time for the rasterizer: 32-bit pixels in the color
+// buffer's format, at power of two sizes so texel coordinates wrap with a mask.
+typedef struct {
+    uint32_t * pixels;
+    int width;
+    int height;
+    int width_shift; // log2(width): texel (x, y) is pixels[(y << width_shift) + x]
+    int width_mask;  // width - 1
+    int height_mask; // height - 1
+} texture_t;
+
+tex2_t tex2_clone(tex2_t *p);
+
+texture_t * texture_from_png(const upng_t * png);
+void texture_free(texture_t * texture);
\ No newline at end of file
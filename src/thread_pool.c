@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <SDL2/SDL.h>
+#include "thread_pool.h"
+
+#define MAX_WORKER_THREADS (63)
+
+static SDL_Thread * worker_threads[MAX_WORKER_THREADS];
+static int num_worker_threads = 0;
+
+// Each worker waits on work_ready_sem, runs jobs until there are none left, and then
+// posts work_done_sem so run_jobs() knows it's finished with the current batch.
+static SDL_sem * work_ready_sem = NULL;
+static SDL_sem * work_done_sem = NULL;
+static bool is_shutting_down = false;
+
+// The batch of jobs currently being run.
+static job_function_t current_job_function = NULL;
+static void * current_job_data = NULL;
+static int current_num_jobs = 0;
+static SDL_atomic_t next_job_index;
+
+static void run_available_jobs(void)
+{
+    // Threads grab the next job index until they're all taken.
+    int job_index = SDL_AtomicAdd(&next_job_index, 1);
+    while (job_index < current_num_jobs) {
+        current_job_function(current_job_data, job_index);
+        job_index = SDL_AtomicAdd(&next_job_index, 1);
+    }
+}
+
+static int worker_thread_main(void * unused)
+{
+    (void)unused;
+
+    while (true) {
+        SDL_SemWait(work_ready_sem);
+        if (is_shutting_down) {
+            break;
+        }
+        run_available_jobs();
+        SDL_SemPost(work_done_sem);
+    }
+    return 0;
+}
+
+// Start the pool. num_threads counts the calling thread too, since run_jobs() has the
+// caller work on jobs alongside the workers instead of just waiting for them.
+bool init_thread_pool(int num_threads)
+{
+    int num_workers = num_threads - 1;
+    if (num_workers > MAX_WORKER_THREADS) {
+        num_workers = MAX_WORKER_THREADS;
+    }
+
+    work_ready_sem = SDL_CreateSemaphore(0);
+    work_done_sem = SDL_CreateSemaphore(0);
+    if (!work_ready_sem || !work_done_sem) {
+        fprintf(stderr, "Error: SDL_CreateSemaphore failed\n");
+        return false;
+    }
+
+    is_shutting_down = false;
+    for (num_worker_threads = 0; num_worker_threads < num_workers; num_worker_threads++) {
+        SDL_Thread * thread = SDL_CreateThread(worker_thread_main, "worker", NULL);
+        if (!thread) {
+            // Not fatal: we just run with fewer threads.
+            fprintf(stderr, "Warning: SDL_CreateThread failed, using %d threads\n", num_worker_threads + 1);
+            break;
+        }
+        worker_threads[num_worker_threads] = thread;
+    }
+
+    return true;
+}
+
+void destroy_thread_pool(void)
+{
+    is_shutting_down = true;
+    for (int ii = 0; ii < num_worker_threads; ii++) {
+        SDL_SemPost(work_ready_sem);
+    }
+    for (int ii = 0; ii < num_worker_threads; ii++) {
+        SDL_WaitThread(worker_threads[ii], NULL);
+    }
+    num_worker_threads = 0;
+
+    if (work_ready_sem) {
+        SDL_DestroySemaphore(work_ready_sem);
+        work_ready_sem = NULL;
+    }
+    if (work_done_sem) {
+        SDL_DestroySemaphore(work_done_sem);
+        work_done_sem = NULL;
+    }
+}
+
+// Number of threads that run jobs, including the thread that calls run_jobs().
+int get_thread_pool_size(void)
+{
+    return num_worker_threads + 1;
+}
+
+// Run job_function for job indices 0..num_jobs-1 across the pool, and return once
+// all of them are done. Jobs must not call run_jobs() themselves.
+void run_jobs(job_function_t job_function, void * job_data, int num_jobs)
+{
+    if ((num_worker_threads == 0) || (num_jobs <= 1)) {
+        for (int job_index = 0; job_index < num_jobs; job_index++) {
+            job_function(job_data, job_index);
+        }
+        return;
+    }
+
+    current_job_function = job_function;
+    current_job_data = job_data;
+    current_num_jobs = num_jobs;
+    SDL_AtomicSet(&next_job_index, 0);
+
+    // Only wake up as many workers as there are jobs for besides our own.
+    int num_woken_workers = (num_jobs - 1 < num_worker_threads) ? (num_jobs - 1) : num_worker_threads;
+    for (int ii = 0; ii < num_woken_workers; ii++) {
+        SDL_SemPost(work_ready_sem);
+    }
+
+    run_available_jobs();
+
+    for (int ii = 0; ii < num_woken_workers; ii++) {
+        SDL_SemWait(work_done_sem);
+    }
+}
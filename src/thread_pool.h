@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdbool.h>
+
+// A job function is called once for every job index in [0, num_jobs), from whichever
+// pool thread (or the calling thread) picks that job up.
+typedef void (*job_function_t)(void * job_data, int job_index);
+
+bool init_thread_pool(int num_threads);
+void destroy_thread_pool(void);
+int get_thread_pool_size(void);
+
+void run_jobs(job_function_t job_function, void * job_data, int num_jobs);
@@ -0,0 +1,255 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "tiles.h"
+#include "arena.h"
+#include "swap.h"
+#include "thread_pool.h"
+
+/*/////////////////////////////////////////////////////////////////////////////
+// Sort-middle tile rendering
+///////////////////////////////////////////////////////////////////////////////
+// 1. Binning: each triangle's screen bounding box is used to add the triangle's
+//    index to the bin of every tile the box overlaps. Triangles are binned in
+//    order, so each bin lists its triangles in the same order as the input.
+//    A first pass counts each bin's triangles, so all the bins can be laid out
+//    one after another in a single frame arena allocation of the exact size.
+// 2. Rasterizing: each tile is a job on the thread pool. A job clears its tile
+//    and draws the tile's binned triangles, clipped to the tile rectangle.
+//    With a pre-pass (e.g. depth only), all of the tile's triangles go through
+//    the pre-pass before any of them are drawn.
+//
+// Tiles never share pixels, so the jobs don't need any locking, and a 64x64
+// tile's color and depth values (32KB) stay in the cache while it's drawn.
+// Every pixel sees the exact same sequence of writes as when the triangles are
+// drawn one after another over the whole screen, so the output is identical.
+/////////////////////////////////////////////////////////////////////////////*/
+
+typedef struct {
+    int * triangle_indices; // in the frame arena, only valid during render_tiles()
+    int num_triangles;
+} tile_bin_t;
+
+static tile_bin_t * tile_bins = NULL;
+static int num_tiles_x = 0;
+static int num_tiles_y = 0;
+static int tiles_screen_width = 0;
+static int tiles_screen_height = 0;
+
+// What the tile jobs need for the current call to render_tiles().
+typedef struct {
+    triangle_t * triangles;
+    tile_clear_function_t clear_function;   // NULL to draw on top of what's there
+    tile_draw_function_t prepass_function; // NULL for no pre-pass
+    tile_draw_function_t draw_function;
+} tile_jobs_t;
+
+bool init_tiles(int screen_width, int screen_height)
+{
+    tiles_screen_width = screen_width;
+    tiles_screen_height = screen_height;
+    num_tiles_x = (screen_width + TILE_SIZE - 1) / TILE_SIZE;
+    num_tiles_y = (screen_height + TILE_SIZE - 1) / TILE_SIZE;
+
+    tile_bins = (tile_bin_t *)calloc(num_tiles_x * num_tiles_y, sizeof(tile_bin_t));
+    if (!tile_bins) {
+        fprintf(stderr, "Error: calloc failed for tile_bins.\n");
+        return false;
+    }
+    return true;
+}
+
+void free_tiles(void)
+{
+    if (tile_bins) {
+        free(tile_bins);
+        tile_bins = NULL;
+    }
+}
+
+static screen_rect_t get_tile_rect(int tile_x, int tile_y)
+{
+    screen_rect_t rect = {
+        .x_min = tile_x * TILE_SIZE,
+        .y_min = tile_y * TILE_SIZE,
+        .x_max = int_min((tile_x + 1) * TILE_SIZE, tiles_screen_width),
+        .y_max = int_min((tile_y + 1) * TILE_SIZE, tiles_screen_height),
+    };
+    return rect;
+}
+
+// Find the tiles a triangle's screen bounding box overlaps, as a rectangle of tiles
+// (not pixels). It's empty for triangles that are completely off screen.
+static screen_rect_t get_triangle_tiles(const triangle_t * triangle, int bounds_margin)
+{
+    const vec4_t * points = triangle->points;
+    screen_rect_t tiles = { 0, 0, 0, 0 };
+
+    // Find the triangle's screen bounding box. The drawing functions truncate the
+    // points to whole pixels, and may draw up to bounds_margin pixels past them
+    // (like the vertex dots do), so round outwards and add the margin.
+    float x_min = fminf(points[0].x, fminf(points[1].x, points[2].x));
+    float x_max = fmaxf(points[0].x, fmaxf(points[1].x, points[2].x));
+    float y_min = fminf(points[0].y, fminf(points[1].y, points[2].y));
+    float y_max = fmaxf(points[0].y, fmaxf(points[1].y, points[2].y));
+
+    // Clamp to just outside the screen before converting to int, so huge values can't overflow.
+    x_min = fmaxf(x_min, -1.0 - bounds_margin);
+    y_min = fmaxf(y_min, -1.0 - bounds_margin);
+    x_max = fminf(x_max, tiles_screen_width);
+    y_max = fminf(y_max, tiles_screen_height);
+
+    int pixel_x_min = (int)floorf(x_min) - 1;
+    int pixel_y_min = (int)floorf(y_min) - 1;
+    int pixel_x_max = (int)ceilf(x_max) + bounds_margin;
+    int pixel_y_max = (int)ceilf(y_max) + bounds_margin;
+
+    if (    (pixel_x_max < 0) || (pixel_y_max < 0)
+         || (pixel_x_min >= tiles_screen_width) || (pixel_y_min >= tiles_screen_height)) {
+        return tiles; // completely off screen
+    }
+
+    tiles.x_min = int_max(pixel_x_min, 0) / TILE_SIZE;
+    tiles.y_min = int_max(pixel_y_min, 0) / TILE_SIZE;
+    tiles.x_max = (int_min(pixel_x_max, tiles_screen_width - 1) / TILE_SIZE) + 1;
+    tiles.y_max = (int_min(pixel_y_max, tiles_screen_height - 1) / TILE_SIZE) + 1;
+    return tiles;
+}
+
+// Fill the tile bins, with memory from the frame arena. Returns false, with all the
+// bins empty, if the arena is full.
+static bool bin_triangles(triangle_t * triangles, int num_triangles, int bounds_margin)
+{
+    int num_tiles = num_tiles_x * num_tiles_y;
+
+    for (int tile_index = 0; tile_index < num_tiles; tile_index++) {
+        tile_bins[tile_index].num_triangles = 0;
+    }
+
+    // First pass: find each triangle's tiles, and count the triangles in each bin.
+    screen_rect_t * triangle_tiles = (screen_rect_t *)frame_arena_alloc(num_triangles * sizeof(screen_rect_t));
+    if (!triangle_tiles) {
+        return false;
+    }
+
+    int num_binned = 0;
+    for (int ii = 0; ii < num_triangles; ii++) {
+        screen_rect_t tiles = get_triangle_tiles(&triangles[ii], bounds_margin);
+        triangle_tiles[ii] = tiles;
+
+        for (int tile_y = tiles.y_min; tile_y < tiles.y_max; tile_y++) {
+            for (int tile_x = tiles.x_min; tile_x < tiles.x_max; tile_x++) {
+                tile_bins[(tile_y * num_tiles_x) + tile_x].num_triangles++;
+                num_binned++;
+            }
+        }
+    }
+
+    // Lay the bins out one after another.
+    int * triangle_indices = (int *)frame_arena_alloc(num_binned * sizeof(int));
+    if (!triangle_indices) {
+        for (int tile_index = 0; tile_index < num_tiles; tile_index++) {
+            tile_bins[tile_index].num_triangles = 0;
+        }
+        return false;
+    }
+
+    for (int tile_index = 0; tile_index < num_tiles; tile_index++) {
+        tile_bins[tile_index].triangle_indices = triangle_indices;
+        triangle_indices += tile_bins[tile_index].num_triangles;
+        tile_bins[tile_index].num_triangles = 0;
+    }
+
+    // Second pass: add the triangles to their bins, in order.
+    for (int ii = 0; ii < num_triangles; ii++) {
+        screen_rect_t tiles = triangle_tiles[ii];
+
+        for (int tile_y = tiles.y_min; tile_y < tiles.y_max; tile_y++) {
+            for (int tile_x = tiles.x_min; tile_x < tiles.x_max; tile_x++) {
+                tile_bin_t * bin = &tile_bins[(tile_y * num_tiles_x) + tile_x];
+                bin->triangle_indices[bin->num_triangles] = ii;
+                bin->num_triangles++;
+            }
+        }
+    }
+
+    return true;
+}
+
+static void render_tile_job(void * job_data, int job_index)
+{
+    tile_jobs_t * jobs = (tile_jobs_t *)job_data;
+    tile_bin_t * bin = &tile_bins[job_index];
+    screen_rect_t tile_rect = get_tile_rect(job_index % num_tiles_x, job_index / num_tiles_x);
+
+    if (jobs->clear_function) {
+        jobs->clear_function(&tile_rect);
+    }
+
+    if (jobs->prepass_function) {
+        for (int ii = 0; ii < bin->num_triangles; ii++) {
+            jobs->prepass_function(&jobs->triangles[bin->triangle_indices[ii]], &tile_rect);
+        }
+    }
+
+    for (int ii = 0; ii < bin->num_triangles; ii++) {
+        jobs->draw_function(&jobs->triangles[bin->triangle_indices[ii]], &tile_rect);
+    }
+}
+
+// Draw all the triangles over the whole screen on this thread, in the same order the
+// tiles would. Slow, but it's only for when there's no room to bin the triangles.
+static void render_whole_screen(tile_jobs_t * jobs, int num_triangles)
+{
+    screen_rect_t screen_rect = {
+        .x_min = 0,
+        .y_min = 0,
+        .x_max = tiles_screen_width,
+        .y_max = tiles_screen_height,
+    };
+
+    if (jobs->clear_function) {
+        jobs->clear_function(&screen_rect);
+    }
+
+    if (jobs->prepass_function) {
+        for (int ii = 0; ii < num_triangles; ii++) {
+            jobs->prepass_function(&jobs->triangles[ii], &screen_rect);
+        }
+    }
+
+    for (int ii = 0; ii < num_triangles; ii++) {
+        jobs->draw_function(&jobs->triangles[ii], &screen_rect);
+    }
+}
+
+// Clear the screen and draw all the triangles, tile by tile, across the thread pool.
+// bounds_margin is how many pixels past its points draw_function may draw for a triangle.
+// If prepass_function isn't NULL, each tile runs it on all of its triangles first.
+// If clear_function is NULL, the triangles get drawn over the last call's.
+// If the frame arena doesn't have room for the bins, the whole screen gets drawn on this
+// thread instead, with the same result.
+void render_tiles(triangle_t * triangles, int num_triangles, int bounds_margin,
+                  tile_clear_function_t clear_function, tile_draw_function_t prepass_function,
+                  tile_draw_function_t draw_function)
+{
+    tile_jobs_t jobs = {
+        .triangles = triangles,
+        .clear_function = clear_function,
+        .prepass_function = prepass_function,
+        .draw_function = draw_function,
+    };
+
+    // The bins are only needed until the tiles are drawn.
+    size_t arena_mark = get_frame_arena_mark();
+
+    if (bin_triangles(triangles, num_triangles, bounds_margin)) {
+        run_jobs(render_tile_job, &jobs, num_tiles_x * num_tiles_y);
+    }
+    else {
+        fprintf(stderr, "Error: frame arena is full, drawing %d triangles without tiles.\n", num_triangles);
+        render_whole_screen(&jobs, num_triangles);
+    }
+
+    rewind_frame_arena(arena_mark);
+}
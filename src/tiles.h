@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdbool.h>
+#include "display.h"
+#include "triangle.h"
+
+// The screen is split into TILE_SIZE x TILE_SIZE pixel tiles for rendering.
+#define TILE_SIZE (64)
+
+// Called once per tile before any triangles are drawn in it (if not NULL).
+typedef void (*tile_clear_function_t)(const screen_rect_t * tile_rect);
+
+// Draws one triangle, only touching the pixels inside tile_rect.
+typedef void (*tile_draw_function_t)(triangle_t * triangle, const screen_rect_t * tile_rect);
+
+bool init_tiles(int screen_width, int screen_height);
+void free_tiles(void);
+
+void render_tiles(triangle_t * triangles, int num_triangles, int bounds_margin,
+                  tile_clear_function_t clear_function, tile_draw_function_t prepass_function,
+                  tile_draw_function_t draw_function);
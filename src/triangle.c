@@ -1,311 +1,780 @@
+#include <math.h>
+#include <stdio.h>
 #include "triangle.h"
 #include "swap.h"
 #include "display.h"
+#include "simd.h"
+
+// The rasterizer walks a triangle's bounding box in square blocks of pixels, so it can
+// skip whole blocks outside the triangle and skip the per-pixel inside test for blocks
+// completely inside it.
+// The blocks line up with the hierarchical z buffer's, so a whole block can be skipped
+// when the triangle is behind everything already drawn there.
+#define RASTER_BLOCK_SIZE (HI_Z_BLOCK_SIZE)
+
+// Vertices are snapped to 1/16 of a pixel (28.4 fixed point) before anything else, so
+// triangles sharing an edge agree exactly on where it is, and every edge test is exact
+// integer math. Pixels are sampled at their centers.
+#define SUBPIXEL_BITS (4)
+#define SUBPIXEL_ONE (1 << SUBPIXEL_BITS)
+#define SUBPIXEL_HALF (SUBPIXEL_ONE / 2)
+
+// Edges that are inside the whole of a block don't need testing there, so their pixel
+// test values start at this, which is far enough from both 0 and the int limits that
+// stepping across a block doesn't get near either one.
+#define EDGE_INSIDE_BLOCK (1 << 30)
+
+// Textured triangles with a depth range small enough for affine mapping to be within
+// this many texels of perspective correct skip the perspective divide entirely, when
+// texture spans are on.
+#define MAX_AFFINE_TEXEL_ERROR (0.5)
+
+static int texture_span_length = TEXTURE_SPAN_LENGTH;
 
 /*/////////////////////////////////////////////////////////////////////////////
-// Return the barycentric weights alpha, beta, and gamma for point p
+// Edge functions
 ///////////////////////////////////////////////////////////////////////////////
 //
-//         (B)
-//         /|\
-//        / | \
-//       /  |  \
-//      /  (P)  \
-//     /  /   \  \
-//    / /       \ \
-//   //           \\
-//  (A)------------(C)
+//         (v0)
+//         /  \
+//   E2   /    \   E1         E0(p) is (twice) the area of triangle v1, v2, p.
+//       /  p   \             It's 0 on the edge v1-v2, and grows linearly
+//      /        \            towards v0, where it equals the triangle's area.
+//  (v2)----------(v1)
+//           E0
 //
+// So E0/area, E1/area, and E2/area are the barycentric weights of p, and p is
+// inside the triangle when all three are >= 0.
+// Each edge function is a*x + b*y + c, so stepping one pixel right adds 16 * a
+// (in 28.4 fixed point) and stepping one pixel down adds 16 * b: after setting
+// them up once per triangle, the inside test for each pixel only takes additions.
+//
+// Fill rule: a pixel center exactly on an edge belongs to the triangle only if
+// the edge is a top edge (horizontal, with the triangle below it) or a left edge
+// (the triangle is to its right). Two triangles sharing an edge see it as top-left
+// from one side only, so every pixel along it is drawn exactly once. Other edges
+// get a bias of -1, which turns their ">= 0" test into "> 0".
+//
+// The fixed point products can be bigger than an int (vertices can be out in the
+// guard band), so c, the area, and the values at the corners of each block are
+// 64-bit. Inside a block, only the edges crossing the block need the per-pixel
+// test, and their values there are small enough for ints, including SIMD lanes.
+// The values interpolated across the triangle are floats, in attribute planes.
+//////////////////////////////////////////////////////////////////////////////*/
+
+/*/////////////////////////////////////////////////////////////////////////////
+// Attribute planes
+///////////////////////////////////////////////////////////////////////////////
+// 1/w, u/w, and v/w are linear in screen space, so each is a plane over the
+// screen: value + dx * (x - origin x) + dy * (y - origin y). Each plane comes
+// from the barycentric weights once per triangle: its dx is the sum of the
+// vertex values times each weight's change per pixel, and so on. After that,
+// each pixel only takes adds to get all three, and one reciprocal of 1/w to
+// get u and v back.
+//
+// The planes are measured from the pixel the first vertex is in, so the
+// values stay small near the triangle, and the same triangle always gets
+// the same values at the same pixel whatever rectangle it's clipped to.
+//////////////////////////////////////////////////////////////////////////////*/
+
+/*/////////////////////////////////////////////////////////////////////////////
+// Texture spans
+///////////////////////////////////////////////////////////////////////////////
+// With a texture span length set, u and v only get the perspective divide at
+// the ends of spans that many pixels long, lined up with the screen, and are
+// interpolated linearly in between. A span ends where the next one starts, so
+// its end values get reused by the block to its right. Since spans are a
+// multiple of RASTER_BLOCK_SIZE long, each block row is inside one span.
+//
+// Half way between two points, affine u is off from perspective correct u by
+// about du * (w1 - w0) / (2 * (w0 + w1)), so a triangle whose texel extent
+// times its relative depth range keeps that under MAX_AFFINE_TEXEL_ERROR gets
+// u and v planes instead, with no divides at all.
+//
+// Span ends can be outside the triangle, where 1/w can go to 0 or below, so
+// the values there are clamped to the triangle's own ranges.
 //////////////////////////////////////////////////////////////////////////////*/
-vec3_t barycentric_weights(vec2_t a, vec2_t b, vec2_t c, vec2_t p) {
-    // Find the vectors between the vertices ABC and point p
-    vec2_t ac = vec2_sub(c, a);
-    vec2_t ab = vec2_sub(b, a);
-    vec2_t ap = vec2_sub(p, a);
-    vec2_t pc = vec2_sub(c, p);
-    vec2_t pb = vec2_sub(b, p);
 
-    // Compute the area of the full parallegram/triangle ABC using 2D cross product
-    float area_parallelogram_abc = (ac.x * ab.y - ac.y * ab.x); // || AC x AB ||
+typedef enum {
+    TEXTURE_MAPPING_PERSPECTIVE, // divide at every pixel
+    TEXTURE_MAPPING_SPANS,       // divide at the ends of each texture span
+    TEXTURE_MAPPING_AFFINE,      // no divides: u and v are planes themselves
+} texture_mapping_t;
+
+typedef struct {
+    float value; // at the center of the triangle's origin pixel
+    float dx;    // change per pixel to the right
+    float dy;    // change per pixel down
+} attribute_plane_t;
+
+// Everything the rasterizer needs to know about a triangle, set up once before drawing it.
+typedef struct {
+    int x[3]; // snapped to 28.4 fixed point
+    int y[3];
+
+    // Edge function i is edge_a[i] * x + edge_b[i] * y + edge_c[i], and is zero on the edge
+    // opposite vertex i. The signs are flipped as needed so the inside is always positive.
+    int edge_a[3];
+    int edge_b[3];
+    int64_t edge_c[3];
+    int edge_bias[3]; // 0 for top and left edges, -1 for the others: the fill rule
+
+    // Per-vertex values to interpolate. W (z depth) is not linear with perspective,
+    // but 1/w (the reciprocal) is, and so are u/w and v/w.
+    float reciprocal_w[3];
+    float u[3];
+    float v[3];
+    float u_over_w[3];
+    float v_over_w[3];
+
+    // The same values as planes over the screen, measured from the origin pixel. The
+    // texture planes are of u and v themselves with TEXTURE_MAPPING_AFFINE.
+    int origin_x;
+    int origin_y;
+    attribute_plane_t reciprocal_w_plane;
+    attribute_plane_t texture_u_plane;
+    attribute_plane_t texture_v_plane;
+
+    texture_mapping_t texture_mapping;
+    int span_length;
+    float min_reciprocal_w, max_reciprocal_w; // to clamp span ends to
+    tex2_t min_texcoords, max_texcoords;
+
+    depth_mode_t depth_mode;
+    uint32_t color;
+    const texture_t * texture; // NULL to draw the triangle with a solid color
+} raster_triangle_t;
+
+// Snap a screen coordinate to the nearest 1/16 of a pixel.
+static inline int snap_to_subpixel(float coordinate)
+{
+    return (int)floorf((coordinate * SUBPIXEL_ONE) + 0.5f);
+}
+
+// Edge function i at the center of pixel (x, y).
+static inline int64_t get_edge_value(const raster_triangle_t * tri, int ii, int x, int y)
+{
+    return ((int64_t)tri->edge_a[ii] * ((x * SUBPIXEL_ONE) + SUBPIXEL_HALF)) +
+           ((int64_t)tri->edge_b[ii] * ((y * SUBPIXEL_ONE) + SUBPIXEL_HALF)) + tri->edge_c[ii];
+}
+
+// The plane of a value given at each vertex, from the barycentric weights at the
+// origin pixel and their changes per pixel.
+static attribute_plane_t get_attribute_plane(const float vertex_values[3], const double weights[3],
+                                             const double weight_dx[3], const double weight_dy[3])
+{
+    double value = 0.0, dx = 0.0, dy = 0.0;
+    for (int ii = 0; ii < 3; ii++) {
+        value += vertex_values[ii] * weights[ii];
+        dx += vertex_values[ii] * weight_dx[ii];
+        dy += vertex_values[ii] * weight_dy[ii];
+    }
+
+    attribute_plane_t plane = { .value = value, .dx = dx, .dy = dy };
+    return plane;
+}
+
+// The plane's value at the center of pixel (x, y).
+static inline float get_plane_value(const attribute_plane_t * plane, const raster_triangle_t * tri, int x, int y)
+{
+    return plane->value + (plane->dx * (x - tri->origin_x)) + (plane->dy * (y - tri->origin_y));
+}
+
+// Work out the ranges to clamp span ends to, and switch to affine mapping if the
+// triangle's depth range is small enough.
+static void setup_texture_spans(raster_triangle_t * tri)
+{
+    tri->min_reciprocal_w = float_min(tri->reciprocal_w[0], float_min(tri->reciprocal_w[1], tri->reciprocal_w[2]));
+    tri->max_reciprocal_w = float_max(tri->reciprocal_w[0], float_max(tri->reciprocal_w[1], tri->reciprocal_w[2]));
+    tri->min_texcoords.u = float_min(tri->u[0], float_min(tri->u[1], tri->u[2]));
+    tri->max_texcoords.u = float_max(tri->u[0], float_max(tri->u[1], tri->u[2]));
+    tri->min_texcoords.v = float_min(tri->v[0], float_min(tri->v[1], tri->v[2]));
+    tri->max_texcoords.v = float_max(tri->v[0], float_max(tri->v[1], tri->v[2]));
+
+    float texel_extent = float_max((tri->max_texcoords.u - tri->min_texcoords.u) * tri->texture->width,
+                                   (tri->max_texcoords.v - tri->min_texcoords.v) * tri->texture->height);
+    float min_w = 1.0f / tri->max_reciprocal_w;
+    float max_w = 1.0f / tri->min_reciprocal_w;
+    if (texel_extent * (max_w - min_w) <= 2.0f * MAX_AFFINE_TEXEL_ERROR * (min_w + max_w)) {
+        tri->texture_mapping = TEXTURE_MAPPING_AFFINE;
+    }
+}
+
+// Set up the edge functions and attribute planes for the triangle. Returns false if
+// the triangle has no area, so there's nothing to draw.
+static bool setup_edge_functions(raster_triangle_t * tri)
+{
+    for (int ii = 0; ii < 3; ii++) {
+        // Edge i goes from vertex j to vertex k, which are the two vertices that aren't i.
+        int j = (ii + 1) % 3;
+        int k = (ii + 2) % 3;
+        tri->edge_a[ii] = tri->y[j] - tri->y[k];
+        tri->edge_b[ii] = tri->x[k] - tri->x[j];
+        tri->edge_c[ii] = ((int64_t)tri->x[j] * tri->y[k]) - ((int64_t)tri->x[k] * tri->y[j]);
+    }
 
-    // Alpha is the area of the small parallelogram/triangle PBC divided by the area of the full parallelogram/triangle ABC
-    float alpha = (pc.x * pb.y - pc.y * pb.x) / area_parallelogram_abc;
+    // Twice the area, with a sign that depends on the winding order of the vertices.
+    int64_t area = ((int64_t)tri->edge_a[0] * tri->x[0]) + ((int64_t)tri->edge_b[0] * tri->y[0]) + tri->edge_c[0];
+    if (area == 0) {
+        return false;
+    }
+
+    if (area < 0) {
+        for (int ii = 0; ii < 3; ii++) {
+            tri->edge_a[ii] = -tri->edge_a[ii];
+            tri->edge_b[ii] = -tri->edge_b[ii];
+            tri->edge_c[ii] = -tri->edge_c[ii];
+        }
+        area = -area;
+    }
+
+    // With the inside positive, the function grows to the right across a left edge, and
+    // (with y going down the screen) grows downwards across a top edge.
+    for (int ii = 0; ii < 3; ii++) {
+        bool is_top_left = (tri->edge_a[ii] > 0) || ((tri->edge_a[ii] == 0) && (tri->edge_b[ii] > 0));
+        tri->edge_bias[ii] = is_top_left ? 0 : -1;
+    }
 
-    // Beta is the area of the small parallelogram/triangle APC divided by the area of the full parallelogram/triangle ABC
-    float beta = (ac.x * ap.y - ac.y * ap.x) / area_parallelogram_abc;
+    // The weights at the center of the origin pixel, and how much they change per pixel.
+    tri->origin_x = tri->x[0] >> SUBPIXEL_BITS;
+    tri->origin_y = tri->y[0] >> SUBPIXEL_BITS;
+    double inv_area = 1.0 / (double)area;
+    double weights[3], weight_dx[3], weight_dy[3];
+    for (int ii = 0; ii < 3; ii++) {
+        weights[ii] = get_edge_value(tri, ii, tri->origin_x, tri->origin_y) * inv_area;
+        weight_dx[ii] = tri->edge_a[ii] * SUBPIXEL_ONE * inv_area;
+        weight_dy[ii] = tri->edge_b[ii] * SUBPIXEL_ONE * inv_area;
+    }
+
+    tri->reciprocal_w_plane = get_attribute_plane(tri->reciprocal_w, weights, weight_dx, weight_dy);
+    if (tri->texture) {
+        if (tri->texture_mapping == TEXTURE_MAPPING_SPANS) {
+            setup_texture_spans(tri);
+        }
+
+        bool is_affine = (tri->texture_mapping == TEXTURE_MAPPING_AFFINE);
+        tri->texture_u_plane = get_attribute_plane(is_affine ? tri->u : tri->u_over_w, weights, weight_dx, weight_dy);
+        tri->texture_v_plane = get_attribute_plane(is_affine ? tri->v : tri->v_over_w, weights, weight_dx, weight_dy);
+    }
+    return true;
+}
 
-    // Weight gamma is easily found since barycentric coordinates always add up to 1.0
-    float gamma = 1 - alpha - beta;
+// u and v at the center of pixel (x, y), with a perspective divide, for the end of a
+// texture span.
+static inline tex2_t get_span_texcoords(const raster_triangle_t * tri, int x, int y)
+{
+    float reciprocal_w = get_plane_value(&tri->reciprocal_w_plane, tri, x, y);
+    reciprocal_w = float_max(tri->min_reciprocal_w, float_min(reciprocal_w, tri->max_reciprocal_w));
+    float w = 1.0f / reciprocal_w;
+
+    tex2_t texcoords = {
+        .u = get_plane_value(&tri->texture_u_plane, tri, x, y) * w,
+        .v = get_plane_value(&tri->texture_v_plane, tri, x, y) * w,
+    };
+    texcoords.u = float_max(tri->min_texcoords.u, float_min(texcoords.u, tri->max_texcoords.u));
+    texcoords.v = float_max(tri->min_texcoords.v, float_min(texcoords.v, tri->max_texcoords.v));
+    return texcoords;
+}
 
-    vec3_t weights = { alpha, beta, gamma };
-    return weights;
+// Set the texture attributes for a block row offset pixels into its texture span to
+// interpolate linearly between the span's ends.
+static inline void get_span_row(const raster_triangle_t * tri, const tex2_t * span_start, const tex2_t * span_end,
+                                int offset, float row_attributes[3], float row_steps[3])
+{
+    row_steps[1] = (span_end->u - span_start->u) / tri->span_length;
+    row_steps[2] = (span_end->v - span_start->v) / tri->span_length;
+    row_attributes[1] = span_start->u + (row_steps[1] * offset);
+    row_attributes[2] = span_start->v + (row_steps[2] * offset);
 }
 
+// Past 2^24 floats are all whole numbers anyway, so wrapping them into the texture
+// can't mean anything; clamping to this keeps the conversion to int defined.
+#define MAX_TEXEL_COORDINATE (16777216.0f)
 
-void draw_triangle_pixel(int x, int y, uint32_t color, vec4_t point_a, vec4_t point_b, vec4_t point_c)
+// Wrap a texel coordinate into a power-of-two sized texture. It has to be rounded down,
+// not towards zero, or coordinates just below 0 would land on texel 0 instead of the
+// last one.
+static inline int wrap_texel_coordinate(float texel, int mask)
 {
-    // Create three vec2_t's for points a,b,c of the triangle so we can interpolate the z value (okay,
-    // the value of 1/w) of point x,y inside the triangle a,b,c.
-    vec2_t p = { x, y };
-    vec2_t a = vec2_from_vec4(point_a);
-    vec2_t b = vec2_from_vec4(point_b);
-    vec2_t c = vec2_from_vec4(point_c);
-
-    // Note that because we truncate the x and y points coming into this function (from float to int),
-    // the x,y point might be *outside* the triangle, and so the alpha, beta, and gamma results
-    // that the barycentric_weights() function calculates might be outside [0,1].
-    // We take the lazy way out and clamp the weights to [0,1] by using the "% texture_width" and
-    // "% texture_height" below when we use the interpolated u and v values to index into the
-    // texture array.
-    vec3_t weights = barycentric_weights(a, b, c, p);
-
-    float alpha = weights.x;
-    float beta = weights.y;
-    float gamma = weights.z;
-
-    // 1/w used for interpolation.
-    float interpolated_reciprocal_w; // W (z depth) is not linear with perspective, but 1/w (the reciprocal) is.
-
-    // Interpolate 1/w for the current pixel.
-    interpolated_reciprocal_w = ((1 / point_a.w) * alpha) + ((1 / point_b.w) * beta) + ((1 / point_c.w) * gamma);
+    texel = float_min(float_max(floorf(texel), -MAX_TEXEL_COORDINATE), MAX_TEXEL_COORDINATE);
+    return (int)texel & mask;
+}
 
+// Shade one pixel inside the triangle, given its interpolated 1/w, and its u/w and v/w
+// with TEXTURE_MAPPING_PERSPECTIVE, or u and v otherwise. Returns true if the pixel's
+// depth got written to the z buffer, so the hierarchical z buffer needs updating. The
+// pixel must be inside the window.
+static inline bool shade_pixel(const raster_triangle_t * tri, int x, int y,
+                               float interpolated_reciprocal_w, float texture_u, float texture_v)
+{
     // Adjust 1/w so the pixels that are closer to the camera have smaller values than
     // pixels farther from the camera.
-    // After this change, interpolated_reciprocal_w will == 0.0 right at the camera,
+    // After this change, depth will == 0.0 right at the camera,
     // and == 1.0 at the farthest away point from the camera.
-    interpolated_reciprocal_w = 1.0 - interpolated_reciprocal_w;
+    float depth = 1.0 - interpolated_reciprocal_w;
 
-    int z_buffer_index = (get_window_width() * y) + x;
-    if (z_buffer_index >= (get_window_height() * get_window_width())) {
-        //printf("ERROR: z_buffer_index is too big: %d, used x:%d y:%d\n", z_buffer_index, x, y);
-    }
+    int buffer_index = (get_window_width() * y) + x;
+    float * z_buffer = get_z_buffer();
+
+    // Only draw the pixel if it's in front of whatever is already in the z buffer, or
+    // after a depth-only pass, if it's the pixel that pass left in the z buffer.
+    if (tri->depth_mode == DEPTH_MODE_EQUAL) {
+        if (depth != z_buffer[buffer_index]) {
+            return false;
+        }
 
-    // Only draw the pixel if it's in front of whatever is already in the z buffer.
-    if (interpolated_reciprocal_w < get_zbuffer_at(x, y))
-    {
-        draw_pixel(x, y, color);
+        // Move the depth the tiniest bit nearer, so another triangle at the exact same
+        // depth here (like a coplanar face drawn over this one) doesn't shade the pixel
+        // a second time. Triangles drawn after this pass (like the next render queue
+        // flush) still get depth tested properly, and the hierarchical z buffer stays
+        // usable since depths only get nearer.
+        z_buffer[buffer_index] = nextafterf(depth, -INFINITY);
+    }
+    else {
+        if (depth >= z_buffer[buffer_index]) {
+            return false;
+        }
 
         // Update z buffer with the 1/w inverted depth value.
-        update_zbuffer_at(x, y, interpolated_reciprocal_w);
+        z_buffer[buffer_index] = depth;
+
+        if (tri->depth_mode == DEPTH_MODE_DEPTH_ONLY) {
+            return true;
+        }
     }
+
+    uint32_t color = tri->color;
+
+    if (tri->texture) {
+        // We use 1/w to get the perspective depth correct: u/w and v/w interpolate linearly, and
+        // dividing by the interpolated 1/w gets back to "normal" u and v.
+        float interpolated_u = texture_u;
+        float interpolated_v = texture_v;
+        if (tri->texture_mapping == TEXTURE_MAPPING_PERSPECTIVE) {
+            float w = 1.0f / interpolated_reciprocal_w;
+            interpolated_u *= w;
+            interpolated_v *= w;
+        }
+
+        // Map the interpolated u and v values to the right pixel in the texture.
+        const texture_t * texture = tri->texture;
+        int texture_x = wrap_texel_coordinate(interpolated_u * texture->width, texture->width_mask);
+        int texture_y = wrap_texel_coordinate(interpolated_v * texture->height, texture->height_mask);
+
+        color = texture->pixels[(texture_y << texture->width_shift) + texture_x];
+    }
+
+    get_color_buffer()[buffer_index] = color;
+
+    return (tri->depth_mode != DEPTH_MODE_EQUAL);
 }
 
-/* /////////////////////////////////////////////////////////////////////////////
-// Draw a filled triangle with the flat-top/flat-bottom method.
-// We split the original triangle in two, half flat-bottom (the top half of the triangle
-// had a flat bottom) and half flat-top (the bottom half of the triangle has a
-// flat top).
-///////////////////////////////////////////////////////////////////////////////
-//
-//          (x0,y0)
-//            / \
-//           /   \
-//          /     \
-//         / flat- \
-//        / bottom  \
-//   (x1,y1)------(Mx,My)   (this alg doesn't use the Mx,My midpoint explicitly)
-//       \_  flat-top \
-//          \_         \
-//             \_       \
-//                \_     \
-//                   \    \
-//                     \_  \
-//                        \_\
-//                           \
-//                         (x2,y2)
-//
-/////////////////////////////////////////////////////////////////////////////// */
+#if SIMD_WIDTH > 1
+// The float just below each depth, the same as nextafterf(depth, -INFINITY).
+static inline simd_float_t get_next_nearer_depths(simd_float_t depth)
+{
+    // Stepping down means subtracting 1 from the bits of positive floats, and adding 1
+    // to the bits of negative ones.
+    simd_int_t bits = simd_as_int(depth);
+    simd_int_t step = simd_int_or(simd_int_srai(bits, 31), simd_int_set1(1));
+    simd_int_t next = simd_int_sub(bits, step);
+
+    // Zero (+0 or -0) steps down to the smallest negative float.
+    simd_int_t is_zero = simd_as_int(simd_cmpeq(depth, simd_set1(0.0f)));
+    return simd_as_float(simd_int_select(is_zero, simd_int_set1(INT32_MIN + 1), next));
+}
 
-void draw_filled_triangle(int x0, int y0, float z0, float w0,
-                          int x1, int y1, float z1, float w1,
-                          int x2, int y2, float z2, float w2,
-                          uint32_t color)
+/*/////////////////////////////////////////////////////////////////////////////
+// Shade SIMD_WIDTH pixels of a row at once, starting at (x, y)
+///////////////////////////////////////////////////////////////////////////////
+// covered has all bits set for the pixels inside the triangle and inside the
+// part of the block being drawn, and the other arguments hold each pixel's
+// interpolated 1/w and texture coordinates, the same as shade_pixel() takes.
+// Each lane does the same math as shade_pixel(), except that the divide by the
+// interpolated 1/w uses an approximate reciprocal plus a Newton-Raphson step.
+// Pixels that are covered and pass the depth test get written to the color and
+// z buffers (depending on the depth mode), and the others keep their old values
+// (a masked store), so all the pixels must be inside the window.
+// Returns true if any pixel's depth got written to the z buffer, so the
+// hierarchical z buffer needs updating.
+/////////////////////////////////////////////////////////////////////////////*/
+static inline bool shade_pixels_simd(const raster_triangle_t * tri, int x, int y, simd_int_t covered,
+                                    simd_float_t interpolated_reciprocal_w, simd_float_t texture_u, simd_float_t texture_v)
 {
-    // First sort the triangle so that y0 < y1 < y2 (so y0 is at the top and y2 is at
-    // the bottom of the triangle).
-    if (y0 > y1)
-    {
-        int_swap(&x0, &x1);
-        int_swap(&y0, &y1);
-        float_swap(&z0, &z1);
-        float_swap(&w0, &w1);
-    }
-    if (y1 > y2)
-    {
-        int_swap(&x1, &x2);
-        int_swap(&y1, &y2);
-        float_swap(&z1, &z2);
-        float_swap(&w1, &w2);
-    }
-    if (y0 > y1)
-    {
-        int_swap(&x0, &x1);
-        int_swap(&y0, &y1);
-        float_swap(&z0, &z1);
-        float_swap(&w0, &w1);
+    if (simd_movemask(simd_as_float(covered)) == 0) {
+        return false;
     }
 
-    vec4_t point_a = {x0, y0, z0, w0};
-    vec4_t point_b = {x1, y1, z1, w1};
-    vec4_t point_c = {x2, y2, z2, w2};
+    simd_float_t depth = simd_sub(simd_set1(1.0f), interpolated_reciprocal_w);
 
-    // Render the upper part of the triangle - with a flat bottom.
-    float inverse_slope_1 = 0.0; // left leg of triangle
-    float inverse_slope_2 = 0.0; // right leg of triangle
+    int buffer_index = (get_window_width() * y) + x;
+    float * z_buffer = get_z_buffer() + buffer_index;
+    uint32_t * color_buffer = get_color_buffer() + buffer_index;
 
-    if ((y1 - y0) != 0)
-    {
-        inverse_slope_1 = (float)(x1 - x0) / (y1 - y0);
+    simd_float_t old_depth = simd_load(z_buffer);
+    simd_float_t depth_passed;
+    if (tri->depth_mode == DEPTH_MODE_EQUAL) {
+        depth_passed = simd_cmpeq(depth, old_depth);
     }
-    if ((y2 - y0) != 0)
-    {
-        inverse_slope_2 = (float)(x2 - x0) / (y2 - y0);
+    else {
+        depth_passed = simd_cmplt(depth, old_depth);
     }
 
-    if ((y1 - y0) != 0)
-    {
-
-        for (int y = y0; y <= y1; y++)
-        {
-            int x_start = x1 + ((y - y1) * inverse_slope_1);
-            int x_end = x0 + ((y - y0) * inverse_slope_2);
+    simd_int_t passed = simd_int_and(covered, simd_as_int(depth_passed));
+    if (simd_movemask(simd_as_float(passed)) == 0) {
+        return false;
+    }
 
-            // Depending on orientation of triangle, x_start and x_end may be on either side of each
-            // other. Swap them so x_start is always on the left and x_end is always on the right.
-            if (x_end < x_start)
-            {
-                int_swap(&x_start, &x_end);
-            }
+    if (tri->depth_mode == DEPTH_MODE_EQUAL) {
+        // Move the depth a tiny bit nearer, like shade_pixel() does.
+        simd_store(z_buffer, simd_as_float(simd_int_select(passed, simd_as_int(get_next_nearer_depths(depth)), simd_as_int(old_depth))));
+    }
+    else {
+        simd_store(z_buffer, simd_as_float(simd_int_select(passed, simd_as_int(depth), simd_as_int(old_depth))));
 
-            for (int x = x_start; x < x_end; x++)
-            {
-                // Draw the pixel with the color that comes from the texture.
-                draw_triangle_pixel(x, y, color, point_a, point_b, point_c);
-            }
+        if (tri->depth_mode == DEPTH_MODE_DEPTH_ONLY) {
+            return true;
         }
     }
 
-    // Render the lower part of the triangle - with a flat top.
-    inverse_slope_1 = 0.0; // left leg of triangle
-    inverse_slope_2 = 0.0; // right leg of triangle
+    simd_int_t color;
+
+    if (tri->texture) {
+        simd_float_t u = texture_u;
+        simd_float_t v = texture_v;
+        if (tri->texture_mapping == TEXTURE_MAPPING_PERSPECTIVE) {
+            simd_float_t w = simd_reciprocal(interpolated_reciprocal_w);
+            u = simd_mul(u, w);
+            v = simd_mul(v, w);
+        }
 
-    if ((y2 - y1) != 0)
-    {
-        inverse_slope_1 = (float)(x2 - x1) / (y2 - y1);
+        // Same as wrap_texel_coordinate() in shade_pixel(). Lanes that aren't drawn can
+        // hold any value at all, even NaN before the conversion to int, but the masks keep
+        // their texture reads inside the texture anyway.
+        const texture_t * texture = tri->texture;
+        simd_int_t texture_x = simd_int_and(simd_floor_to_int(simd_mul(u, simd_set1((float)texture->width))),
+                                            simd_int_set1(texture->width_mask));
+        simd_int_t texture_y = simd_int_and(simd_floor_to_int(simd_mul(v, simd_set1((float)texture->height))),
+                                            simd_int_set1(texture->height_mask));
+
+        simd_int_t texture_index = simd_int_add(simd_int_slli(texture_y, texture->width_shift), texture_x);
+        color = simd_int_gather(texture->pixels, texture_index);
     }
-    if ((y2 - y0) != 0)
-    {
-        inverse_slope_2 = (float)(x2 - x0) / (y2 - y0);
+    else {
+        color = simd_int_set1(tri->color);
     }
 
-    if ((y2 - y1) != 0)
-    {
+    simd_int_store(color_buffer, simd_int_select(passed, color, simd_int_load(color_buffer)));
 
-        for (int y = y1; y <= y2; y++)
-        {
-            int x_start = x1 + ((y - y1) * inverse_slope_1);
-            int x_end = x0 + ((y - y0) * inverse_slope_2);
+    return (tri->depth_mode != DEPTH_MODE_EQUAL);
+}
+#endif
 
-            // Depending on orientation of triangle, x_start and x_end may be on either side of each
-            // other. Swap them so x_start is always on the left and x_end is always on the right.
-            if (x_end < x_start)
-            {
-                int_swap(&x_start, &x_end);
-            }
+/*/////////////////////////////////////////////////////////////////////////////
+// Rasterize a triangle by walking its bounding box in blocks
+///////////////////////////////////////////////////////////////////////////////
+// For each RASTER_BLOCK_SIZE x RASTER_BLOCK_SIZE block, the edge functions are
+// checked at the block's four corners first. Since they're linear:
+//   - if all four corners are outside the same edge, the whole block is outside
+//     the triangle and gets skipped,
+//   - if all four corners are inside all three edges, the whole block is inside
+//     the triangle and its pixels don't need the inside test.
+// Inside a block, the edge functions and attribute planes are stepped from pixel
+// to pixel with adds, and the pixels are shaded SIMD_WIDTH at a time when SIMD is available.
+//
+// Before any of that, the triangle's nearest depth is checked against the
+// hierarchical z buffer: blocks where everything already drawn is nearer than
+// the whole triangle get skipped, and if that's every block the triangle
+// touches, the triangle is skipped before even setting up its edge functions.
+//////////////////////////////////////////////////////////////////////////////*/
+static void rasterize_triangle(raster_triangle_t * tri, const screen_rect_t * clip_rect)
+{
+    // The pixels whose centers are inside the triangle's bounding box, clipped to the clip
+    // rectangle. (The shifts round down, negative numbers included.)
+    int min_x = int_max((int_min(tri->x[0], int_min(tri->x[1], tri->x[2])) - SUBPIXEL_HALF + SUBPIXEL_ONE - 1) >> SUBPIXEL_BITS, clip_rect->x_min);
+    int min_y = int_max((int_min(tri->y[0], int_min(tri->y[1], tri->y[2])) - SUBPIXEL_HALF + SUBPIXEL_ONE - 1) >> SUBPIXEL_BITS, clip_rect->y_min);
+    int max_x = int_min((int_max(tri->x[0], int_max(tri->x[1], tri->x[2])) - SUBPIXEL_HALF) >> SUBPIXEL_BITS, clip_rect->x_max - 1);
+    int max_y = int_min((int_max(tri->y[0], int_max(tri->y[1], tri->y[2])) - SUBPIXEL_HALF) >> SUBPIXEL_BITS, clip_rect->y_max - 1);
+
+    if ((min_x > max_x) || (min_y > max_y)) {
+        return;
+    }
 
-            for (int x = x_start; x < x_end; x++)
-            {
-                // Draw the pixel with the color that comes from the texture.
-                draw_triangle_pixel(x, y, color, point_a, point_b, point_c);
+    // The nearest depth of any pixel in the triangle is at the vertex with the biggest 1/w.
+    // The interpolated 1/w can round to a little more than that, so leave some room.
+    float max_reciprocal_w = float_max(tri->reciprocal_w[0], float_max(tri->reciprocal_w[1], tri->reciprocal_w[2]));
+    float nearest_depth = 1.0f - (max_reciprocal_w * 1.0001f);
+
+    const float * hi_z_buffer = get_hi_z_buffer();
+    const int hi_z_width = get_hi_z_width();
+    const int first_column = min_x / RASTER_BLOCK_SIZE;
+    const int first_row = min_y / RASTER_BLOCK_SIZE;
+    const int last_column = max_x / RASTER_BLOCK_SIZE;
+    const int last_row = max_y / RASTER_BLOCK_SIZE;
+
+    bool is_triangle_hidden = true;
+    for (int row = first_row; is_triangle_hidden && (row <= last_row); row++) {
+        for (int column = first_column; column <= last_column; column++) {
+            if (nearest_depth < hi_z_buffer[(row * hi_z_width) + column]) {
+                is_triangle_hidden = false;
+                break;
             }
         }
     }
-}
 
-// Function to draw the textured pixel at position (x,y) on screen, using interpolation
-// from 3 points of the triangle (points are a, b, and c).
-void draw_texel(int x, int y, upng_t *texture,
-                vec4_t point_a, vec4_t point_b, vec4_t point_c,
-                tex2_t a_uv, tex2_t b_uv, tex2_t c_uv)
-{
-    vec2_t p = {x, y};
-    vec2_t a = vec2_from_vec4(point_a);
-    vec2_t b = vec2_from_vec4(point_b);
-    vec2_t c = vec2_from_vec4(point_c);
-
-    // Note that because we truncate the x and y points coming into this function (from float to int),
-    // the x,y point might be *outside* the triangle, and so the alpha, beta, and gamma results
-    // that the barycentric_weights() function calculates might be outside [0,1].
-    // We take the lazy way out and clamp the weights to [0,1] by using the "% texture_width" and
-    // "% texture_height" below when we use the interpolated u and v values to index into the
-    // texture array.
-    vec3_t weights = barycentric_weights(a, b, c, p);
-
-    float alpha = weights.x;
-    float beta = weights.y;
-    float gamma = weights.z;
-
-    // u, v, and 1/w used for interpolation.
-    float interpolated_u;
-    float interpolated_v;
-    float interpolated_reciprocal_w; // W (z depth) is not linear with perspective, but 1/w (the reciprocal) is.
-
-    // Interpolate the u and v values using barycentric weights (alpha, beta, and gamma) and also 1/w.
-    // We use 1/w to get the perspective depth correct.
-    interpolated_u = ((a_uv.u / point_a.w) * alpha) + ((b_uv.u / point_b.w) * beta) + ((c_uv.u / point_c.w) * gamma);
-    interpolated_v = ((a_uv.v / point_a.w) * alpha) + ((b_uv.v / point_b.w) * beta) + ((c_uv.v / point_c.w) * gamma);
-
-    // Interpolate 1/w for the current pixel.
-    interpolated_reciprocal_w = ((1 / point_a.w) * alpha) + ((1 / point_b.w) * beta) + ((1 / point_c.w) * gamma);
-
-    // Now divide by w to get back to "normal" depth (instead of 1/w inverted (or reciprocal) depth).
-    interpolated_u /= interpolated_reciprocal_w;
-    interpolated_v /= interpolated_reciprocal_w;
-
-    // Map the interpolated u and v values to the right pixel in the texture.
-    // We use the "% texture_width" and "% texture_height" at the end to clamp
-    // the values to be within the texture[] structure, which is
-    // texture_width * texture_height large.
-    int texture_width = upng_get_width(texture);
-    int texture_height = upng_get_height(texture);
-
-    int texture_x = abs((int)(interpolated_u * texture_width)) % texture_width;
-    int texture_y = abs((int)(interpolated_v * texture_height)) % texture_height;
-
-    if ((texture_x > texture_width) || (texture_y > texture_height))
-    {
-        printf("ERROR: texture x or y too big: %d, %d\n", texture_x, texture_y);
-        printf("       interpolated u, v: %f, %f\n", interpolated_u, interpolated_v);
+    if (is_triangle_hidden || !setup_edge_functions(tri)) {
+        return;
     }
 
-    uint32_t texture_array_index = (texture_width * texture_y) + texture_x;
+    const int block_step = RASTER_BLOCK_SIZE - 1; // from a block's first pixel to its last
 
-    int z_buffer_index = (get_window_width() * y) + x;
-    if (z_buffer_index >= (get_window_height() * get_window_width()))
-    {
-        //printf("ERROR: z_buffer_index is too big: %d, used x:%d y:%d\n", z_buffer_index, x, y);
+    // How much the edge functions change from one pixel to the next.
+    int step_x[3], step_y[3];
+    for (int ii = 0; ii < 3; ii++) {
+        step_x[ii] = tri->edge_a[ii] * SUBPIXEL_ONE;
+        step_y[ii] = tri->edge_b[ii] * SUBPIXEL_ONE;
     }
 
-    // Adjust 1/w so the pixels that are closer to the camera have smaller values than
-    // pixels farther from the camera.
-    // After this change, interpolated_reciprocal_w will == 0.0 right at the camera,
-    // and == 1.0 at the farthest away point from the camera.
-    interpolated_reciprocal_w = 1.0 - interpolated_reciprocal_w;
+    // The attribute planes, in the same order as shade_pixel() takes them.
+    const attribute_plane_t * planes[3] = { &tri->reciprocal_w_plane, &tri->texture_u_plane, &tri->texture_v_plane };
+    const bool is_using_spans = (tri->texture_mapping == TEXTURE_MAPPING_SPANS);
+
+#if SIMD_WIDTH > 1
+    // Lane i of a SIMD group is the pixel i to the right of the group's first pixel,
+    // so its edge functions are step_x * i bigger, and the same for the attributes.
+    int lane_offsets[SIMD_WIDTH];
+    float lane_float_offsets[SIMD_WIDTH];
+    int lane_steps[3][SIMD_WIDTH];
+    for (int lane = 0; lane < SIMD_WIDTH; lane++) {
+        lane_offsets[lane] = lane;
+        lane_float_offsets[lane] = lane;
+        for (int ii = 0; ii < 3; ii++) {
+            lane_steps[ii][lane] = step_x[ii] * lane;
+        }
+    }
+    simd_int_t lane_x_offsets = simd_int_load(lane_offsets);
+    simd_float_t lane_attribute_offsets = simd_load(lane_float_offsets);
+    simd_int_t lane_edge_steps[3] = {
+        simd_int_load(lane_steps[0]), simd_int_load(lane_steps[1]), simd_int_load(lane_steps[2])
+    };
+#endif
+
+    // Blocks are aligned to the screen, not to the triangle.
+    for (int row = first_row; row <= last_row; row++) {
+        // The texture coordinates at the start and end of the texture span starting at
+        // span_x, for each pixel row in this row of blocks.
+        tex2_t span_starts[RASTER_BLOCK_SIZE];
+        tex2_t span_ends[RASTER_BLOCK_SIZE];
+        int span_x = -1; // no span yet
+
+        for (int column = first_column; column <= last_column; column++) {
+            // Skip the block if everything in it is already nearer than the triangle.
+            if (nearest_depth >= hi_z_buffer[(row * hi_z_width) + column]) {
+                continue;
+            }
 
-    // Only draw the pixel if it's in front of whatever is already in the z buffer.
-    if (interpolated_reciprocal_w < get_zbuffer_at(x, y))
-    {
-        uint32_t *texture_buffer = (uint32_t *)upng_get_buffer(texture);
-        draw_pixel(x, y, texture_buffer[texture_array_index]);
+            int block_x = column * RASTER_BLOCK_SIZE;
+            int block_y = row * RASTER_BLOCK_SIZE;
+            bool is_block_outside = false;
+            bool is_block_inside = true;
+            int block_edges[3]; // the pixel test values at the block's top left pixel
+
+            for (int ii = 0; ii < 3; ii++) {
+                int64_t e = get_edge_value(tri, ii, block_x, block_y);
+                int64_t e_top_left = e + tri->edge_bias[ii];
+                int64_t e_top_right = e_top_left + ((int64_t)step_x[ii] * block_step);
+                int64_t e_bottom_left = e_top_left + ((int64_t)step_y[ii] * block_step);
+                int64_t e_bottom_right = e_top_right + ((int64_t)step_y[ii] * block_step);
+
+                if ((e_top_left < 0) && (e_top_right < 0) && (e_bottom_left < 0) && (e_bottom_right < 0)) {
+                    is_block_outside = true;
+                    break;
+                }
+                if ((e_top_left < 0) || (e_top_right < 0) || (e_bottom_left < 0) || (e_bottom_right < 0)) {
+                    // The edge crosses the block, so its values in the block fit in an int.
+                    is_block_inside = false;
+                    block_edges[ii] = (int)e_top_left;
+                }
+                else {
+                    block_edges[ii] = EDGE_INSIDE_BLOCK;
+                }
+            }
 
-        // Update z buffer with the 1/w inverted depth value.
-        update_zbuffer_at(x, y, interpolated_reciprocal_w);
+            if (is_block_outside) {
+                continue;
+            }
+
+            // Only the part of the block inside the clipped bounding box gets drawn.
+            int first_x = int_max(block_x, min_x);
+            int first_y = int_max(block_y, min_y);
+            int last_x = int_min(block_x + block_step, max_x);
+            int last_y = int_min(block_y + block_step, max_y);
+
+            bool is_z_written = false; // whether the block's hierarchical z needs updating
+
+            // Edge function values and attributes at the left side of the block, on the
+            // first row drawn, and how much the attributes change per pixel to the right.
+            int row_edges[3];
+            float row_attributes[3];
+            float row_steps[3];
+            for (int ii = 0; ii < 3; ii++) {
+                row_edges[ii] = block_edges[ii] + step_y[ii] * (first_y - block_y);
+                row_attributes[ii] = get_plane_value(planes[ii], tri, block_x, first_y);
+                row_steps[ii] = planes[ii]->dx;
+            }
+
+            // Every block row here is inside one texture span. If the last block drawn
+            // was in the span before, its span ends are this span's starts.
+            if (is_using_spans) {
+                int block_span_x = block_x - (block_x % tri->span_length);
+                if (block_span_x != span_x) {
+                    bool is_next_span = (span_x >= 0) && (block_span_x == span_x + tri->span_length);
+                    for (int y = first_y; y <= last_y; y++) {
+                        int ii = y - block_y;
+                        span_starts[ii] = is_next_span ? span_ends[ii] : get_span_texcoords(tri, block_span_x, y);
+                        span_ends[ii] = get_span_texcoords(tri, block_span_x + tri->span_length, y);
+                    }
+                    span_x = block_span_x;
+                }
+            }
+
+#if SIMD_WIDTH > 1
+            // Shade SIMD_WIDTH pixels at a time, unless the block sticks out past the right
+            // side of the clip rectangle (only at the right edge of the window), since the
+            // SIMD loads and stores always cover whole block rows.
+            if (block_x + RASTER_BLOCK_SIZE <= clip_rect->x_max) {
+                simd_int_t before_first_x = simd_int_set1(first_x - 1);
+                simd_int_t after_last_x = simd_int_set1(last_x + 1);
+
+                for (int y = first_y; y <= last_y; y++) {
+                    if (is_using_spans) {
+                        get_span_row(tri, &span_starts[y - block_y], &span_ends[y - block_y], block_x - span_x,
+                                     row_attributes, row_steps);
+                    }
+
+                    for (int group_x = block_x; group_x < block_x + RASTER_BLOCK_SIZE; group_x += SIMD_WIDTH) {
+                        int group_offset = group_x - block_x;
+                        simd_int_t lane_x = simd_int_add(simd_int_set1(group_x), lane_x_offsets);
+                        simd_int_t draw_mask = simd_int_and(simd_int_cmpgt(lane_x, before_first_x),
+                                                            simd_int_cmpgt(after_last_x, lane_x));
+
+                        simd_int_t e0 = simd_int_add(simd_int_set1(row_edges[0] + step_x[0] * group_offset), lane_edge_steps[0]);
+                        simd_int_t e1 = simd_int_add(simd_int_set1(row_edges[1] + step_x[1] * group_offset), lane_edge_steps[1]);
+                        simd_int_t e2 = simd_int_add(simd_int_set1(row_edges[2] + step_x[2] * group_offset), lane_edge_steps[2]);
+
+                        // A pixel is covered when none of its edge functions are negative.
+                        simd_int_t covered = simd_int_and(draw_mask, simd_int_cmpgt(simd_int_or(simd_int_or(e0, e1), e2), simd_int_set1(-1)));
+
+                        simd_float_t attributes[3];
+                        for (int ii = 0; ii < 3; ii++) {
+                            attributes[ii] = simd_add(simd_set1(row_attributes[ii] + row_steps[ii] * group_offset),
+                                                      simd_mul(simd_set1(row_steps[ii]), lane_attribute_offsets));
+                        }
+
+                        is_z_written |= shade_pixels_simd(tri, group_x, y, covered, attributes[0], attributes[1], attributes[2]);
+                    }
+
+                    for (int ii = 0; ii < 3; ii++) {
+                        row_edges[ii] += step_y[ii];
+                        row_attributes[ii] += planes[ii]->dy;
+                    }
+                }
+
+                if (is_z_written) {
+                    update_hi_z_block(column, row);
+                }
+                continue;
+            }
+#endif
+
+            for (int y = first_y; y <= last_y; y++) {
+                if (is_using_spans) {
+                    get_span_row(tri, &span_starts[y - block_y], &span_ends[y - block_y], block_x - span_x,
+                                 row_attributes, row_steps);
+                }
+
+                int e0 = row_edges[0] + step_x[0] * (first_x - block_x);
+                int e1 = row_edges[1] + step_x[1] * (first_x - block_x);
+                int e2 = row_edges[2] + step_x[2] * (first_x - block_x);
+                float reciprocal_w = row_attributes[0] + row_steps[0] * (first_x - block_x);
+                float texture_u = row_attributes[1] + row_steps[1] * (first_x - block_x);
+                float texture_v = row_attributes[2] + row_steps[2] * (first_x - block_x);
+
+                for (int x = first_x; x <= last_x; x++) {
+                    // The pixel is inside when none of the edge functions are negative,
+                    // which is when the OR of all three doesn't have the sign bit set.
+                    if (is_block_inside || ((e0 | e1 | e2) >= 0)) {
+                        is_z_written |= shade_pixel(tri, x, y, reciprocal_w, texture_u, texture_v);
+                    }
+                    e0 += step_x[0];
+                    e1 += step_x[1];
+                    e2 += step_x[2];
+                    reciprocal_w += row_steps[0];
+                    texture_u += row_steps[1];
+                    texture_v += row_steps[2];
+                }
+
+                for (int ii = 0; ii < 3; ii++) {
+                    row_edges[ii] += step_y[ii];
+                    row_attributes[ii] += planes[ii]->dy;
+                }
+            }
+
+            if (is_z_written) {
+                update_hi_z_block(column, row);
+            }
+        }
     }
 }
 
+/* /////////////////////////////////////////////////////////////////////////////
+// Draw a filled triangle with a solid color.
+///////////////////////////////////////////////////////////////////////////////
+//
+//          (x0,y0)
+//            / \
+//           /   \
+//          /     \
+//         /       \
+//        /         \
+//   (x1,y1)         \
+//       \_           \
+//          \_         \
+//             \_       \
+//                \_     \
+//                   \    \
+//                     \_  \
+//                        \_\
+//                           \
+//                         (x2,y2)
+//
+// The z and w values are used for the z buffer depth test, as set by
+// depth_mode. Only the pixels inside clip_rect are drawn.
+/////////////////////////////////////////////////////////////////////////////// */
+
+void draw_filled_triangle(float x0, float y0, float z0, float reciprocal_w0,
+                          float x1, float y1, float z1, float reciprocal_w1,
+                          float x2, float y2, float z2, float reciprocal_w2,
+                          uint32_t color, depth_mode_t depth_mode, const screen_rect_t * clip_rect)
+{
+    (void)z0;
+    (void)z1;
+    (void)z2;
+
+    raster_triangle_t tri = {
+        .x = {snap_to_subpixel(x0), snap_to_subpixel(x1), snap_to_subpixel(x2)},
+        .y = {snap_to_subpixel(y0), snap_to_subpixel(y1), snap_to_subpixel(y2)},
+        .reciprocal_w = {reciprocal_w0, reciprocal_w1, reciprocal_w2},
+        .depth_mode = depth_mode,
+        .color = color,
+        .texture = NULL,
+    };
+
+    rasterize_triangle(&tri, clip_rect);
+}
+
 /* ////////////////////////////////////////////////////////////////////////////
 // Draw a textured triangle based on a texture array of colors.
-// We split the original triangle in two, half flat-bottom and half flat-top.
 ///////////////////////////////////////////////////////////////////////////////
 //
 //        v0
@@ -313,7 +782,7 @@ void draw_texel(int x, int y, upng_t *texture,
 //       /  \ 
 //      /    \ 
 //     /      \ 
-//   v1--------\ 
+//   v1        \ 
 //     \_       \ 
 //        \_     \ 
 //           \_   \ 
@@ -322,39 +791,20 @@ void draw_texel(int x, int y, upng_t *texture,
 //                   \ 
 //                    v2
 //
+// u and v are the texture coordinates of each vertex, and are interpolated
+// with perspective correction using 1/w, at every pixel or at the ends of
+// texture spans (see set_texture_span_length()). 1/w is also used for the z
+// buffer depth test, as set by depth_mode. Only the pixels inside clip_rect are drawn.
 */
 
-void draw_textured_triangle(int x0, int y0, float z0, float w0, float u0, float v0, 
-                            int x1, int y1, float z1, float w1, float u1, float v1,
-                            int x2, int y2, float z2, float w2, float u2, float v2,
-                            upng_t *texture)
+void draw_textured_triangle(float x0, float y0, float z0, float reciprocal_w0, float u0, float v0,
+                            float x1, float y1, float z1, float reciprocal_w1, float u1, float v1,
+                            float x2, float y2, float z2, float reciprocal_w2, float u2, float v2,
+                            const texture_t * texture, depth_mode_t depth_mode, const screen_rect_t * clip_rect)
 {
-    // First sort the triangle so that y0 < y1 < y2 (so y0 is at the top and y2 is at
-    // the bottom of the triangle).
-    if (y0 > y1) {
-        int_swap(&x0, &x1);
-        int_swap(&y0, &y1);
-        float_swap(&u0, &u1);
-        float_swap(&v0, &v1);
-        float_swap(&z0, &z1);
-        float_swap(&w0, &w1);
-    }
-    if (y1 > y2) {
-        int_swap(&x1, &x2);
-        int_swap(&y1, &y2);
-        float_swap(&u1, &u2);
-        float_swap(&v1, &v2);
-        float_swap(&z1, &z2);
-        float_swap(&w1, &w2);
-    }
-    if (y0 > y1) {
-        int_swap(&x0, &x1);
-        int_swap(&y0, &y1);
-        float_swap(&u0, &u1);
-        float_swap(&v0, &v1);
-        float_swap(&z0, &z1);
-        float_swap(&w0, &w1);
-    }
+    (void)z0;
+    (void)z1;
+    (void)z2;
 
     // Flip the V coordinates to account for inverted UV-coordinates. The obj file has
     // u=v=0 at the top left, with u=v=1 at the bottom right: this is the inverse of 
@@ -363,92 +813,75 @@ void draw_textured_triangle(int x0, int y0, float z0, float w0, float u0, float
     v1 = 1.0 - v1;
     v2 = 1.0 - v2;
 
-    // Create the vector points of the sorted triangle for use in interpolation.
-    vec4_t point_a = { x0, y0, z0, w0 };
-    vec4_t point_b = { x1, y1, z1, w1 };
-    vec4_t point_c = { x2, y2, z2, w2 };
-
-    // Create texture coords after sorting.
-    tex2_t a_uv = {u0, v0};
-    tex2_t b_uv = {u1, v1};
-    tex2_t c_uv = {u2, v2};
-
-    // Render the upper part of the triangle - with a flat bottom.
-    float inverse_slope_1 = 0.0; // left leg of triangle
-    float inverse_slope_2 = 0.0; // right leg of triangle
-
-    if ((y1 - y0) != 0) {
-        inverse_slope_1 = (float)(x1 - x0) / (y1 - y0);
-    }
-    if ((y2 - y0) != 0) {
-        inverse_slope_2 = (float)(x2 - x0) / (y2 - y0);
-    }
-
-    if ((y1 - y0) != 0) {
-
-        for (int y = y0; y <= y1; y++) {
-            int x_start = x1 + ((y - y1) * inverse_slope_1);
-            int x_end = x0 + ((y - y0) * inverse_slope_2);
-
-            // Depending on orientation of triangle, x_start and x_end may be on either side of each
-            // other. Swap them so x_start is always on the left and x_end is always on the right.
-            if (x_end < x_start) {
-                int_swap(&x_start, &x_end);
-            }
+    raster_triangle_t tri = {
+        .x = {snap_to_subpixel(x0), snap_to_subpixel(x1), snap_to_subpixel(x2)},
+        .y = {snap_to_subpixel(y0), snap_to_subpixel(y1), snap_to_subpixel(y2)},
+        .reciprocal_w = {reciprocal_w0, reciprocal_w1, reciprocal_w2},
+        .u = {u0, u1, u2},
+        .v = {v0, v1, v2},
+        .u_over_w = {u0 * reciprocal_w0, u1 * reciprocal_w1, u2 * reciprocal_w2},
+        .v_over_w = {v0 * reciprocal_w0, v1 * reciprocal_w1, v2 * reciprocal_w2},
+        .texture_mapping = (texture_span_length > 0) ? TEXTURE_MAPPING_SPANS : TEXTURE_MAPPING_PERSPECTIVE,
+        .span_length = texture_span_length,
+        .depth_mode = depth_mode,
+        .texture = texture,
+    };
+
+    rasterize_triangle(&tri, clip_rect);
+}
 
-            for (int x = x_start; x < x_end; x++) {
-                // Draw the pixel with the color that comes from the texture.
-                //draw_pixel(x, y, 0xFFFF00FF);
-                draw_texel(x, y, texture,
-                           point_a, point_b, point_c,
-                           a_uv, b_uv, c_uv);
-            }
-        }
-    }
+/* ////////////////////////////////////////////////////////////////////////////
+// Draw only a triangle's depth into the z buffer, for a depth pre-pass.
+///////////////////////////////////////////////////////////////////////////////
+// After drawing every triangle this way, the z buffer holds the nearest depth
+// at each pixel. Drawing the triangles again with DEPTH_MODE_EQUAL then shades
+// each pixel only once, for the triangle that ends up visible there.
+// This goes through the same rasterizer and depth math as the other draw
+// functions (with the same 1/w), so the depths match exactly.
+*/
 
-    // Render the lower part of the triangle - with a flat top.
-    inverse_slope_1 = 0.0; // left leg of triangle
-    inverse_slope_2 = 0.0; // right leg of triangle
+void draw_triangle_depth(float x0, float y0, float reciprocal_w0,
+                         float x1, float y1, float reciprocal_w1,
+                         float x2, float y2, float reciprocal_w2,
+                         const screen_rect_t * clip_rect)
+{
+    raster_triangle_t tri = {
+        .x = {snap_to_subpixel(x0), snap_to_subpixel(x1), snap_to_subpixel(x2)},
+        .y = {snap_to_subpixel(y0), snap_to_subpixel(y1), snap_to_subpixel(y2)},
+        .reciprocal_w = {reciprocal_w0, reciprocal_w1, reciprocal_w2},
+        .depth_mode = DEPTH_MODE_DEPTH_ONLY,
+        .texture = NULL,
+    };
+
+    rasterize_triangle(&tri, clip_rect);
+}
 
-    if ((y2 - y1) != 0) {
-        inverse_slope_1 = (float)(x2 - x1) / (y2 - y1);
-    }
-    if ((y2 - y0) != 0) {
-        inverse_slope_2 = (float)(x2 - x0) / (y2 - y0);
+// Set how many pixels apart along a row textured triangles get an exact perspective
+// divide, or 0 for every pixel. It has to be a multiple of RASTER_BLOCK_SIZE.
+void set_texture_span_length(int span_length)
+{
+    if ((span_length < 0) || ((span_length % RASTER_BLOCK_SIZE) != 0)) {
+        fprintf(stderr, "Error: texture spans must be a multiple of %d pixels long, not %d.\n",
+                RASTER_BLOCK_SIZE, span_length);
+        return;
     }
 
-    if ((y2 - y1) != 0) {
-
-        for (int y = y1; y <= y2; y++) {
-            int x_start = x1 + ((y - y1) * inverse_slope_1);
-            int x_end = x0 + ((y - y0) * inverse_slope_2);
-
-            // Depending on orientation of triangle, x_start and x_end may be on either side of each
-            // other. Swap them so x_start is always on the left and x_end is always on the right.
-            if (x_end < x_start) {
-                int_swap(&x_start, &x_end);
-            }
+    texture_span_length = span_length;
+}
 
-            for (int x = x_start; x < x_end; x++) {
-                // Draw the pixel with the color that comes from the texture.
-                //draw_pixel(x, y, 0xFFFF0055);
-                draw_texel(x, y, texture,
-                           point_a, point_b, point_c,
-                           a_uv, b_uv, c_uv);
-            }
-        }
-    }
+int get_texture_span_length(void)
+{
+    return texture_span_length;
 }
 
-vec3_t get_triangle_normal(vec4_t vertices[3])
+vec3_t get_triangle_normal(vec3_t vertices[3])
 {
-    // Backface culling.
     // Remember that triangles are "clockwise", going A-B-C.
     // Also remember that we use a left-handed axis system, so z gets larger
     // going "into" the screen away from the viewer.
-    vec3_t vector_a = vec3_from_vec4(vertices[0]); /*     A     */
-    vec3_t vector_b = vec3_from_vec4(vertices[1]); /*    / \    */
-    vec3_t vector_c = vec3_from_vec4(vertices[2]); /*   C---B   */
+    vec3_t vector_a = vertices[0]; /*     A     */
+    vec3_t vector_b = vertices[1]; /*    / \    */
+    vec3_t vector_c = vertices[2]; /*   C---B   */
 
     vec3_t vector_ab = vec3_sub(vector_b, vector_a); // Vector AB
     vec3_t vector_ac = vec3_sub(vector_c, vector_a); // Vector AC
@@ -1,9 +1,10 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
+#include "display.h"
 #include "gfx-vector.h"
 #include "texture.h"
-#include "upng.h"
 
 // Struct for vertex index.
 typedef struct {
@@ -14,28 +15,49 @@ typedef struct {
     tex2_t b_uv;
     tex2_t c_uv;
     uint32_t color;
+    vec3_t normal;  // unit normal in model space, worked out when the mesh is loaded
+    float distance; // the face's plane: points p with dot(normal, p) == distance
 } face_t; 
 
 // Struct for projected points on the screen.
 typedef struct {
     vec4_t points[3];
     tex2_t texcoords[3]; // UV texture coordinates
+    float reciprocal_w[3]; // 1/w of each point, worked out once here instead of per pixel
     uint32_t color;
-    upng_t * texture;
+    const texture_t * texture;
 } triangle_t;
 
-vec3_t get_triangle_normal(vec4_t vertices[3]);
+// How the rasterizer uses the z buffer.
+typedef enum {
+    DEPTH_MODE_NORMAL,     // draw pixels nearer than the z buffer, and write their depth
+    DEPTH_MODE_DEPTH_ONLY, // only write the depth of pixels nearer than the z buffer
+    DEPTH_MODE_EQUAL,      // only draw pixels exactly at the z buffer's depth, after a depth-only pass
+} depth_mode_t;
 
-void draw_filled_triangle(int x0, int y0, float z0, float w0,
-                          int x1, int y1, float z1, float w1,
-                          int x2, int x3, float z2, float w2,
-                          uint32_t color);
+// How many pixels apart along a row textured triangles get an exact perspective divide
+// by default, with u and v interpolated linearly in between. 0 divides at every pixel,
+// otherwise it has to be a multiple of 8 (the rasterizer's block size).
+#ifndef TEXTURE_SPAN_LENGTH
+#define TEXTURE_SPAN_LENGTH (0)
+#endif
 
-void draw_textured_triangle(int x0, int y0, float z0, float w0, float u0, float v0, 
-                            int x1, int y1, float z1, float w1, float u1, float v1,
-                            int x2, int y2, float z2, float w2, float u2, float v2,
-                            upng_t * texture);
+void set_texture_span_length(int span_length);
+int get_texture_span_length(void);
 
-void draw_texel(int x, int y, upng_t * texture,
-                vec4_t point_a, vec4_t point_b, vec4_t point_c,
-                tex2_t a_uv, tex2_t b_uv, tex2_t c_uv);
\ No newline at end of file
+vec3_t get_triangle_normal(vec3_t vertices[3]);
+
+void draw_triangle_depth(float x0, float y0, float reciprocal_w0,
+                         float x1, float y1, float reciprocal_w1,
+                         float x2, float y2, float reciprocal_w2,
+                         const screen_rect_t * clip_rect);
+
+void draw_filled_triangle(float x0, float y0, float z0, float reciprocal_w0,
+                          float x1, float y1, float z1, float reciprocal_w1,
+                          float x2, float y2, float z2, float reciprocal_w2,
+                          uint32_t color, depth_mode_t depth_mode, const screen_rect_t * clip_rect);
+
+void draw_textured_triangle(float x0, float y0, float z0, float reciprocal_w0, float u0, float v0,
+                            float x1, float y1, float z1, float reciprocal_w1, float u1, float v1,
+                            float x2, float y2, float z2, float reciprocal_w2, float u2, float v2,
+                            const texture_t * texture, depth_mode_t depth_mode, const screen_rect_t * clip_rect);
\ No newline at end of file
@@ -0,0 +1,275 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "array.h"
+#include "vertex_cache.h"
+
+/*/////////////////////////////////////////////////////////////////////////////
+// Reorder faces and vertices for vertex reuse
+///////////////////////////////////////////////////////////////////////////////
+// OBJ exporters write faces in whatever order suits them, which often has each
+// face using vertices far from the last face's in the vertex array. The faces
+// get reordered with Tom Forsyth's "Linear-Speed Vertex Cache Optimisation":
+// a simulated LRU cache of VERTEX_CACHE_SIZE vertices, a score for each vertex
+// from where it is in the cache and how many faces still need it, and each next
+// face is the best scoring one using a vertex in the cache. When no face uses a
+// cached vertex, the next face not yet taken in the old order starts over.
+//
+// The vertices are then renumbered in the order the new faces first use them,
+// so walking the faces walks the vertex array mostly forward. Vertices no face
+// uses go at the end.
+/////////////////////////////////////////////////////////////////////////////*/
+
+// The scoring constants from Forsyth's article.
+#define CACHE_DECAY_POWER (1.5)
+#define LAST_FACE_SCORE (0.75)
+#define VALENCE_BOOST_SCALE (2.0)
+#define VALENCE_BOOST_POWER (0.5)
+
+static float get_vertex_score(int cache_position, int num_active_faces)
+{
+    // No faces left to use it, so it doesn't matter where it is.
+    if (num_active_faces == 0) {
+        return -1.0;
+    }
+
+    float score = 0.0;
+    if (cache_position >= 0) {
+        if (cache_position < 3) {
+            // The last face's vertices all score the same, so the order it listed them
+            // in doesn't matter.
+            score = LAST_FACE_SCORE;
+        } else {
+            float scaled_position = 1.0 - ((float)(cache_position - 3) / (VERTEX_CACHE_SIZE - 3));
+            score = powf(scaled_position, CACHE_DECAY_POWER);
+        }
+    }
+
+    // Vertices with few faces left get a boost, so lone faces get picked up before
+    // they're stranded.
+    score += VALENCE_BOOST_SCALE * powf((float)num_active_faces, -VALENCE_BOOST_POWER);
+    return score;
+}
+
+static float get_face_score(const face_t * face, const float * vertex_scores)
+{
+    return vertex_scores[face->a] + vertex_scores[face->b] + vertex_scores[face->c];
+}
+
+bool optimize_vertex_cache(mesh_lod_t * lod)
+{
+    int num_vertices = array_length(lod->vertices);
+    int num_faces = array_length(lod->faces);
+
+    // The faces around each vertex not taken yet, in vertex_faces starting at
+    // vertex_face_starts[vertex], and num_active_faces[vertex] of them.
+    int * vertex_face_starts = (int *)calloc(num_vertices + 1, sizeof(int));
+    int * vertex_faces = (int *)malloc((3 * num_faces + 1) * sizeof(int));
+    int * num_active_faces = (int *)calloc(num_vertices + 1, sizeof(int));
+    int * cache_positions = (int *)malloc((num_vertices + 1) * sizeof(int));
+    float * vertex_scores = (float *)malloc((num_vertices + 1) * sizeof(float));
+    float * face_scores = (float *)malloc((num_faces + 1) * sizeof(float));
+    bool * is_face_taken = (bool *)calloc(num_faces + 1, sizeof(bool));
+    face_t * ordered_faces = (face_t *)malloc((num_faces + 1) * sizeof(face_t));
+    int * new_indices = (int *)malloc((num_vertices + 1) * sizeof(int));
+    vec3_t * old_vertices = (vec3_t *)malloc((num_vertices + 1) * sizeof(vec3_t));
+    bool all_good = vertex_face_starts && vertex_faces && num_active_faces && cache_positions &&
+                    vertex_scores && face_scores && is_face_taken && ordered_faces &&
+                    new_indices && old_vertices;
+
+    if (!all_good) {
+        fprintf(stderr, "Error: malloc failed while reordering the mesh for the vertex cache.\n");
+    } else {
+        for (int face_i = 0; face_i < num_faces; face_i++) {
+            vertex_face_starts[lod->faces[face_i].a + 1]++;
+            vertex_face_starts[lod->faces[face_i].b + 1]++;
+            vertex_face_starts[lod->faces[face_i].c + 1]++;
+        }
+        for (int vertex_i = 0; vertex_i < num_vertices; vertex_i++) {
+            vertex_face_starts[vertex_i + 1] += vertex_face_starts[vertex_i];
+        }
+        for (int face_i = 0; face_i < num_faces; face_i++) {
+            const face_t * face = &lod->faces[face_i];
+            int corners[3] = { face->a, face->b, face->c };
+            for (int corner = 0; corner < 3; corner++) {
+                int vertex = corners[corner];
+                vertex_faces[vertex_face_starts[vertex] + num_active_faces[vertex]] = face_i;
+                num_active_faces[vertex]++;
+            }
+        }
+
+        for (int vertex_i = 0; vertex_i < num_vertices; vertex_i++) {
+            cache_positions[vertex_i] = -1;
+            vertex_scores[vertex_i] = get_vertex_score(-1, num_active_faces[vertex_i]);
+        }
+        for (int face_i = 0; face_i < num_faces; face_i++) {
+            face_scores[face_i] = get_face_score(&lod->faces[face_i], vertex_scores);
+        }
+
+        int cache[VERTEX_CACHE_SIZE];
+        int cache_length = 0;
+        int best_face = -1;
+        int next_unused_face = 0;
+
+        for (int num_ordered_faces = 0; num_ordered_faces < num_faces; num_ordered_faces++) {
+            if (best_face < 0) {
+                while (is_face_taken[next_unused_face]) {
+                    next_unused_face++;
+                }
+                best_face = next_unused_face;
+            }
+
+            const face_t * face = &lod->faces[best_face];
+            int corners[3] = { face->a, face->b, face->c };
+            ordered_faces[num_ordered_faces] = *face;
+            is_face_taken[best_face] = true;
+
+            // The face's vertices go to the front of the cache, and the face comes off
+            // their lists of faces still to take. The new cache has room for one face's
+            // vertices more than VERTEX_CACHE_SIZE: the ones past the end just fell out.
+            int new_cache[VERTEX_CACHE_SIZE + 3];
+            int new_cache_length = 0;
+
+            for (int corner = 0; corner < 3; corner++) {
+                int vertex = corners[corner];
+                int * faces = &vertex_faces[vertex_face_starts[vertex]];
+                for (int ii = 0; ii < num_active_faces[vertex]; ii++) {
+                    if (faces[ii] == best_face) {
+                        faces[ii] = faces[num_active_faces[vertex] - 1];
+                        num_active_faces[vertex]--;
+                        break;
+                    }
+                }
+
+                bool is_repeat = (corner > 0 && vertex == corners[0]) || (corner > 1 && vertex == corners[1]);
+                if (!is_repeat) {
+                    new_cache[new_cache_length] = vertex;
+                    new_cache_length++;
+                }
+            }
+            for (int ii = 0; ii < cache_length; ii++) {
+                int vertex = cache[ii];
+                if ((vertex != corners[0]) && (vertex != corners[1]) && (vertex != corners[2])) {
+                    new_cache[new_cache_length] = vertex;
+                    new_cache_length++;
+                }
+            }
+
+            // Rescore the vertices that moved in or out of the cache, then the faces
+            // around them, and take the best of those faces next.
+            for (int ii = 0; ii < new_cache_length; ii++) {
+                int vertex = new_cache[ii];
+                cache_positions[vertex] = (ii < VERTEX_CACHE_SIZE) ? ii : -1;
+                vertex_scores[vertex] = get_vertex_score(cache_positions[vertex], num_active_faces[vertex]);
+            }
+
+            best_face = -1;
+            float best_score = 0.0;
+            for (int ii = 0; ii < new_cache_length; ii++) {
+                int vertex = new_cache[ii];
+                const int * faces = &vertex_faces[vertex_face_starts[vertex]];
+                for (int jj = 0; jj < num_active_faces[vertex]; jj++) {
+                    int face_i = faces[jj];
+                    face_scores[face_i] = get_face_score(&lod->faces[face_i], vertex_scores);
+                    if ((ii < VERTEX_CACHE_SIZE) && ((best_face < 0) || (face_scores[face_i] > best_score))) {
+                        best_face = face_i;
+                        best_score = face_scores[face_i];
+                    }
+                }
+            }
+
+            cache_length = (new_cache_length < VERTEX_CACHE_SIZE) ? new_cache_length : VERTEX_CACHE_SIZE;
+            memcpy(cache, new_cache, cache_length * sizeof(int));
+        }
+
+        // Number the vertices in the order the faces now use them.
+        int num_new_indices = 0;
+        for (int vertex_i = 0; vertex_i < num_vertices; vertex_i++) {
+            new_indices[vertex_i] = -1;
+        }
+        for (int face_i = 0; face_i < num_faces; face_i++) {
+            face_t * face = &ordered_faces[face_i];
+            int * corners[3] = { &face->a, &face->b, &face->c };
+            for (int corner = 0; corner < 3; corner++) {
+                if (new_indices[*corners[corner]] < 0) {
+                    new_indices[*corners[corner]] = num_new_indices;
+                    num_new_indices++;
+                }
+                *corners[corner] = new_indices[*corners[corner]];
+            }
+        }
+        for (int vertex_i = 0; vertex_i < num_vertices; vertex_i++) {
+            if (new_indices[vertex_i] < 0) {
+                new_indices[vertex_i] = num_new_indices;
+                num_new_indices++;
+            }
+        }
+
+        memcpy(old_vertices, lod->vertices, num_vertices * sizeof(vec3_t));
+        for (int vertex_i = 0; vertex_i < num_vertices; vertex_i++) {
+            lod->vertices[new_indices[vertex_i]] = old_vertices[vertex_i];
+        }
+        memcpy(lod->faces, ordered_faces, num_faces * sizeof(face_t));
+    }
+
+    free(vertex_face_starts);
+    free(vertex_faces);
+    free(num_active_faces);
+    free(cache_positions);
+    free(vertex_scores);
+    free(face_scores);
+    free(is_face_taken);
+    free(ordered_faces);
+    free(new_indices);
+    free(old_vertices);
+
+    return all_good;
+}
+
+/*/////////////////////////////////////////////////////////////////////////////
+// How well does this face order reuse vertices?
+///////////////////////////////////////////////////////////////////////////////
+// The average cache miss ratio (ACMR): how many vertices a FIFO cache of
+// VERTEX_CACHE_SIZE vertices misses for each face. 3 is no reuse at all, and a
+// big regular grid gets down to about 0.5.
+/////////////////////////////////////////////////////////////////////////////*/
+float get_vertex_cache_miss_ratio(face_t * faces)
+{
+    int num_faces = array_length(faces);
+    if (num_faces == 0) {
+        return 0.0;
+    }
+
+    int cache[VERTEX_CACHE_SIZE];
+    int cache_length = 0;
+    int next_slot = 0; // the oldest vertex, once the cache is full
+    int num_misses = 0;
+
+    for (int face_i = 0; face_i < num_faces; face_i++) {
+        int corners[3] = { faces[face_i].a, faces[face_i].b, faces[face_i].c };
+        for (int corner = 0; corner < 3; corner++) {
+            bool is_hit = false;
+            for (int ii = 0; ii < cache_length; ii++) {
+                if (cache[ii] == corners[corner]) {
+                    is_hit = true;
+                    break;
+                }
+            }
+            if (is_hit) {
+                continue;
+            }
+
+            num_misses++;
+            if (cache_length < VERTEX_CACHE_SIZE) {
+                cache[cache_length] = corners[corner];
+                cache_length++;
+            } else {
+                cache[next_slot] = corners[corner];
+                next_slot = (next_slot + 1) % VERTEX_CACHE_SIZE;
+            }
+        }
+    }
+
+    return (float)num_misses / num_faces;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stdbool.h>
+#include "mesh.h"
+
+// How many vertices the simulated post-transform cache holds, both when reordering
+// faces and when measuring how well an order reuses vertices.
+#define VERTEX_CACHE_SIZE (32)
+
+bool optimize_vertex_cache(mesh_lod_t * lod);
+float get_vertex_cache_miss_ratio(face_t * faces);